@@ -22,6 +22,7 @@ struct FreeLogEntry {
 
 struct FreeLog;
 void thread_gc(FreeLog *log);
+void grow_free_log(FreeLog *log);
 
 constexpr uint64_t GC_TICK_CYCLES = 0x100000;
 
@@ -29,39 +30,45 @@ inline uint64_t current_gc_tsc() { return _rdtsc() / GC_TICK_CYCLES; }
 
 struct alignas(CACHELINE_SIZE) FreeLog {
     // how many object should be pending for validation and free in one thread
-    // NOTE(kuriko): enlarged to avoid double-free
-    // static constexpr size_t MAX_SIZE = 4096;
-    static constexpr size_t MAX_SIZE = 2048;
+    // the log grows beyond this when objects are freed faster than validated
+    static constexpr size_t INIT_SIZE = 1024;
 
-    FreeLogEntry entries[MAX_SIZE];
+    FreeLogEntry *entries;
+    size_t capacity;
     size_t front;
     size_t back;
 
     FreeLog() {
+        capacity = INIT_SIZE;
+        entries = static_cast<FreeLogEntry *>(
+            malloc(capacity * sizeof(FreeLogEntry)));
         front = 0;
         back = 0;
     }
 
+    ~FreeLog() { free(entries); }
+
     void push(void *ptr) {
-    retry:
-        entries[back] = {ptr, current_gc_tsc()};
-        back = (back + 1) % MAX_SIZE;
         if (unlikely(full())) {
             // fprintf(stderr, "Full\n");
             thread_gc(this);
-            goto retry;
+            // every pending object may still be in use by an unvalidated
+            // closure: keep them all rather than overwriting the oldest
+            if (full()) grow_free_log(this);
         }
+        entries[back] = {ptr, current_gc_tsc()};
+        back = (back + 1) % capacity;
     }
 
-    void pop() { front = (front + 1) % MAX_SIZE; }
+    void pop() { front = (front + 1) % capacity; }
 
     const FreeLogEntry *peek() const { return entries + front; }
 
     bool empty() const { return front == back; }
 
-    bool full() const { return (back + 1) % MAX_SIZE == front; }
+    bool full() const { return (back + 1) % capacity == front; }
 
-    size_t size() const { return (back - front + MAX_SIZE) % MAX_SIZE; }
+    size_t size() const { return (back - front + capacity) % capacity; }
 };
 
 struct ClosureStartLog {
@@ -83,6 +90,9 @@ struct ClosureStartLog {
     uint64_t new_closure() {
         uint64_t tsc = current_gc_tsc();
         // fprintf(stderr, "new_closure tsc: %lu\n", tsc);
+        // start tracking at the first closure: a later first poll would take
+        // the current tsc, and free objects of closures still in flight
+        if (unlikely(earliest_tsc == 0)) poll_earliest_tsc();
         if (unlikely(tsc >= earliest_tsc + MAX_TSC_INTERVAL)) {
             poll_earliest_tsc();
             if (unlikely(tsc >= earliest_tsc + MAX_TSC_INTERVAL)) {
@@ -174,4 +184,25 @@ inline void thread_gc(FreeLog *log) {
     gc_instance->spin_lock.Unlock();
 }
 
+// double the capacity, under the lock of thread_gc() that pops concurrently
+inline void grow_free_log(FreeLog *log) {
+    auto *gc_instance = app_thread_gc_instance;
+    if (gc_instance == nullptr) {
+        gc_instance = &thread_gc_instance;
+    }
+    gc_instance->spin_lock.Lock();
+    size_t size = log->size();
+    auto *entries = static_cast<FreeLogEntry *>(
+        malloc(log->capacity * 2 * sizeof(FreeLogEntry)));
+    for (size_t i = 0; i < size; i++) {
+        entries[i] = log->entries[(log->front + i) % log->capacity];
+    }
+    free(log->entries);
+    log->entries = entries;
+    log->capacity *= 2;
+    log->front = 0;
+    log->back = size;
+    gc_instance->spin_lock.Unlock();
+}
+
 }  // namespace scee
@@ -2,6 +2,7 @@
 
 #include <boost/lockfree/spsc_queue.hpp>
 #include <cstddef>
+#include <cstdint>
 
 #include "compiler.hpp"
 
@@ -14,11 +15,14 @@ using LogQueue =
                                 boost::lockfree::capacity<LOG_QUEUE_CAPACITY>>;
 
 extern thread_local LogQueue log_queue;
+// logs pushed to log_queue, see wait_validation()
+extern thread_local uint64_t enqueued_logs;
 
 inline void log_enqueue(void *log) {
     while (!log_queue.push(log)) {
         cpu_relax();
     }
+    enqueued_logs++;
 }
 
 inline void *log_dequeue(LogQueue *q) {
@@ -54,6 +54,10 @@ private:
 template <typename F, typename... Args>
 auto main_thread(F &&f, Args &&...args);
 
+// wait until the validator of this app thread has validated every closure it
+// committed, e.g. before checking the outcome of a test
+void wait_validation();
+
 /* Internal Implementations */
 
 inline Thread::Thread() noexcept : thread() {}
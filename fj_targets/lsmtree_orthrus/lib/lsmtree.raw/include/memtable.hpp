@@ -21,7 +21,6 @@
 #include <vector>
 
 // namespace mt {
-// #include "mersenne-twister.h"
 // }
 
 
@@ -4,7 +4,6 @@
 
 // namespace NAMESPACE::lsmtree::rt {
 // namespace mt {
-// #include "mersenne-twister.h"
 // struct gen {
 //     gen() {
 //         mt::seed(114514);
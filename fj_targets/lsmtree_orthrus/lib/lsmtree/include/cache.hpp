@@ -1,53 +1,223 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
-#include <map>
+#include <vector>
 
 #include "consts.hpp"
-#include "lrucache.hpp"
+#include "spin_lock.hpp"
+#include "utils.hpp"
 
 namespace NAMESPACE::lsmtree {
 
-template <typename K, typename V>
-struct HashMapNode {
-    K key;
-    V value;
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
 };
 
-template <typename K, typename V>
-class HashMap {
-    using Node = HashMapNode<K, V>;
-    using Bucket = LRUCache<K, V>;
-
+// A sharded LRU cache of sst blocks, bounded by the block count. The blocks
+// live in the sst mappings; an entry records that the crc of its block has
+// been checked, and keeps the block pinned while in use.
+//
+// Each shard keeps a chained hash index and an LRU list under its own lock.
+// Lookup() and Insert() pin the entry and Release() unpins it; pinned
+// entries are never evicted. Validators read the mapping rather than the
+// entries, which the sst outlives, so evicted entries are freed at once.
+// Only used by the app.
+class BlockCache {
 public:
-    explicit HashMap(int capacity) : capacity_(capacity) {
-        buckets = new Bucket(0);
+    struct Entry {
+        CacheKey key;
+        BlkData* blk_data;
+
+        // only changed under the shard lock
+        Entry* hash_next = nullptr;
+        Entry* prev = nullptr;
+        Entry* next = nullptr;
+        int refs = 0;
+        bool in_cache = false;
+    };
+
+    BlockCache() = delete;
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    explicit BlockCache(size_t capacity) {
+        size_t const shard_capacity =
+            std::max<size_t>(1, capacity / BLK_CACHE_SHARDS);
+        size_t bucket_count = 1;
+        while (bucket_count < shard_capacity * 2) bucket_count <<= 1;
+        for (auto& shard : shards_) {
+            shard.capacity = shard_capacity;
+            shard.buckets.assign(bucket_count, nullptr);
+            shard.lru.prev = shard.lru.next = &shard.lru;
+        }
+    }
+
+    ~BlockCache() {
+        for (auto& shard : shards_) {
+            for (Entry* entry : shard.buckets) {
+                while (entry != nullptr) {
+                    Entry* next = entry->hash_next;
+                    Free(entry);
+                    entry = next;
+                }
+            }
+        }
+    }
+
+    // Returns the pinned entry of `key`, or nullptr on a miss.
+    Entry* Lookup(CacheKey key) {
+        Shard& shard = ShardOf(key);
+        shard.lock.Lock();
+        Entry* entry = *Find(shard, key);
+        if (entry != nullptr) {
+            entry->refs++;
+            Unlink(entry);
+            PushFront(shard, entry);
+            shard.stats.hits++;
+        } else {
+            shard.stats.misses++;
+        }
+        shard.lock.Unlock();
+        return entry;
     }
 
-    Retcode Get(K key, V* value) {
-        if (!data.contains(key)) {
-            return Retcode::NotFound;
+    // Inserts `blk_data` and returns its pinned entry. If another thread
+    // inserted the key first, `blk_data` is deleted and theirs is returned.
+    Entry* Insert(CacheKey key, BlkData* blk_data) {
+        Shard& shard = ShardOf(key);
+        shard.lock.Lock();
+        Entry** slot = Find(shard, key);
+        if (*slot != nullptr) {
+            Entry* entry = *slot;
+            entry->refs++;
+            shard.lock.Unlock();
+            delete blk_data;
+            return entry;
         }
 
-        auto ret = data[key];
-        *value = ret;
-        return Retcode::Found;
+        auto* entry = new Entry{.key = key, .blk_data = blk_data};
+        entry->refs = 1;
+        entry->in_cache = true;
+        *slot = entry;
+        PushFront(shard, entry);
+        shard.count++;
+
+        // evict from the cold end, skipping the pinned entries
+        Entry* victim = shard.lru.prev;
+        while (shard.count > shard.capacity && victim != &shard.lru) {
+            Entry* prev = victim->prev;
+            if (victim->refs == 0) {
+                Remove(shard, victim);
+                shard.stats.evictions++;
+            }
+            victim = prev;
+        }
+        shard.lock.Unlock();
+        return entry;
     }
 
-    Retcode Set(K key, const V& value) {
-        data.insert_or_assign(key, value);
-        return Retcode::Success;
+    void Release(Entry* entry) {
+        Shard& shard = ShardOf(entry->key);
+        shard.lock.Lock();
+        entry->refs--;
+        if (entry->refs == 0 && !entry->in_cache) {
+            // erased while pinned
+            Free(entry);
+        }
+        shard.lock.Unlock();
+    }
+
+    // Drops the block of `key`, if cached. A pinned one is freed on its last
+    // Release().
+    void Erase(CacheKey key) {
+        Shard& shard = ShardOf(key);
+        shard.lock.Lock();
+        if (Entry* entry = *Find(shard, key); entry != nullptr) {
+            Remove(shard, entry);
+        }
+        shard.lock.Unlock();
+    }
+
+    CacheStats Stats() {
+        CacheStats stats;
+        for (auto& shard : shards_) {
+            shard.lock.Lock();
+            stats.hits += shard.stats.hits;
+            stats.misses += shard.stats.misses;
+            stats.evictions += shard.stats.evictions;
+            shard.lock.Unlock();
+        }
+        return stats;
     }
 
 private:
-    Bucket* buckets;
+    struct alignas(CACHELINE_SIZE) Shard {
+        SpinLock lock;
+        std::vector<Entry*> buckets;
+        Entry lru;  // sentinel, the most recently used first
+        size_t count = 0;
+        size_t capacity = 0;
+        CacheStats stats;
+    };
+
+    static uint64_t Hash(CacheKey key) {
+        // murmur3 finalizer
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    Shard& ShardOf(CacheKey key) {
+        return shards_[Hash(key) & (BLK_CACHE_SHARDS - 1)];
+    }
+
+    static Entry** Find(Shard& shard, CacheKey key) {
+        size_t const mask = shard.buckets.size() - 1;
+        Entry** slot = &shard.buckets[(Hash(key) >> 32) & mask];
+        while (*slot != nullptr && (*slot)->key != key) {
+            slot = &(*slot)->hash_next;
+        }
+        return slot;
+    }
 
-    // TODO(kuriko): temp
-    std::map<K, V> data;
+    static void Unlink(Entry* entry) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+    }
+
+    static void PushFront(Shard& shard, Entry* entry) {
+        entry->prev = &shard.lru;
+        entry->next = shard.lru.next;
+        shard.lru.next->prev = entry;
+        shard.lru.next = entry;
+    }
+
+    // Takes `entry` out of the index, freeing it unless pinned.
+    static void Remove(Shard& shard, Entry* entry) {
+        Entry** slot = Find(shard, entry->key);
+        *slot = entry->hash_next;
+        Unlink(entry);
+        entry->in_cache = false;
+        shard.count--;
+        if (entry->refs == 0) {
+            Free(entry);
+        }
+    }
+
+    static void Free(Entry* entry) {
+        delete entry->blk_data;
+        delete entry;
+    }
 
-    const int capacity_;
+    Shard shards_[BLK_CACHE_SHARDS];
 };
 
 }  // namespace NAMESPACE::lsmtree
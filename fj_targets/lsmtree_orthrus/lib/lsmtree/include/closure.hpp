@@ -1,6 +1,20 @@
 int lsmtree_set(void *lsm, int64_t k, int64_t v);
 int64_t lsmtree_get(void *lsm, int64_t k);
 int lsmtree_del(void *lsm, int64_t k);
+// one step of a batch, returns the next `from`, see LSMTree::Write()
+int lsmtree_write(void *lsm, const void *batch, int from);
+// the same, with the lsn to pass to lsmtree_wal_wait() after the closure
+int lsmtree_set_logged(void *lsm, int64_t k, int64_t v, uint64_t *lsn);
+int lsmtree_del_logged(void *lsm, int64_t k, uint64_t *lsn);
+int lsmtree_write_logged(void *lsm, const void *batch, int from,
+                         uint64_t *lsn);
+void lsmtree_wal_wait(void *lsm, uint64_t lsn);
+uint64_t lsmtree_scan(void *lsm, int64_t start_key, int count, int64_t *keys,
+                      int64_t *values, int *found, int64_t *next_key);
+bool lsmtree_flush(void *lsm);
+bool lsmtree_flush_due(void *lsm);
+bool lsmtree_compact(void *lsm);
+bool lsmtree_compact_due(void *lsm);
 uint32_t lsmtree_get_as_crc32(void *lsm, int64_t k);
 double lsmtree_get_as_time(void *lsm, int64_t k);
 // using namespace lsmtree;
@@ -14,8 +14,9 @@ namespace NAMESPACE::lsmtree {
 #define IS_REPLICA false
 #endif
 
-#ifndef LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS
-#define LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS false
+// resume skiplist searches from the last one of the app thread
+#ifndef LSMTREE_ENABLE_SKIPLIST_FINGER
+#define LSMTREE_ENABLE_SKIPLIST_FINGER true
 #endif
 
 #ifndef LSMTREE_PROFILE_SKIPLIST_RDTSC
@@ -71,6 +72,8 @@ enum class Retcode {
 
     Empty,
 
+    Deleted,
+
     Fail = 255,
 };
 
@@ -155,54 +158,108 @@ constexpr KeyT SKIPLIST_KEY_INVALID = InvalidKey;
 constexpr int SKIPLIST_MAX_LEVEL = 12;
 constexpr int SKIPLIST_P_MASK = 0xFFFF;
 constexpr double SKIPLIST_P = 1.0/4.0;
+// stripe locks taken by concurrent updates of one key
+constexpr int SKIPLIST_UPDATE_STRIPES = 1024;
 
 // BlkCache consts
-constexpr int BLK_CACHE_MAX_COUNT = 1024;
+// A block is written by a single flush closure, which logs each entry it
+// reads, so it must stay well below the per-closure log budget.
+constexpr int BLK_CACHE_MAX_COUNT = 128;
 constexpr int BLK_CACHE_MAX_SIZE =
     BLK_CACHE_MAX_COUNT * sizeof(Data);  // 4KB aligned
-static_assert(BLK_CACHE_MAX_SIZE % 4 * 1024 == 0);
+static_assert(BLK_CACHE_MAX_SIZE % (4 * 1024) == 0);
+// blocks kept in the block cache, split over the shards
+constexpr size_t BLK_CACHE_CAPACITY = 4096;  // 16MiB
+constexpr int BLK_CACHE_SHARDS = 16;
+static_assert((BLK_CACHE_SHARDS & (BLK_CACHE_SHARDS - 1)) == 0);
 constexpr uint64_t MEMTABLE_MAX_SIZE = 512UL << 20;  // 512MiB
-constexpr int FILTER_BIT_SIZE = BLK_CACHE_MAX_COUNT;
+// about 1% false positives with three hashes
+constexpr int FILTER_BITS_PER_KEY = 10;
+constexpr int FILTER_BIT_SIZE = BLK_CACHE_MAX_COUNT * FILTER_BITS_PER_KEY;
+static_assert(FILTER_BIT_SIZE % (sizeof(uint32_t) * 8) == 0);
 
+// Immutable once built: made by make_obj in the flush closure, so the
+// validator checks it (and the crc of the block data) against its replay.
 struct BlkInfo {
     // key range
     KeyT blk_key_min = SKIPLIST_KEY_INVALID;
     KeyT blk_key_max = 0;  // int64_t but only positive part.
 
     // bloom filter
-    uint32_t filter[FILTER_BIT_SIZE / sizeof(uint32_t)];
+    uint32_t filter[FILTER_BIT_SIZE / (sizeof(uint32_t) * 8)];
 
     // blk meta data
-    int offset_in_sst = 0;
-    int count = 0;
-
-    // Blk status
-    bool in_cache = false;
+    int64_t offset_in_sst = 0;
+    int32_t count = 0;
+    uint32_t crc = 0;
 
     BlkInfo() { memset(filter, 0, sizeof(filter)); }
 };
+static_assert(std::has_unique_object_representations_v<BlkInfo>);
 
+// A block of an sst whose crc has been checked, pointing into the mapping.
 struct BlkData {
-    BlkInfo* blk_info = nullptr;
+    const BlkInfo* blk_info = nullptr;
 
-    Data* data;
+    const Data* data;
     int count;
-
-    ~BlkData() {
-        // FIXME(kuriko): I dont think this relationship is good.
-        delete data;
-        blk_info->in_cache = false;
-    }
 };
 
+// Compaction consts
+constexpr int LSM_MAX_LEVELS = 7;
+// L0 ssts overlap, so they are merged into L1 once there are this many
+constexpr int L0_COMPACTION_TRIGGER = 4;
+// each level past L1 may hold LEVEL_SIZE_MULTIPLIER times the previous one
+constexpr uint64_t L1_MAX_SIZE = 8UL << 20;  // 8MiB
+constexpr int LEVEL_SIZE_MULTIPLIER = 10;
+// compaction output is cut into ssts of this many blocks
+constexpr int SST_MAX_BLK_COUNT = 256;  // 1MiB
+// entries a compaction closure may consume while producing one block, as
+// dropped entries produce none
+constexpr int COMPACT_MAX_INPUT_COUNT = 4 * BLK_CACHE_MAX_COUNT;
+
 struct SstMeta {
+    uint64_t id;
     fs::path filepath;
+    FILE* file;  // while written, closed once mapped
+    const char* map = nullptr;  // read-only mapping of the finished sst
 
     KeyT key_min;
     KeyT key_max;
+    uint64_t size;  // bytes of data
+
+    std::vector<const BlkInfo*> blk_infos;
+};
 
-    std::vector<BlkInfo> blk_infos;
+// The ssts of each level, immutable once published: L0 overlapping with the
+// newest last, deeper levels sorted by key and non-overlapping.
+struct Version {
+    std::vector<const SstMeta*> levels[LSM_MAX_LEVELS];
 };
 
+// Scan consts
+// pairs a scan closure may visit, each logging a couple of memtable loads
+constexpr int SCAN_MAX_COUNT = 48;
+// blks read ahead of a scan in the sst mapping
+constexpr int SCAN_PREFETCH_BLK_COUNT = 4;
+
+// WriteBatch consts
+// ops applied by one closure of a batch: an insert into a memtable of
+// millions logs up to 1KB, within the 4KB guaranteed to a closure log
+constexpr int WRITE_BATCH_STEP_COUNT = 4;
+// ops of a batch, which stalls readers for its 16 closures at most
+constexpr int WRITE_BATCH_MAX_COUNT = 16 * WRITE_BATCH_STEP_COUNT;
+// the done count of LSMTree::batch_version_, above the in-flight count
+constexpr uint64_t WRITE_BATCH_DONE = uint64_t{1} << 16;
+// spins of a reader on a batch in flight, after which it yields in between
+constexpr int WRITE_BATCH_READ_SPINS = 64;
+
+// WAL consts
+// O_DIRECT writes are aligned to it
+constexpr size_t WAL_PAGE_SIZE = 4096;
+// the logger writes out its buffer once full, a multiple of the page size
+constexpr size_t WAL_BUFFER_SIZE = 1UL << 20;
+static_assert(WAL_BUFFER_SIZE % WAL_PAGE_SIZE == 0);
+
 using CacheKey = uint64_t;
 }  // namespace NAMESPACE::lsmtree
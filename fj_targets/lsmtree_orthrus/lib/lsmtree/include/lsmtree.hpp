@@ -1,12 +1,44 @@
 #pragma once
 
+#include <atomic>
+#include <thread>
+
 #include "memtable.hpp"
 #include "runtime.hpp"
+#include "spin_lock.hpp"
 #include "sstable.hpp"
+#include "wal.hpp"
 
 namespace NAMESPACE::lsmtree {
 
 namespace fs = std::filesystem;
+
+// Sets and deletes applied by LSMTree::Write(), WRITE_BATCH_STEP_COUNT per
+// closure, and logged as one WAL record group. Kept small by
+// WRITE_BATCH_MAX_COUNT, as readers wait for the whole batch.
+class WriteBatch {
+public:
+    // false once the batch is full
+    bool Put(KeyT key, ValueT value) { return Add(Data(key, value, false)); }
+    bool Delete(KeyT key) { return Add(Data(key, -1, true)); }
+    void Clear() { count_ = 0; }
+
+    int Count() const { return count_; }
+    const Data* ops() const { return ops_; }
+
+private:
+    bool Add(const Data& op) {
+        if (count_ == WRITE_BATCH_MAX_COUNT) {
+            return false;
+        }
+        ops_[count_++] = op;
+        return true;
+    }
+
+    Data ops_[WRITE_BATCH_MAX_COUNT];
+    int count_ = 0;
+};
+
 class LSMTree {
 public:
     LSMTree() = delete;
@@ -16,36 +48,141 @@ public:
     LSMTree& operator=(LSMTree&&) = delete;
 
 public:
-    explicit LSMTree(const fs::path& sst_dir);
+    // Unless `wal_mode` is None, writes are logged to sst_dir/wal and the
+    // ssts are listed in sst_dir/MANIFEST. The ssts of the manifest are then
+    // reopened, and the segments not yet flushed to them are replayed, into
+    // memtables flushed as they fill up. A flush removes the segments of
+    // its memtable.
+    explicit LSMTree(const fs::path& sst_dir,
+                     size_t memtable_max_size = MEMTABLE_MAX_SIZE,
+                     uint64_t l1_max_size = L1_MAX_SIZE,
+                     size_t blk_cache_capacity = BLK_CACHE_CAPACITY,
+                     WalMode wal_mode = WalMode::None);
 
     ValueT Get(KeyT key);
 
-    Retcode Set(KeyT key, ValueT value);
+    // *lsn, if given, gets the lsn of the WAL record, 0 if not logged; only
+    // the app writes it. In Sync mode the write is durable once WalWait(*lsn)
+    // returns, which the caller runs after the closure.
+    Retcode Set(KeyT key, ValueT value, uint64_t* lsn = nullptr);
+
+    Retcode Del(KeyT key, uint64_t* lsn = nullptr);
+
+    // One step of applying the ops of `batch` in order: the closure of step
+    // `from`, 0 first, applies up to WRITE_BATCH_STEP_COUNT ops and returns
+    // the next `from`, batch.Count() once done. The thread runs the steps
+    // back to back and keeps the batch until the last one; Get and Scan
+    // wait until then, and see all the ops or none. The batch is logged to
+    // the WAL by the first step, and replayed after a crash together. *lsn
+    // is the lsn of its last op, as for Set(), written by the first step.
+    int Write(const WriteBatch& batch, int from = 0, uint64_t* lsn = nullptr);
+
+    // Waits until the WAL record `lsn` is synced in Sync mode, outside of
+    // closures.
+    void WalWait(uint64_t lsn) { wal_.Wait(lsn); }
 
-    Retcode Del(KeyT key);
+    // Loads `count` pairs straight into ssts, outside of closures and with
+    // no write to their key range in flight: sorted by key in parallel, the
+    // last of equal keys kept, and written with their filters by `nthreads`
+    // threads. The ssts go to the deepest level that leaves them newer than
+    // the ones they overlap. Fails if mem_table_ holds a key in their range,
+    // or while immu_mem_table_ waits for its flush. Waits for a compaction
+    // in progress, which the thread running Compact() finishes first;
+    // Flush() and Compact() skip their sst steps until it is done.
+    // Not logged to the WAL: with a WAL the ssts are synced and in the
+    // manifest once it returns, so the pairs survive a crash from then on,
+    // and without one nothing does.
+    Retcode BulkLoad(const KeyT* keys, const ValueT* values, size_t count,
+                     int nthreads = std::thread::hardware_concurrency());
 
-    // void BulkLoad(std::span<KeyT> keys, std::span<ValueT> values) {
-    //     MYASSERT(keys.size() == values.size());
-    //     // FIXME(kuriko): use some real bulkload rather than insert one by
-    //     one. for (int i = 0; i < keys.size(); i++) {
-    //         Set(keys[i], values[i]);
-    //     }
-    // }
+    // Copies up to `count` live pairs with keys not less than `start_key` to
+    // `keys` and `values` in key order, visiting at most SCAN_MAX_COUNT
+    // pairs to bound the closure log. *found gets the pairs copied (-1 on a
+    // crc mismatch) and *next_key the key to resume from, InvalidKey at the
+    // end; only the app writes the outputs. Returns a rolling checksum of
+    // them, which the validator recomputes instead of logging each pair.
+    uint64_t Scan(KeyT start_key, int count, KeyT* keys, ValueT* values,
+                  int* found, KeyT* next_key);
 
-    // void BulkLoad(std::span<std::tuple<KeyT, ValueT>> data) {
-    //     // FIXME(kuriko): use some real bulkload rather than insert one by
-    //     one. for (auto [key, value] : data) {
-    //         Set(key, value);
-    //     }
-    // }
+    // One bounded step of flushing the immutable memtable: writes a block of
+    // its sst, or frees a batch of its nodes once the sst is in place.
+    // Returns false if there was nothing to do.
+    bool Flush();
+
+    // Whether Flush() has work to do, checked outside of closures.
+    bool FlushDue() const {
+        return immu_mem_table_->load_logless() != nullptr ||
+               reclaim_.tbl != nullptr;
+    }
+
+    // One bounded step of leveled compaction, see TblCache::Compact().
+    bool Compact();
+
+    // Whether Compact() has work to do, checked outside of closures.
+    bool CompactDue() const { return tbl_cache_.CompactDue(); }
+
+    // Prints the write amplification, the sst count of each level and the
+    // block cache hit rate.
+    void DumpStats(FILE* out);
+
+    // WAL records replayed when opened
+    uint64_t WalReplayed() const { return wal_.Replayed(); }
 
 private:
-    void ImmuMemTblFlush();
+    ValueT GetOnce(KeyT key);
+    uint64_t ScanOnce(KeyT start_key, int count, KeyT* keys, ValueT* values,
+                      int* found, KeyT* next_key);
+
+    // Waits for the batches in flight, returns batch_version_ for
+    // ReadValid().
+    uint64_t ReadBegin();
+    // Whether no batch started since ReadBegin() returned `version`.
+    bool ReadValid(uint64_t version);
 
-    void MemTblSwap();
+    // Flushes mem_table_ whole while the tree is opened, and releases the
+    // wal segments up to `wal_seg`. Raw only.
+    void ReplayFlush(uint64_t wal_seg);
+
+    // Counts `inserts` new nodes of p_tbl, and swaps it out once full.
+    void MemTblSwap(const MemTable* p_tbl, size_t inserts = 1);
+
+    // Registers a writer before it loads mem_table_, returns its slot.
+    int BeginWrite();
+    void EndWrite(int slot);
 
 private:
+    // A flushed memtable whose nodes are being freed, only changed by the app.
+    struct ReclaimState {
+        const MemTable* tbl = nullptr;
+        const SkipListNode* cursor = nullptr;  // next node to free
+    };
+
     const fs::path sst_dir_;
+    const size_t memtable_max_size_;
+
+    // rough memory usage of mem_table_, only changed by the app
+    std::atomic<size_t> mem_size_ = 0;
+    // bytes written by Set and Del, only changed by the app
+    std::atomic<uint64_t> user_bytes_ = 0;
+    // Taken by the writer that swaps mem_table_, which then bumps
+    // swap_epoch_. Set and Del count themselves in writers_ of the epoch
+    // parity they started in, so that the flush of the swapped out table
+    // waits for the writers that may still insert into it. App only.
+    SpinLock swap_lock_;
+    std::atomic<uint64_t> swap_epoch_ = 0;
+    std::atomic<int> writers_[2] = {};
+    // the last wal segment of immu_mem_table_, only changed by the app
+    uint64_t immu_wal_seg_ = 0;
+    // Batches in flight in the low bits, and done in the high ones, see
+    // WRITE_BATCH_DONE. Get and Scan read under it as under a seqlock, and
+    // retry if a batch ran in between. App only.
+    std::atomic<uint64_t> batch_version_ = 0;
+    // Held by BulkLoad(), and by the steps of Flush() and Compact() that
+    // change tbl_cache_. App only.
+    SpinLock bulk_lock_;
+    // BulkLoad() calls waiting for a compaction to finish
+    std::atomic<int> bulk_waiters_ = 0;
+    ReclaimState reclaim_;
 
     scee::ptr_t<MemTable>* mem_table_;
     scee::ptr_t<MemTable>* immu_mem_table_;
@@ -53,6 +190,9 @@ private:
     // MemTable* immu_mem_table_;
 
     TblCache tbl_cache_;
+
+    // made last, it replays into mem_table_
+    Wal wal_;
 };
 
 }  // namespace NAMESPACE::lsmtree
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 // #include <ranges>
 // #include <span>
@@ -17,15 +18,67 @@
 
 namespace NAMESPACE::lsmtree {
 
-struct SkipListNode {
-    KeyT key;
-    scee::ptr_t<Data>* data;
-    // Data* data;
+// A node is allocated with the links of its own level only, 64 bytes for
+// the three nodes in four of level 0. The data of the insert is kept inline,
+// and `data` points to it until the key is updated.
+struct SkipListNode : public scee::obj_header {
+    const Data inline_data;
+    // the current data, changed in place by the app like the links
+    const Data* data;
     const uint64_t level;
+    // only next[0 .. level] are allocated, the rest is for building a node
     const SkipListNode* next[SKIPLIST_MAX_LEVEL + 1];
 
     SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxt = nullptr);
-    SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxts[]);
+    SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxts[],
+                 bool is_delete = false);
+
+    static constexpr size_t Bytes(uint64_t level) {
+        return offsetof(SkipListNode, next) +
+               (level + 1) * sizeof(const SkipListNode*);
+    }
+
+    // for make_obj(), which copies only the allocated links
+    size_t size() const { return Bytes(level); }
+
+    void write_at(void* shadow, void* real, size_t size) const {
+        memcpy(shadow, this, size);
+        static_cast<SkipListNode*>(shadow)->data =
+            &static_cast<SkipListNode*>(real)->inline_data;
+    }
+
+    KeyT key() const { return inline_data.key; }
+
+    const Data* LoadData() const {
+        return rt::cache_read(std::atomic_ref(const_cast<SkipListNode*>(this)->data)
+                                  .load(std::memory_order_acquire));
+    }
+
+    void StoreData(const Data* p) const {
+        std::atomic_ref(const_cast<SkipListNode*>(this)->data)
+            .store(p, std::memory_order_release);
+    }
+
+    bool IsInline(const Data* p) const { return p == &inline_data; }
+
+    // The links are changed in place by the app, with a CAS once the node is
+    // reachable at that level, and never by the validator.
+    const SkipListNode* Next(int i) const {
+        return std::atomic_ref(const_cast<SkipListNode*>(this)->next[i])
+            .load(std::memory_order_acquire);
+    }
+
+    void SetNext(int i, const SkipListNode* p) const {
+        std::atomic_ref(const_cast<SkipListNode*>(this)->next[i])
+            .store(p, std::memory_order_relaxed);
+    }
+
+    bool CasNext(int i, const SkipListNode* expected,
+                 const SkipListNode* p) const {
+        return std::atomic_ref(const_cast<SkipListNode*>(this)->next[i])
+            .compare_exchange_strong(expected, p, std::memory_order_release,
+                                     std::memory_order_relaxed);
+    }
 
     static int get_random_level() {
         int lvl = 0;
@@ -38,6 +91,19 @@ struct SkipListNode {
     }
 };
 
+// A skiplist that many app threads insert into at once, in the style of
+// RocksDB's InlineSkipList. A new node is linked bottom-up with a CAS on
+// each level, and a failed CAS walks on from the old predecessor to the new
+// splice. Every CAS outcome and link read goes through the log, so the
+// validator replays the same walk and checks where the node was linked
+// without writing any link itself. Updates of an existing key take a stripe
+// lock in the app, so that the old data is freed once.
+//
+// Set, Del and Get start from a finger: the splice of the last search of the
+// app thread in the same table, from the lowest level where it still
+// precedes the key. Sequential keys then walk a node or two per level rather
+// than from the head. Only the app keeps fingers, the validator gets the
+// starting node from the log.
 class SkipList {
 public:
     SkipList(const SkipList&) = delete;
@@ -50,6 +116,12 @@ public:
     // void write_at(void *shadow, void *real, size_t size) const {};
     // void destroy() const {};
 
+    // rough memory usage of an inserted entry, a node of the mean height
+    // 1 / (1 - SKIPLIST_P) = 4 / 3 and its checksum
+    static constexpr size_t kNodeBytes = SkipListNode::Bytes(0) +
+                                         sizeof(const SkipListNode*) / 3 +
+                                         sizeof(checksum_t);
+
     SkipList();
 
     // ~SkipList() {
@@ -63,33 +135,79 @@ public:
 
     ValueT Get(KeyT key) const;
 
+    // Found, NotFound, or Deleted if the key has a tombstone here.
+    Retcode Get(KeyT key, ValueT* value) const;
+
     Retcode Set(KeyT key, ValueT value) const;
 
+    // Puts a tombstone, which shadows the key in older tables. Returns Insert
+    // or Update like Set.
     Retcode Del(KeyT key) const;
 
-    const SkipListNode* findCache(
-        const SkipListNode* p, const Data* p_data, int level, KeyT key) const;
-
-    void updateCache(int level, const SkipListNode* node) const;
-
     // size_t mem_size() const {
     //     auto ret = *mem_size_->load();
     //     return ret;
     // }
     // size_t count() const { return *count_->load(); }
 
-    SstMeta* dump_disk(const fs::path& filepath, FILE* file);
+    // The first entry node, and the end of the entries.
+    const SkipListNode* Begin() const { return rt::cache_read(head_->Next(0)); }
+    const SkipListNode* End() const { return tail_; }
+
+    // The first entry node with a key not less than `key`, or End().
+    const SkipListNode* Seek(KeyT key) const;
+
+    // Copies at most BLK_CACHE_MAX_COUNT entries from `p` on into `blk`,
+    // returns the first node not copied.
+    const SkipListNode* DumpBlock(const SkipListNode* p, Data* blk,
+                                  int* count) const;
+
+    // Frees at most `count` nodes from `p` on, starting at nullptr for the
+    // head. The table must be unreachable. Returns the next node to free, or
+    // nullptr once all nodes are freed; the table object is left to the caller.
+    const SkipListNode* Reclaim(const SkipListNode* p, int count) const;
+
+private:
+    Retcode Put(KeyT key, ValueT value, bool is_delete) const;
+
+    // Replaces the data of `p`, which is already linked.
+    Retcode Update(const SkipListNode* p, KeyT key, ValueT value,
+                   bool is_delete) const;
+
+    // Walks level `i` from `p` to the last node before `key`, which it
+    // returns, and sets *succ to the node after it.
+    const SkipListNode* FindSplice(const SkipListNode* p, KeyT key, int i,
+                                   const SkipListNode** succ) const;
+
+    int Height() const {
+        return rt::cache_read(
+            std::atomic_ref(*height_).load(std::memory_order_acquire));
+    }
+
+    // Frees a node, its data and its ptr cell after the grace period.
+    static void FreeNode(const SkipListNode* p);
+
+    // Where a search for `key` starts: a node preceding `key` on `level`,
+    // which is at least `min_level`.
+    struct Hint {
+        const SkipListNode* node;
+        int64_t level;
+    };
+    Hint FindHint(KeyT key, int height, int min_level = 0) const;
+    // Keeps the predecessors found on levels 0 .. `level` for the next search
+    // of the app thread. Unless `claim`, only if the finger is in this table.
+    void SaveFinger(const SkipListNode* const* update, int level,
+                    bool claim = true) const;
 
 private:
     SkipListNode* head_;
     SkipListNode* tail_;
 
-    scee::ptr_t<int>* level_;
-    // int* level_;
-
-#if (LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS)
-    scee::ptr_t<SkipListNode>* cache_access_[SKIPLIST_MAX_LEVEL + 1];
-#endif
+    // The highest level in use, only raised by the app with a CAS. Like the
+    // links, it is changed in place and read through rt::cache_read().
+    int* height_;
+    // unique among the tables, for the fingers into this one
+    uint64_t id_;
 
     // The actual count of elements in the SkipList
     // scee::ptr_t<size_t> *count_;
@@ -103,4 +221,31 @@ static_assert(std::has_unique_object_representations_v<SkipList>);
 // R;edefine the SkipList as MemTable.
 using MemTable = SkipList;
 
+// Walks the entries of a memtable in key order, from the first key not less
+// than the seek key on.
+class MemTableIter {
+public:
+    MemTableIter() = default;
+    MemTableIter(const MemTable* tbl, KeyT key) : tbl_(tbl), p_(tbl->Seek(key)) {
+        Load();
+    }
+
+    bool Valid() const { return tbl_ != nullptr && p_ != tbl_->End(); }
+    const Data& data() const { return data_; }
+
+    void Next() {
+        p_ = rt::cache_read(p_->Next(0));
+        Load();
+    }
+
+private:
+    void Load() {
+        if (Valid()) data_ = *p_->LoadData();
+    }
+
+    const MemTable* tbl_ = nullptr;
+    const SkipListNode* p_ = nullptr;
+    Data data_;
+};
+
 }  // namespace NAMESPACE::lsmtree
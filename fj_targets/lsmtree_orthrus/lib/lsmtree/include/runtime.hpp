@@ -18,6 +18,17 @@ inline T cache_read(T ptr) {
     return external_return(ptr);
 }
 
+// Reads app-only state that may change under a lagging validator: only the
+// app evaluates `fn`, the validator takes the logged result.
+template<typename F>
+inline auto app_read(F&& fn) {
+    decltype(fn()) ret{};
+    if constexpr (!is_validator()) {
+        ret = fn();
+    }
+    return external_return(ret);
+}
+
 // template<typename T>
 // inline void cache_write(T* ptr, const T& data) {
 //     if (!is_validator()) {
@@ -27,26 +38,23 @@ inline T cache_read(T ptr) {
 //     }
 // }
 
-inline size_t fread(void *ptr, size_t size, size_t count, FILE *stream) {
-    auto ret = 0;
-    struct Data {
-        void *buffer;
-        size_t size;
-    } log;
-    if (!is_validator()) {
-        // record the data
-        log.buffer = ::malloc(size * count);
-        log.size = size * count;
-        ret = ::fread(ptr, size, count, stream);
-        ::memcpy(log.buffer, ptr, size * count);
-        auto _ = external_return(log);
-    } else {
-        // Replay the fread
-        auto _ = external_return(log);
-        MYASSERT(log.size == size * count);
-        ::memcpy(ptr, log.buffer, log.size);
+// Reads `length` bytes of a read-only mapping found by `fn`, which only the
+// app evaluates. Only the address is logged, not the bytes: the validator
+// checks `crc` against the same mapped pages instead, and gets nullptr on a
+// mismatch.
+template <typename F>
+inline const void *mapped_read(F &&fn, size_t length, uint32_t crc) {
+    const void *addr = nullptr;
+    if constexpr (!is_validator()) {
+        addr = fn();
     }
-    return external_return(ret);
+    addr = external_return(addr);
+    if constexpr (is_validator()) {
+        if (kompute_crc32(addr, length) != crc) {
+            return nullptr;
+        }
+    }
+    return addr;
 }
 
 inline size_t fwrite(const void *ptr, size_t size, size_t count, FILE *stream) {
@@ -78,7 +86,7 @@ inline int fseek(FILE *stream, long offset, int whence) {
 
 inline int fflush(FILE *stream) {
     auto ret = 0;
-    if (is_validator()) {
+    if (!is_validator()) {
         ret = ::fflush(stream);
     }
     return external_return(ret);
@@ -1,20 +1,42 @@
 #pragma once
 
-#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <filesystem>
-#include <map>
 #include <vector>
 
 #include "cache.hpp"
 #include "consts.hpp"
 #include "hash.hpp"
+#include "memtable.hpp"
+#include "runtime.hpp"
 
 namespace NAMESPACE::lsmtree {
 
 namespace fs = std::filesystem;
 
+// Write amplification counters, only changed by the app.
+struct TblStats {
+    uint64_t flush_bytes = 0;
+    uint64_t compact_read_bytes = 0;
+    uint64_t compact_write_bytes = 0;
+    uint64_t compactions = 0;
+    uint64_t trivial_moves = 0;
+};
+
+// The ssts on disk, organized in levels.
+//
+// Flush and compaction (the maintenance) run in bounded closures, one output
+// block each, on one thread at a time, which may differ from the thread
+// serving Get. The published Version and the block cache are only read in
+// the app, through rt::app_read(). Retired versions and ssts are freed once
+// every closure that may still read them has been validated.
+//
+// A persistent TblCache records each installed version in sst_dir/MANIFEST,
+// with the WAL segments whose records are all in its ssts, and reopens the
+// ssts listed there on construction.
 class TblCache {
 public:
     TblCache() = delete;
@@ -24,154 +46,180 @@ public:
     TblCache& operator=(TblCache&&) = delete;
 
 public:
-    explicit TblCache(const fs::path& sst_dir)
-        : sst_dir_(std::move(sst_dir)), blk_cache_(BLK_CACHE_MAX_SIZE) {}
-
-    Retcode Get(KeyT key, ValueT* value) {
-        for (int sst_id = static_cast<int>(sst_metas_.size()) - 1; sst_id >= 0;
-             sst_id--) {
-            auto* p_sst_meta = sst_metas_[sst_id];
-
-            if (key < p_sst_meta->key_min || key > p_sst_meta->key_max) {
-                continue;
-            }
-
-            std::vector<BlkInfo>& blk_infos = p_sst_meta->blk_infos;
-
-            // Binary Search the blk
-            int l = 0;
-            int r = static_cast<int>(blk_infos.size()) - 1;
-            int blk_id = -1;
-            while (l <= r) {
-                const int mid = (l + r) / 2;
-                if (key < blk_infos[mid].blk_key_min) {
-                    r = mid - 1;
-                } else if (blk_infos[mid].blk_key_max < key) {
-                    l = mid + 1;
-                } else {
-                    blk_id = mid;
-                    break;
-                }
-            }
-
-            if (blk_id == -1) {
-                continue;
-            }
-
-            // Use bloom hash to quick check whether the key inside the sst blk
-            BlkInfo& blk_info = blk_infos[blk_id];
-            if (!IsFilterSetKey(blk_info.filter, key)) {
-                continue;
-            }
-
-            // Load the blk into cache
-            if (!blk_info.in_cache) {
-                // TODO(kuriko): implement this
-                CacheKey const cache_key = hash_key(sst_id, blk_id);
-                LoadBlkToCache(cache_key, p_sst_meta, &blk_info);
-            }
-
-            // Load data from cache
-            BlkData* blk_data = nullptr;
-            auto cache_key = hash_key(sst_id, blk_id);
-            blk_cache_.Get(cache_key, &blk_data);
-
-            #ifdef false
-                auto view = std::span(blk_data->data, blk_data->count);
-                auto it = std::ranges::lower_bound(
-                    view, key, {}, [](const Data& data) { return data.key; });
-                if (it == view.end() || it->key != key) {
-                    // KDEBUG("Not Found in Current Block");
-                    continue;
-                }
-            #else
-                auto it = std::lower_bound(
-                        blk_data->data,
-                        blk_data->data + blk_data->count,
-                        key,
-                        [](const Data& data, const int& key) {
-                            return data.key < key;
-                        }
-                    );
-
-                if (it >= blk_data->data + key || it->key != key) {
-                    // KDEBUG("Not Found in Current Block");
-                    continue;
-                }
-            #endif
-
-            auto is_delete = it->is_delete;
-
-            if (is_delete) {
-                *value = -1;
-                return Retcode::NotFound;
-            }
-
-            auto val = it->value;
-            *value = val;
-
-            return Retcode::Found;
-        }
-
-        return Retcode::NotFound;
-    }
-
-    void Add(MemTable* tbl) {
-        char sst_file_name[255];
-        sprintf(sst_file_name, "sst_%03lu.bin", *sst_num->load());
-        // KDEBUG("Flush %p => %s", tbl, sst_file_name);
-
-        fs::path filepath = sst_dir_ / sst_file_name;
-        FILE* file = fopen(filepath.c_str(), "wb+");
-
-        SstMeta* sst_meta = tbl->dump_disk(filepath, file);
-
-        // TODO(kuriko): reclaim memory.
-        // delete tbl;
-
-        sst_metas_.emplace_back(sst_meta);
-        sst_files_[sst_meta] = file;
-    }
+    TblCache(const fs::path& sst_dir, uint64_t l1_max_size,
+             size_t blk_cache_capacity, bool persistent = false);
+
+    Retcode Get(KeyT key, ValueT* value);
+
+    // Writes the next block of `tbl` to its sst. Returns true once all
+    // entries are written and the sst is visible to Get in L0, with the WAL
+    // segments up to `wal_seg` recorded as flushed.
+    bool FlushBlock(const MemTable* tbl, uint64_t wal_seg = 0);
+
+    // One step of compaction: picks the inputs, or merges them into the next
+    // output block, or installs the output. Returns false if nothing is due.
+    bool Compact();
+
+    // Whether Compact() has work to do, checked outside of closures.
+    bool CompactDue() const;
+
+    // Writes the pairs into new ssts with `nthreads` threads and installs
+    // them, see LSMTree::BulkLoad(). Raw only, with no compaction in
+    // progress.
+    void BulkLoad(const KeyT* keys, const ValueT* values, size_t count,
+                  int nthreads);
+
+    // Whether a compaction is in progress, between the steps of Compact().
+    bool Compacting() const { return compact_.active; }
+
+    // the last WAL segment whose records are all in the ssts, as recorded
+    // in the manifest
+    uint64_t WalCheckpoint() const { return wal_checkpoint_; }
+
+    const TblStats& Stats() const { return stats_; }
+
+    CacheStats BlkCacheStats() { return blk_cache_.Stats(); }
+
+    // sst count of each level
+    void LevelCounts(int counts[LSM_MAX_LEVELS]) const;
+
+    // Walks a sorted run of ssts in key order: one L0 sst, or a deeper level.
+    // The current blk stays pinned in the cache until the iterator leaves it,
+    // and the blks after it are prefetched from the mapping.
+    class Iterator {
+    public:
+        Iterator(TblCache* tbl_cache, const SstMeta* const* ssts,
+                 size_t sst_count, KeyT key);
+        Iterator(Iterator&& other) noexcept;
+        Iterator(const Iterator&) = delete;
+        Iterator& operator=(const Iterator&) = delete;
+        Iterator& operator=(Iterator&&) = delete;
+        ~Iterator();
+
+        bool Valid() const { return data_ != nullptr; }
+        // the validator found a blk whose crc does not match
+        bool Failed() const { return failed_; }
+        const Data& data() const { return data_[entry_]; }
+
+        void Next();
+
+    private:
+        void SetBlk(size_t sst_idx, int blk_idx);
+
+        TblCache* tbl_cache_;
+        const SstMeta* const* ssts_;
+        size_t sst_count_;
+
+        size_t sst_idx_ = 0;
+        int blk_idx_ = 0;
+        int entry_ = 0;
+        int count_ = 0;
+        const Data* data_ = nullptr;  // nullptr once the run is exhausted
+        BlockCache::Entry* pinned_ = nullptr;
+        bool failed_ = false;
+    };
+
+    // Positions an iterator at `key` on every sorted run, the newest first.
+    void Seek(KeyT key, std::vector<Iterator>* iters);
 
 private:
-    static CacheKey hash_key(int sst_id, int blk_id) {
-        // MYASSERT(blk_id < 0xFFFFFFFFFFFF);
-        // 64 = 16 + 48
-        // aka sst_id < 2**16, blk_id < 2**48
-        return (static_cast<CacheKey>(sst_id) << 48) | blk_id;
+    // An sst being written, one block per closure. Only changed by the app.
+    struct SstWriter {
+        SstMeta* sst = nullptr;
+        int64_t offset = 0;
+    };
+
+    // A sorted run merged by compaction: one L0 sst, or ssts of a deeper
+    // level in key order, with the position of the next entry. The current
+    // block stays pinned in the cache until the run moves past it.
+    struct MergeRun {
+        std::vector<const SstMeta*> ssts;
+        size_t sst_idx = 0;
+        int blk_idx = 0;
+        int entry_idx = 0;
+        BlockCache::Entry* pinned = nullptr;
+    };
+
+    // The current block of a run, as seen by a compaction closure.
+    struct RunPos {
+        const Data* data;  // nullptr once the run is exhausted
+        int32_t count;
+        int32_t entry;
+    };
+
+    // The compaction in progress, only changed by the app.
+    struct CompactState {
+        bool active = false;
+        int level = 0;  // the input level, the output goes one deeper
+        bool drop_tombstones = false;
+        std::vector<MergeRun> runs;  // newest first
+        std::vector<const SstMeta*> inputs;
+        std::vector<const SstMeta*> outputs;
+        SstWriter writer;
+    };
+
+    // Versions and ssts replaced at `tsc`, freed after the grace period.
+    struct Retired {
+        uint64_t tsc;
+        const Version* version;
+        std::vector<const SstMeta*> ssts;
+    };
+
+    static CacheKey hash_key(uint64_t sst_id, int blk_id) {
+        // 64 = 32 + 32
+        // aka sst_id < 2**32, blk_id < 2**32
+        return (static_cast<CacheKey>(sst_id) << 32) | blk_id;
     }
 
-    void LoadBlkToCache(CacheKey cache_key, SstMeta* sst_meta,
-                        BlkInfo* blk_info) {
-        FILE* file = sst_files_[sst_meta];
-        MYASSERT(file != nullptr);
+    uint64_t MaxLevelSize(int level) const;
 
-        fseek(file, blk_info->offset_in_sst, SEEK_SET);
+    Retcode GetFromSst(const SstMeta* p_sst_meta, KeyT key, ValueT* value);
 
-        Data* data = new Data[blk_info->count];
-        fread(data, sizeof(Data), blk_info->count, file);
+    // Creates the file of sst `id`, to be written by WriteBlock().
+    SstMeta* NewSst(uint64_t id) const;
+    // Builds the BlkInfo of `blk` and appends it to the writer's sst, which
+    // is created on the first block.
+    void WriteBlock(SstWriter* writer, const Data* blk, int count);
+    SstMeta* FinishSst(SstWriter* writer);
 
-        auto* blk_data = new BlkData{
-            .blk_info = blk_info,
-            .data = data,
-            .count = blk_info->count,
-        };
+    // Returns the pinned cache entry of the blk, checking its crc on a miss.
+    BlockCache::Entry* LoadBlk(const SstMeta* sst_meta, int blk_id);
+    // Asks the kernel to read ahead the blks from `blk_id` on.
+    void Prefetch(const SstMeta* sst_meta, int blk_id);
 
-        blk_cache_.Set(cache_key, blk_data);
+    // app only
+    bool PickCompaction();
+    RunPos RunPosition(int run_id);
+    RunPos AdvanceRun(int run_id);
+    void Install(const std::vector<const SstMeta*>& removed, int level,
+                 const std::vector<const SstMeta*>& added);
+    void Reclaim();
+    void DropSst(const SstMeta* sst_meta);
 
-        blk_info->in_cache = true;
-    }
+    // Replaces the manifest with one listing `version`, synced.
+    void WriteManifest(const Version* version) const;
+    // Reopens the ssts of the manifest, and removes the ones not listed.
+    void Recover();
 
 private:
     const fs::path sst_dir_;
+    const uint64_t l1_max_size_;
+    const bool persistent_;
+
+    uint64_t sst_num_ = 0;
+    uint64_t wal_checkpoint_ = 0;
+    std::atomic<const Version*> version_;
 
-    scee::ptr_t<size_t>* sst_num;
-    std::vector<SstMeta*> sst_metas_;
+    const SkipListNode* flush_cursor_ = nullptr;  // next node to write
+    SstWriter flush_writer_;
+    CompactState compact_;
+    // the largest key compacted out of each level, to pick the next sst
+    KeyT compact_pointer_[LSM_MAX_LEVELS] = {};
+    std::deque<Retired> retired_;
 
-    std::map<SstMeta*, FILE*> sst_files_;
+    TblStats stats_;
 
-    // TODO(kuriko): use scee compatible ds
-    HashMap<CacheKey, BlkData*> blk_cache_;
+    BlockCache blk_cache_;
 };
 
 }  // namespace NAMESPACE::lsmtree
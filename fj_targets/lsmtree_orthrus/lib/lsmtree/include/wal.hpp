@@ -0,0 +1,136 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "consts.hpp"
+#include "runtime.hpp"
+
+namespace NAMESPACE::lsmtree {
+
+namespace fs = std::filesystem;
+
+// Durability of Set and Del.
+enum class WalMode {
+    None,   // not logged
+    Async,  // logged and synced in the background
+    Sync,   // acknowledged once synced
+};
+
+// The write-ahead log: a segment per memtable, `<id>.wal` in the wal dir,
+// holding the Data records of its writes in order, and removed once the
+// memtable is flushed.
+//
+// Writers only queue their records. A logger thread writes each batch of
+// queued records with one write and one fdatasync (group commit), in whole
+// pages so that the segment can be opened with O_DIRECT, and rewrites the
+// last page with the next batch. The tail is zero padded, and a record whose
+// crc does not match ends the segment on replay. The records of a WriteBatch
+// follow a header record with their count, and are replayed all or none.
+//
+// Only the app logs: Append() is an external effect, whose lsn the
+// validator takes from the log without queueing anything.
+class Wal {
+public:
+    Wal() = delete;
+    Wal(const Wal&) = delete;
+    Wal& operator=(const Wal&) = delete;
+    Wal(Wal&&) = delete;
+    Wal& operator=(Wal&&) = delete;
+
+    // Removes the segments up to `checkpoint`, whose records are all in the
+    // ssts, and replays the ones after it by `replay` in order, with the id
+    // of the segment of each record; `replay` may Release() the segments
+    // before it. Then starts a new segment and the logger.
+    Wal(const fs::path& dir, WalMode mode, uint64_t checkpoint,
+        const std::function<void(const Data&, uint64_t)>& replay);
+    ~Wal();
+
+    // Queues a record, returns its lsn, or 0 if nothing is logged.
+    uint64_t Append(KeyT key, ValueT value, bool is_delete) {
+        return rt::app_read([&]() -> uint64_t {
+            if (mode_ == WalMode::None) {
+                return 0;
+            }
+            Data const rec(key, value, is_delete);
+            return Queue(&rec, 1, false);
+        });
+    }
+
+    // Queues the ops of a batch after its header, returns the lsn of the
+    // last one, or 0 if nothing is logged.
+    uint64_t AppendBatch(const Data* ops, int count) {
+        return rt::app_read([&]() -> uint64_t {
+            if (mode_ == WalMode::None) {
+                return 0;
+            }
+            return Queue(ops, count, true);
+        });
+    }
+
+    // Waits until the record `lsn` is synced in Sync mode. App only.
+    void Wait(uint64_t lsn);
+
+    // Ends the current segment after the records queued so far, returns its
+    // id. App only.
+    uint64_t Roll();
+
+    // Removes the segments up to `seg_id` once they are closed, after the
+    // ssts that hold their records are in the manifest. App only.
+    void Release(uint64_t seg_id);
+
+    // records replayed when opened
+    uint64_t Replayed() const { return replayed_; }
+
+private:
+    uint64_t Queue(const Data* recs, size_t count, bool batch);
+
+    void Run();
+    // Wakes the logger if it is idle, with mutex_ held by `lock`.
+    void Wake(std::unique_lock<std::mutex>& lock);
+    // Opens segment `seg_id` for the logger.
+    void Open(uint64_t seg_id);
+    // Copies records to the page buffer, writing out the full pages.
+    void Write(const Data* recs, size_t count);
+    // Writes the partial page too, padded with zeros, and syncs.
+    void Sync();
+    void Close();
+
+    fs::path SegPath(uint64_t seg_id) const;
+
+private:
+    const fs::path dir_;
+    const WalMode mode_;
+    uint64_t replayed_ = 0;
+
+    // Queued records and the positions in them where a segment ends, and
+    // the logger state, under mutex_. The logger is only woken when idle.
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable synced_cv_;
+    std::vector<Data> queue_;
+    std::vector<size_t> rolls_;
+    uint64_t last_lsn_ = 0;
+    uint64_t seg_id_ = 0;  // the segment being queued to
+    uint64_t synced_lsn_ = 0;
+    uint64_t release_seg_ = 0;
+    bool idle_ = false;
+    bool stop_ = false;
+
+    // only used by the logger
+    int fd_ = -1;
+    uint64_t fd_seg_ = 0;
+    char* buf_ = nullptr;  // WAL_BUFFER_SIZE, page aligned
+    size_t buf_len_ = 0;
+    int64_t buf_offset_ = 0;  // offset of buf_ in the segment
+    uint64_t removed_seg_ = 0;  // segments up to it are removed
+
+    std::thread logger_;
+};
+
+}  // namespace NAMESPACE::lsmtree
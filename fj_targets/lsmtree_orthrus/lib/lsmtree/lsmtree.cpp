@@ -1,6 +1,10 @@
 #include "lsmtree.hpp"
 
+#include <algorithm>
+#include <thread>
+
 #include "cache.hpp"
+#include "compiler.hpp"
 #include "consts.hpp"
 #include "memtable.hpp"
 #include "sstable.hpp"
@@ -34,6 +38,65 @@ int lsmtree_del(void *lsm, int64_t k) {
     return (int)tmp->Del(k);
 }
 
+int lsmtree_write(void *lsm, const void *batch, int from) {
+    sim_mutex2();
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->Write(*reinterpret_cast<const lsmtree::WriteBatch *>(batch),
+                      from);
+}
+
+int lsmtree_set_logged(void *lsm, int64_t k, int64_t v, uint64_t *lsn) {
+    sim_mutex2();
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return (int)tmp->Set(k, v, lsn);
+}
+
+int lsmtree_del_logged(void *lsm, int64_t k, uint64_t *lsn) {
+    sim_mutex2();
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return (int)tmp->Del(k, lsn);
+}
+
+int lsmtree_write_logged(void *lsm, const void *batch, int from,
+                         uint64_t *lsn) {
+    sim_mutex2();
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->Write(*reinterpret_cast<const lsmtree::WriteBatch *>(batch),
+                      from, lsn);
+}
+
+void lsmtree_wal_wait(void *lsm, uint64_t lsn) {
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    tmp->WalWait(lsn);
+}
+
+uint64_t lsmtree_scan(void *lsm, int64_t start_key, int count, int64_t *keys,
+                      int64_t *values, int *found, int64_t *next_key) {
+    sim_mutex2();
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->Scan(start_key, count, keys, values, found, next_key);
+}
+
+bool lsmtree_flush(void *lsm) {
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->Flush();
+}
+
+bool lsmtree_flush_due(void *lsm) {
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->FlushDue();
+}
+
+bool lsmtree_compact(void *lsm) {
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->Compact();
+}
+
+bool lsmtree_compact_due(void *lsm) {
+    auto *tmp = reinterpret_cast<lsmtree::LSMTree *>(lsm);
+    return tmp->CompactDue();
+}
+
 static __attribute__((target("sse4.2"))) uint32_t kompute_crc32_local(
 
     const void* data, std::size_t length) {
@@ -105,12 +168,34 @@ uint32_t lsmtree_get_as_crc32(void *lsm, int64_t k) {
 
 namespace NAMESPACE::lsmtree {
 
-LSMTree::LSMTree(const fs::path& sst_dir)
-    : sst_dir_(sst_dir), tbl_cache_(sst_dir) {
+LSMTree::LSMTree(const fs::path& sst_dir, size_t memtable_max_size,
+                 uint64_t l1_max_size, size_t blk_cache_capacity,
+                 WalMode wal_mode)
+    : sst_dir_(sst_dir),
+      memtable_max_size_(memtable_max_size),
+      mem_table_(scee::ptr_t<MemTable>::create(MemTable())),
+      immu_mem_table_(scee::ptr_t<MemTable>::create()),
+      tbl_cache_(sst_dir, l1_max_size, blk_cache_capacity,
+                 wal_mode != WalMode::None),
+      wal_(sst_dir / "wal", wal_mode, tbl_cache_.WalCheckpoint(),
+           [this](const Data& rec, uint64_t seg) {
+               if (mem_size_ > memtable_max_size_) {
+                   // `seg` is replayed again after a crash, into newer
+                   // memtables
+                   ReplayFlush(seg - 1);
+               }
+               const auto* p_tbl = mem_table_->load();
+               auto ret = rec.is_delete ? p_tbl->Del(rec.key)
+                                        : p_tbl->Set(rec.key, rec.value);
+               if (ret == Retcode::Insert) {
+                   mem_size_.fetch_add(MemTable::kNodeBytes);
+               }
+           }) {
     create_directories(sst_dir);
-
-    mem_table_ = scee::ptr_t<MemTable>::create(MemTable());
-    immu_mem_table_ = scee::ptr_t<MemTable>::create();
+    if (mem_size_ > 0) {
+        // the replayed segments all go, the writes start a new one
+        ReplayFlush(wal_.Roll());
+    }
     // mem_table_ = new MemTable();
     // immu_mem_table_ = nullptr;
 }
@@ -118,79 +203,447 @@ LSMTree::LSMTree(const fs::path& sst_dir)
 ValueT LSMTree::Get(KeyT key) {
     MYASSERT(mem_table_ != nullptr);
     sim_mutex2();
+    while (true) {
+        uint64_t const version = ReadBegin();
+        ValueT const value = GetOnce(key);
+        if (ReadValid(version)) {
+            return value;
+        }
+    }
+}
+
+ValueT LSMTree::GetOnce(KeyT key) {
+    ValueT value = -1;
     const auto *p_tbl = mem_table_->load();
     // const auto *p_tbl = mem_table_;
-    if (auto ret = p_tbl->Get(key); ret != -1) {
+    if (auto ret = p_tbl->Get(key, &value); ret != Retcode::NotFound) {
         // KDEBUG("mem_table found");
-        return ret;
+        return ret == Retcode::Found ? value : -1;
     }
 
     const auto *p_immu_tbl = immu_mem_table_->load();
     // auto *p_immu_tbl = immu_mem_table_;
-    if (p_immu_tbl == nullptr) {
-        return -1;
+    if (p_immu_tbl != nullptr) {
+        if (auto ret = p_immu_tbl->Get(key, &value); ret != Retcode::NotFound) {
+            // KDEBUG("immu_mem_table found");
+            return ret == Retcode::Found ? value : -1;
+        }
     }
 
-    if (auto ret = p_immu_tbl->Get(key); ret != -1) {
-        // KDEBUG("immu_mem_table found");
-        return ret;
+    // the flush publishes the sst before clearing immu_mem_table_
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (auto ret = tbl_cache_.Get(key, &value); ret == Retcode::Found) {
+        // KDEBUG("cache found");
+        return value;
     }
 
-    // TODO(kuriko): disable filesystem access
-    // if (auto ret = tbl_cache_.Get(key); ret != -1) {
-    //     // KDEBUG("cache found");
-    //     return ret;
-    // }
-
     // KDEBUG("Not Found Key: %ld", key);
     return -1;
 }
 
-Retcode LSMTree::Set(KeyT key, ValueT value) {
+static uint64_t ScanMix(uint64_t checksum, uint64_t v) {
+    checksum ^= v;
+    checksum *= 0x100000001b3ULL;  // FNV-1a prime
+    return checksum ^ (checksum >> 29);
+}
+
+uint64_t LSMTree::Scan(KeyT start_key, int count, KeyT* keys, ValueT* values,
+                       int* found, KeyT* next_key) {
     sim_mutex2();
+    while (true) {
+        uint64_t const version = ReadBegin();
+        uint64_t const checksum =
+            ScanOnce(start_key, count, keys, values, found, next_key);
+        if (ReadValid(version)) {
+            return checksum;
+        }
+    }
+}
+
+uint64_t LSMTree::ScanOnce(KeyT start_key, int count, KeyT* keys,
+                           ValueT* values, int* found, KeyT* next_key) {
+    // the sources, the newest first
+    MemTableIter mems[2];
+    int mem_count = 0;
+    mems[mem_count++] = MemTableIter(mem_table_->load(), start_key);
+    if (const auto* p_immu_tbl = immu_mem_table_->load(); p_immu_tbl) {
+        mems[mem_count++] = MemTableIter(p_immu_tbl, start_key);
+    }
+    // the flush publishes the sst before clearing immu_mem_table_
+    std::atomic_thread_fence(std::memory_order_acquire);
+    std::vector<TblCache::Iterator> runs;
+    tbl_cache_.Seek(start_key, &runs);
+
+    int const source_count = mem_count + static_cast<int>(runs.size());
+    auto valid = [&](int i) {
+        return i < mem_count ? mems[i].Valid() : runs[i - mem_count].Valid();
+    };
+    auto data = [&](int i) -> const Data& {
+        return i < mem_count ? mems[i].data() : runs[i - mem_count].data();
+    };
+    auto next = [&](int i) {
+        i < mem_count ? mems[i].Next() : runs[i - mem_count].Next();
+    };
+
+    int n = 0;
+    KeyT resume_key = InvalidKey;
+    bool failed = false;
+    uint64_t checksum = 0xcbf29ce484222325ULL;  // FNV-1a offset basis
+    for (int visits = 0; n < count && visits < SCAN_MAX_COUNT; visits++) {
+        int best = -1;
+        for (int i = 0; i < source_count; i++) {
+            if (!valid(i)) continue;
+            if (best == -1 || data(i).key < data(best).key) best = i;
+        }
+        if (best == -1) {
+            resume_key = InvalidKey;
+            break;
+        }
+
+        Data const d = data(best);
+        // the newest source wins, the older versions are skipped
+        for (int i = best; i < source_count; i++) {
+            if (valid(i) && data(i).key == d.key) next(i);
+        }
+        resume_key = d.key + 1;
+
+        if (!d.check_crc(d.key, d.value, d.is_delete)) {
+            failed = true;
+            break;
+        }
+        if (d.is_delete) {
+            continue;
+        }
+        if constexpr (!rt::is_validator()) {
+            keys[n] = d.key;
+            values[n] = d.value;
+        }
+        checksum = ScanMix(ScanMix(checksum, d.key), d.value);
+        n++;
+    }
+    for (const auto& run : runs) {
+        failed |= run.Failed();
+    }
+    if (failed) {
+        n = -1;
+    }
+
+    if constexpr (!rt::is_validator()) {
+        *found = n;
+        *next_key = resume_key;
+    }
+    return ScanMix(ScanMix(checksum, n), resume_key);
+}
+
+Retcode LSMTree::Set(KeyT key, ValueT value, uint64_t* lsn) {
+    sim_mutex2();
+    int const slot = BeginWrite();
     const auto *p_tbl = mem_table_->load();
     // auto *p_tbl = mem_table_;
-    // if (unlikely(p_tbl->mem_size() > MEMTABLE_MAX_SIZE)) {
-    //     MemTblSwap();
-    //     p_tbl = mem_table_->load();
-    // }
+    // logged after the load, so that the record is in the segment of p_tbl
+    // or a later one
+    uint64_t const rec_lsn = wal_.Append(key, value, false);
+    if constexpr (!rt::is_validator()) {
+        if (lsn != nullptr) *lsn = rec_lsn;
+    }
     auto ret = p_tbl->Set(key, value);
+    if constexpr (!rt::is_validator()) {
+        user_bytes_.fetch_add(sizeof(Data), std::memory_order_relaxed);
+    }
+    if (ret == Retcode::Insert) {
+        MemTblSwap(p_tbl);
+    }
+    EndWrite(slot);
     return ret;
 }
 
 
-Retcode LSMTree::Del(KeyT key) {
+Retcode LSMTree::Del(KeyT key, uint64_t* lsn) {
     sim_mutex2();
+    int const slot = BeginWrite();
     const auto *p_tbl = mem_table_->load();
     // auto *p_tbl = mem_table_;
-    return p_tbl->Del(key);
+    uint64_t const rec_lsn = wal_.Append(key, -1, true);
+    if constexpr (!rt::is_validator()) {
+        if (lsn != nullptr) *lsn = rec_lsn;
+        user_bytes_.fetch_add(sizeof(Data), std::memory_order_relaxed);
+    }
+    if (p_tbl->Del(key) == Retcode::Insert) {
+        MemTblSwap(p_tbl);
+    }
+    EndWrite(slot);
+    return Retcode::Success;
+}
+
+int LSMTree::Write(const WriteBatch& batch, int from, uint64_t* lsn) {
+    sim_mutex2();
+    int const count = rt::app_read([&] { return batch.Count(); });
+    if (count == 0) {
+        return 0;
+    }
+    int const end = std::min(from + WRITE_BATCH_STEP_COUNT, count);
+    int const slot = BeginWrite();
+    const auto *p_tbl = mem_table_->load();
+    if (from == 0) {
+        uint64_t const rec_lsn = wal_.AppendBatch(batch.ops(), count);
+        if constexpr (!rt::is_validator()) {
+            if (lsn != nullptr) *lsn = rec_lsn;
+            user_bytes_.fetch_add(count * sizeof(Data),
+                                  std::memory_order_relaxed);
+            // readers wait from the first op on, see ReadBegin()
+            batch_version_.fetch_add(1, std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+    }
+    size_t inserts = 0;
+    for (int i = from; i < end; i++) {
+        Data const op = rt::app_read([&] { return batch.ops()[i]; });
+        auto ret = op.is_delete ? p_tbl->Del(op.key)
+                                : p_tbl->Set(op.key, op.value);
+        inserts += ret == Retcode::Insert;
+    }
+    if (inserts > 0) {
+        MemTblSwap(p_tbl, inserts);
+    }
+    EndWrite(slot);
+    if constexpr (!rt::is_validator()) {
+        if (end == count) {
+            batch_version_.fetch_add(WRITE_BATCH_DONE - 1,
+                                     std::memory_order_release);
+        }
+    }
+    return end;
+}
+
+Retcode LSMTree::BulkLoad(const KeyT* keys, const ValueT* values,
+                          size_t count, int nthreads) {
+    if (count == 0) {
+        return Retcode::Success;
+    }
+    // no flush or compaction step runs until it is done, and no memtable
+    // is swapped out meanwhile; a compaction in progress is let finish, and
+    // no new one starts until then
+    bulk_waiters_.fetch_add(1);
+    bulk_lock_.Lock();
+    while (tbl_cache_.Compacting()) {
+        bulk_lock_.Unlock();
+        std::this_thread::yield();
+        bulk_lock_.Lock();
+    }
+    bulk_waiters_.fetch_sub(1);
+    swap_lock_.Lock();
+    Retcode ret = Retcode::Success;
+    // the ssts would shadow newer writes in the memtables
+    auto [key_min, key_max] = std::minmax_element(keys, keys + count);
+    const auto *p_tbl = mem_table_->load_logless();
+    const auto *p = p_tbl->Seek(*key_min);
+    if (immu_mem_table_->load_logless() != nullptr ||
+        (p != p_tbl->End() && p->key() <= *key_max)) {
+        ret = Retcode::Fail;
+    } else {
+        tbl_cache_.BulkLoad(keys, values, count, std::max(nthreads, 1));
+    }
+    swap_lock_.Unlock();
+    bulk_lock_.Unlock();
+    return ret;
+}
+
+bool LSMTree::Flush() {
+    // free the nodes of the last flushed memtable first, so that reclaim_ is
+    // free again when the current one is done
+    const auto *p_reclaim_tbl = rt::cache_read(reclaim_.tbl);
+    if (p_reclaim_tbl != nullptr) {
+        const auto *p = p_reclaim_tbl->Reclaim(rt::cache_read(reclaim_.cursor),
+                                               BLK_CACHE_MAX_COUNT);
+        if (p == nullptr) {
+            destroy_obj(const_cast<MemTable *>(p_reclaim_tbl));
+        }
+        if constexpr (!rt::is_validator()) {
+            reclaim_.cursor = p;
+            if (p == nullptr) reclaim_.tbl = nullptr;
+        }
+        return true;
+    }
+
+    const auto *p_immu_tbl = immu_mem_table_->load();
+    if (p_immu_tbl == nullptr) {
+        return false;
+    }
+    // wait for the writers that may still insert into it, and for a bulk
+    // load
+    bool const settled = rt::app_read([&] {
+        uint64_t const epoch = swap_epoch_.load();
+        return writers_[(epoch - 1) & 1].load() == 0 && bulk_lock_.TryLock();
+    });
+    if (!settled) {
+        return false;
+    }
+    uint64_t const wal_seg = rt::app_read([&] { return immu_wal_seg_; });
+    if (tbl_cache_.FlushBlock(p_immu_tbl, wal_seg)) {
+        // the sst is visible in the same closure, Get never misses the keys
+        std::atomic_thread_fence(std::memory_order_release);
+        immu_mem_table_->reref(nullptr);
+        if constexpr (!rt::is_validator()) {
+            reclaim_.tbl = p_immu_tbl;
+            reclaim_.cursor = nullptr;
+            // the manifest covers them now
+            wal_.Release(wal_seg);
+        }
+    }
+    if constexpr (!rt::is_validator()) {
+        bulk_lock_.Unlock();
+    }
+    return true;
+}
+
+bool LSMTree::Compact() {
+    bool const locked = rt::app_read([&] {
+        if (!bulk_lock_.TryLock()) {
+            return false;
+        }
+        // a waiting bulk load goes before the next compaction
+        if (bulk_waiters_.load() > 0 && !tbl_cache_.Compacting()) {
+            bulk_lock_.Unlock();
+            return false;
+        }
+        return true;
+    });
+    if (!locked) {
+        return false;
+    }
+    bool const ret = tbl_cache_.Compact();
+    if constexpr (!rt::is_validator()) {
+        bulk_lock_.Unlock();
+    }
+    return ret;
+}
+
+void LSMTree::DumpStats(FILE* out) {
+    const TblStats& stats = tbl_cache_.Stats();
+    uint64_t const user_bytes = user_bytes_.load(std::memory_order_relaxed);
+    uint64_t const written = stats.flush_bytes + stats.compact_write_bytes;
+    fprintf(out,
+            "user = %lu KB, flush = %lu KB, compaction = %lu KB read / %lu KB "
+            "written, write amplification = %.2f\n",
+            user_bytes / 1024, stats.flush_bytes / 1024,
+            stats.compact_read_bytes / 1024,
+            stats.compact_write_bytes / 1024,
+            user_bytes == 0 ? 0.0 : (double)written / user_bytes);
+
+    int counts[LSM_MAX_LEVELS];
+    tbl_cache_.LevelCounts(counts);
+    fprintf(out, "compactions = %lu, trivial moves = %lu, ssts =",
+            stats.compactions, stats.trivial_moves);
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+        fprintf(out, " L%d:%d", level, counts[level]);
+    }
+    fprintf(out, "\n");
+
+    CacheStats const cache = tbl_cache_.BlkCacheStats();
+    uint64_t const lookups = cache.hits + cache.misses;
+    fprintf(out,
+            "block cache hits = %lu, misses = %lu, hit rate = %.3f, "
+            "evictions = %lu\n",
+            cache.hits, cache.misses,
+            lookups == 0 ? 0.0 : (double)cache.hits / lookups, cache.evictions);
 }
 
-void LSMTree::ImmuMemTblFlush() {
-    // auto* p_immu_tbl = const_cast<MemTable*>(immu_mem_table_->load());
-    auto* p_immu_tbl = immu_mem_table_;
-    if (p_immu_tbl == nullptr) return;
-    // FIXME(kuriko): disable memdump
-    // tbl_cache_.Add(p_immu_tbl);
+// The reads of a Get or Scan that saw the same version here and in
+// ReadValid(), with no batch in flight, saw each batch whole or not at all.
+// A batch may be preempted between its closures, so the reader only spins
+// for a while, and then leaves the cpu to it.
+uint64_t LSMTree::ReadBegin() {
+    return rt::app_read([&] {
+        uint64_t version;
+        for (int spins = 0;
+             (version = batch_version_.load(std::memory_order_acquire)) &
+             (WRITE_BATCH_DONE - 1);
+             spins++) {
+            if (spins < WRITE_BATCH_READ_SPINS) {
+                cpu_relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        return version;
+    });
 }
 
-void LSMTree::MemTblSwap() {
+bool LSMTree::ReadValid(uint64_t version) {
+    return rt::app_read([&] {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return batch_version_.load(std::memory_order_relaxed) == version;
+    });
+}
+
+// Makes mem_table_ immutable once it exceeds the limit, unless the last one
+// is still being flushed. Of the writers that fill it up, the one that takes
+// swap_lock_ swaps it, the others go on inserting.
+void LSMTree::MemTblSwap(const MemTable* p_tbl, size_t inserts) {
     sim_mutex2();
-    const auto* p_tbl = mem_table_->load();
-    const auto* p_immu_tbl = immu_mem_table_->load();
-    // auto* p_tbl = mem_table_;
-    // auto* p_immu_tbl = immu_mem_table_;
-    if (p_immu_tbl != nullptr) {
-        // KDEBUG("flush immu memtable");
-        ImmuMemTblFlush();
+    bool const swap = rt::app_read([&] {
+        size_t const bytes = inserts * MemTable::kNodeBytes;
+        size_t const mem_size =
+            mem_size_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        if (mem_size <= memtable_max_size_ || !swap_lock_.TryLock()) {
+            return false;
+        }
+        if (mem_table_->load_logless() == p_tbl &&
+            immu_mem_table_->load_logless() == nullptr) {
+            return true;  // swap_lock_ is held until the swap is done
+        }
+        swap_lock_.Unlock();
+        return false;
+    });
+    if (!swap) {
+        return;
     }
     // KDEBUG("switching memtable");
+    if constexpr (!rt::is_validator()) {
+        // before the new table is visible, so that its records all follow
+        immu_wal_seg_ = wal_.Roll();
+    }
     immu_mem_table_->reref(p_tbl);
-    // immu_mem_table_ = p_tbl;
+    mem_table_->reref(scee::ptr_t<MemTable>::make_obj(MemTable()));
+    if constexpr (!rt::is_validator()) {
+        mem_size_.store(0, std::memory_order_relaxed);
+        swap_epoch_.fetch_add(1);
+        swap_lock_.Unlock();
+    }
+}
 
-    // KDEBUG("create new memtable");
-    mem_table_->store(MemTable());
-    // mem_table_= new MemTable();
+void LSMTree::ReplayFlush(uint64_t wal_seg) {
+    immu_wal_seg_ = wal_seg;
+    immu_mem_table_->reref(mem_table_->load());
+    mem_table_->reref(scee::ptr_t<MemTable>::make_obj(MemTable()));
+    mem_size_ = 0;
+    while (FlushDue()) {
+        Flush();
+    }
+}
+
+// A writer that saw the epoch unchanged after counting itself is seen by a
+// flush of a table swapped out after that epoch. Orders are seq_cst.
+int LSMTree::BeginWrite() {
+    int slot = 0;
+    if constexpr (!rt::is_validator()) {
+        while (true) {
+            uint64_t const epoch = swap_epoch_.load();
+            slot = epoch & 1;
+            writers_[slot].fetch_add(1);
+            if (swap_epoch_.load() == epoch) {
+                break;
+            }
+            writers_[slot].fetch_sub(1);
+        }
+    }
+    return slot;
+}
+
+void LSMTree::EndWrite(int slot) {
+    if constexpr (!rt::is_validator()) {
+        writers_[slot].fetch_sub(1);
+    }
 }
 
 }  // namespace NAMESPACE::lsmtree
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <cstddef>
 #include <tuple>
@@ -5,6 +6,7 @@
 // #include <ranges>
 // #include <span>
 
+#include "assertion.hpp"
 #include "compiler.hpp"
 #include "hash.hpp"
 #include "log.hpp"
@@ -15,6 +17,8 @@
 #include "runtime.hpp"
 #include "memtable.hpp"
 #include "consts.hpp"
+#include "spin_lock.hpp"
+#include "utils.hpp"
 
 namespace NAMESPACE::lsmtree {
 
@@ -24,78 +28,167 @@ __attribute__((noinline)) void sim_mutex() {
     return;
 }
 
+// Writers of one key take turns replacing its data, only in the app.
+struct alignas(CACHELINE_SIZE) UpdateStripe {
+    SpinLock lock;
+};
+static UpdateStripe g_update_stripes[SKIPLIST_UPDATE_STRIPES];
+
+static SpinLock& update_lock_of(KeyT key) {
+    // fibonacci hashing
+    uint64_t const h = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL;
+    return g_update_stripes[h >> 54].lock;
+}
+static_assert(SKIPLIST_UPDATE_STRIPES == 1 << (64 - 54));
+
+// The splice of the last search of an app thread, in the table `tbl`.
+// Nodes stay linked until their table is freed, and a table made later at
+// the same address has another id. The first table is made by the raw code,
+// whose ids start over, so a finger matches on both.
+struct Finger {
+    const SkipList* tbl = nullptr;
+    uint64_t tbl_id = 0;
+    const SkipListNode* prev[SKIPLIST_MAX_LEVEL + 1];
+};
+static thread_local Finger t_finger;
+static std::atomic<uint64_t> g_next_tbl_id{1};
+
 SkipListNode::SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxt)
-    : key(key), level(lvl) {
-    data = ptr_t<Data>::create({ key, value, false, });
+    : inline_data(key, value, false), data(nullptr), level(lvl) {
     memset(next, 0, sizeof(next));
     for (int i = 0; i <= lvl; i++) { next[i] = nxt; }
 }
 
-SkipListNode::SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxts[])
-    : key(key), level(lvl) {
-    data = ptr_t<Data>::create({ key, value, false, });
+SkipListNode::SkipListNode(KeyT key, ValueT value, int lvl, const SkipListNode* nxts[],
+                           bool is_delete)
+    : inline_data(key, value, is_delete), data(nullptr), level(lvl) {
     memset(next, 0, sizeof(next));
     for (int i = 0; i <= lvl; i++) { next[i] = nxts[i]; }
 }
 
 //=====================================================================
 SkipList::SkipList() {
-    level_ = ptr_t<int>::create(int(0));
-    // level_ = new int(0);
-    tail_ = new SkipListNode {SKIPLIST_KEY_INVALID, 0, 0, static_cast<SkipListNode*>(nullptr)};
-    head_ = new SkipListNode {SKIPLIST_KEY_INVALID, 0, SKIPLIST_MAX_LEVEL, tail_};
-    #if (LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS)
-        for (int i = 0; i <= SKIPLIST_MAX_LEVEL; i++) {
-            cache_access_[i] = scee::ptr_t<SkipListNode>::create(p_head);
-        }
-    #endif
+    height_ = const_cast<int*>(scee::ptr_t<int>::make_obj(0));
+    // made by make_obj so that a swap inside a closure gets the same nodes in
+    // the validator
+    tail_ = const_cast<SkipListNode*>(scee::ptr_t<SkipListNode>::make_obj(
+        {SKIPLIST_KEY_INVALID, 0, 0, static_cast<SkipListNode*>(nullptr)}));
+    head_ = const_cast<SkipListNode*>(scee::ptr_t<SkipListNode>::make_obj(
+        {SKIPLIST_KEY_INVALID, 0, SKIPLIST_MAX_LEVEL, tail_}));
+    id_ = rt::app_read([] { return g_next_tbl_id.fetch_add(1); });
 }
 
-const SkipListNode* SkipList::findCache(
-    const SkipListNode* p, const Data* p_data, int level, KeyT key) const {
-    #if (LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS)
-        const auto* last_visit_p = cache_access_[level]->load();
-        const auto* last_visit_p_data = last_visit_p->data->load();
-        if (p_data->key <= last_visit_p_data->key && last_visit_p_data->key < key) {
-            p = last_visit_p;
+SkipList::Hint SkipList::FindHint(KeyT key, int height, int min_level) const {
+    auto hint = rt::app_read([&] {
+    #if (LSMTREE_ENABLE_SKIPLIST_FINGER)
+        if (t_finger.tbl == this && t_finger.tbl_id == id_) {
+            auto brackets = [&](int i) {
+                const auto* p = t_finger.prev[i];
+                return (p == head_ || p->key() < key) &&
+                       p->Next(i)->key() >= key;
+            };
+            // The old splice widens going up, so the levels where it still
+            // brackets key are mostly the top ones: bisect for the lowest.
+            int lo = min_level;
+            int hi = height + 1;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (brackets(mid)) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            if (lo <= height) {
+                return Hint{t_finger.prev[lo], lo};
+            }
         }
     #endif
-    return p;
+        return Hint{head_, height};
+    });
+    validator_assert(hint.node == head_ || hint.node->key() < key);
+    validator_assert(static_cast<uint64_t>(hint.level) <= hint.node->level &&
+                     hint.level >= min_level && hint.level <= height);
+    return hint;
 }
 
-void SkipList::updateCache(int level, const SkipListNode* node) const {
-    #if (LSMTREE_ENABLE_SKIPLIST_CACHE_ACCESS)
-        cache_access_[level]->reref(node);
+void SkipList::SaveFinger(const SkipListNode* const* update, int level,
+                          bool claim) const {
+    #if (LSMTREE_ENABLE_SKIPLIST_FINGER)
+    if constexpr (!rt::is_validator()) {
+        if (t_finger.tbl != this || t_finger.tbl_id != id_) {
+            if (!claim) {
+                return;
+            }
+            t_finger.tbl = this;
+            t_finger.tbl_id = id_;
+            std::fill(std::begin(t_finger.prev), std::end(t_finger.prev), head_);
+        }
+        std::copy(update, update + level + 1, t_finger.prev);
+    }
     #endif
 }
 
 ValueT SkipList::Get(KeyT key) const {
+    ValueT value;
+    if (Get(key, &value) != Retcode::Found) {
+        return -1;
+    }
+    return value;
+}
+
+Retcode SkipList::Get(KeyT key, ValueT* value) const {
     sim_mutex();
 
-    auto level = *level_->load();
-    // auto level = *level_;
+    auto hint = FindHint(key, Height());
 
-    const auto* p = head_;
+    const SkipListNode* update[SKIPLIST_MAX_LEVEL + 1];
+    const auto* p = hint.node;
+    const SkipListNode* succ = nullptr;
+    for (int i = hint.level; i >= 0; i--) {
+        p = update[i] = FindSplice(p, key, i, &succ);
+    }
+    // reads of an older table leave the finger to the one being written
+    SaveFinger(update, hint.level, false);
+    p = succ;
+    if (p->key() != key) {
+        return Retcode::NotFound;
+    }
+    auto p_data = p->LoadData();
+    if (!p_data->check_crc(key, p_data->value, p_data->is_delete)) {
+        *value = -1;
+        return Retcode::Fail;
+    }
+    if (p_data->is_delete) {
+        return Retcode::Deleted;
+    }
+    *value = p_data->value;
+    return Retcode::Found;
+}
+
+const SkipListNode* SkipList::Seek(KeyT key) const {
+    auto level = Height();
 
+    const auto* p = head_;
+    const SkipListNode* succ = nullptr;
     for (int i = level; i >= 0; i--) {
-        while (true) {
-            const auto* p_next = rt::cache_read(p->next[i]);
-            if (p_next->key >= key) { break; }
-            p = p_next;
-        }
+        p = FindSplice(p, key, i, &succ);
     }
-    p = rt::cache_read(p->next[0]);
-    auto p_data = p->data->load();
-    // auto p_data = p->data;
-    if (p_data->key == key && !p_data->is_delete) {
-        if (p_data->check_crc(key, p_data->value, false))
-            return p_data->value;
-        else
-            return -1;
-    }
-    return -1;
+    return succ;
 }
 
+const SkipListNode* SkipList::FindSplice(const SkipListNode* p, KeyT key,
+                                         int i,
+                                         const SkipListNode** succ) const {
+    while (true) {
+        const auto* p_next = rt::cache_read(p->Next(i));
+        if (p_next->key() >= key) {
+            *succ = p_next;
+            return p;
+        }
+        p = p_next;
+    }
+}
 
 struct Stats {
     // Internal states size
@@ -141,6 +234,14 @@ struct Stats {
 } g_stat;
 
 Retcode SkipList::Set(KeyT key, ValueT value) const {
+    return Put(key, value, false);
+}
+
+Retcode SkipList::Del(KeyT key) const {
+    return Put(key, -1, true);
+}
+
+Retcode SkipList::Put(KeyT key, ValueT value, bool is_delete) const {
     sim_mutex();
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         uint64_t now = rdtsc();
@@ -148,50 +249,50 @@ Retcode SkipList::Set(KeyT key, ValueT value) const {
         uint64_t start = now;
     #endif
 
+    // the splice of each level: the last node before key, and the next one
     SkipListNode const* update[SKIPLIST_MAX_LEVEL + 1];
+    SkipListNode const* update_next[SKIPLIST_MAX_LEVEL + 1];
 
-    auto level = *level_->load();
-    // auto level = *level_;
+    auto level = Height();
+    auto hint = FindHint(key, level);
 
     // fprintf(stderr, "%s, level: %d\n", TO_STRING(NAMESPACE), level);
-    const auto* p = head_;
+    const auto* p = hint.node;
 
     int acc_cnt = 0;
-    for (int i = level; i >= 0; i--) {
+    for (int i = hint.level; i >= 0; i--) {
         while (true) {
             acc_cnt += 1;
-            // auto* p_next = p->next[i];
-            auto* p_next = rt::cache_read(p->next[i]);
+            auto* p_next = rt::cache_read(p->Next(i));
             // fprintf(stderr, "%s, p_next: %p\n", TO_STRING(NAMESPACE), p_next);
-            if (p_next->key >= key) { break; }
+            if (p_next->key() >= key) {
+                update_next[i] = p_next;
+                break;
+            }
             p = p_next;
         }
         update[i] = p;
     }
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
-        g_stat.g_acc_cnts.emplace_back(acc_cnt + 1);
+        g_stat.g_acc_cnts.emplace_back(acc_cnt);
     #endif
 
-    p = rt::cache_read(p->next[0]);
-    // p = p->next[0];
-    // fprintf(stderr, "%s, p: %p\n", TO_STRING(NAMESPACE), p);
-
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         now = rdtsc();
         g_stat.time_for += now - start;
         start = now;
     #endif
 
-    if (p->key == key) {
-        p->data->store({ key, value, false, });
+    if (update_next[0]->key() == key) {
+        SaveFinger(update, hint.level);
+        auto ret = Update(update_next[0], key, value, is_delete);
 
         #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
             now = rdtsc();
             g_stat.time_assign += now - start;
             g_stat.time_tot += now - start_0;
         #endif
-        // fprintf(stderr, "%s, ret: %d\n", TO_STRING(NAMESPACE), Retcode::Update);
-        return Retcode::Update;
+        return ret;
     }
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         now = rdtsc();
@@ -202,53 +303,68 @@ Retcode SkipList::Set(KeyT key, ValueT value) const {
     int lvl = SkipListNode::get_random_level();
     // fprintf(stderr, "%s, lvl: %d\n", TO_STRING(NAMESPACE), lvl);
     if (lvl > level) {
-        lvl = ++level;
-        level_->store(lvl);
-        // *level_ = lvl;
-        // fprintf(stderr, "%s, new lvl: %d\n", TO_STRING(NAMESPACE), lvl);
-        update[lvl] = head_;
+        lvl = level + 1;
+        if constexpr (!rt::is_validator()) {
+            // another writer may have raised it already
+            int height = level;
+            while (height < lvl &&
+                   !std::atomic_ref(*height_).compare_exchange_weak(
+                       height, lvl, std::memory_order_release)) {
+            }
+        }
     }
-    #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
-        now = rdtsc();
-        g_stat.time_random += now - start;
-        start = now;
-    #endif
-
-    const SkipListNode* update_next[SKIPLIST_MAX_LEVEL + 1];
-    for (int i = 0; i <= lvl; i++) {
-        // const auto* ptr = update[i]->next[i];
-        const auto* ptr = rt::cache_read(update[i]->next[i]);
-        // fprintf(stderr, "%s, ptr: %p\n", TO_STRING(NAMESPACE), ptr);
-        update_next[i] = ptr;
+    // The levels above the hint were not searched: walk them down from
+    // another hint at or above lvl, the new level included as nodes may have
+    // been linked there since it was raised.
+    int searched = hint.level;
+    if (lvl > hint.level) {
+        auto upper = FindHint(key, std::max(level, lvl), lvl);
+        p = upper.node;
+        for (int i = upper.level; i > hint.level; i--) {
+            p = update[i] = FindSplice(p, key, i, &update_next[i]);
+        }
+        searched = upper.level;
     }
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         now = rdtsc();
-        g_stat.time_update += now - start;
+        g_stat.time_random += now - start;
         start = now;
     #endif
 
     auto* new_node = scee::ptr_t<SkipListNode>::make_obj({
-        key, value, lvl, update_next,
+        key, value, lvl, update_next, is_delete,
     });
-    // SkipListNode* new_node = nullptr;
-    // if (!rt::is_validator()) {
-    //     new_node = new SkipListNode({
-    //         key, value, lvl, update_next,
-    //     });
-    // }
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         now = rdtsc();
         g_stat.time_malloc += now - start;
         start = now;
     #endif
 
-    if constexpr (!rt::is_validator()) {
-        // FIXME(kuriko): actually this should be a cache_write
-        for (auto i = lvl; i >= 0; i--) {
-            const auto* p = update[i];
-            const_cast<SkipListNode*>(p)->next[i] = new_node;
+    // Link bottom-up, so that the node is in the list once level 0 is linked.
+    // A failed CAS means another writer linked a node right after update[i]:
+    // walk on from there, the splice only moves forward.
+    for (int i = 0; i <= lvl; i++) {
+        while (!rt::app_read([&] {
+            return update[i]->CasNext(i, update_next[i], new_node);
+        })) {
+            update[i] = FindSplice(update[i], key, i, &update_next[i]);
+            if (i == 0 && update_next[0]->key() == key) {
+                // the other writer inserted the same key, new_node was never
+                // reachable
+                FreeNode(new_node);
+                SaveFinger(update, hint.level);
+                return Update(update_next[0], key, value, is_delete);
+            }
+            if constexpr (!rt::is_validator()) {
+                new_node->SetNext(i, update_next[i]);
+            }
         }
     }
+    // the new node precedes the next keys of a sequential run
+    for (int i = 0; i <= lvl; i++) {
+        update[i] = new_node;
+    }
+    SaveFinger(update, searched);
     #if (LSMTREE_PROFILE_SKIPLIST_RDTSC)
         now = rdtsc();
         g_stat.time_relink += now - start;
@@ -263,97 +379,60 @@ Retcode SkipList::Set(KeyT key, ValueT value) const {
     return Retcode::Insert;
 }
 
-Retcode SkipList::Del(KeyT key) const {
-    sim_mutex();
-    int const level = *level_->load();
-    const SkipListNode* p = head_;
-
-    for (int i = level; i >= 0; i--) {
-        while (true) {
-            auto* p_next = rt::cache_read(p->next[i]);
-            if (p_next->key >= key) { break; }
-            p = p_next;
-        }
+Retcode SkipList::Update(const SkipListNode* p, KeyT key, ValueT value,
+                         bool is_delete) const {
+    SpinLock& lock = update_lock_of(key);
+    if constexpr (!rt::is_validator()) {
+        lock.Lock();
     }
+    const Data* old = p->LoadData();
+    const Data* data = scee::ptr_t<Data>::make_obj({ key, value, is_delete, });
+    if constexpr (!rt::is_validator()) {
+        p->StoreData(data);
+        lock.Unlock();
+    }
+    // the inline data goes with the node
+    if (!p->IsInline(old)) {
+        destroy_obj(const_cast<Data*>(old));
+    }
+    return Retcode::Update;
+}
 
-    p = rt::cache_read(p->next[0]);
+const SkipListNode* SkipList::DumpBlock(const SkipListNode* p, Data* blk,
+                                        int* count) const {
+    int n = 0;
+    while (p != tail_ && n < BLK_CACHE_MAX_COUNT) {
+        blk[n++] = *p->LoadData();
+        p = rt::cache_read(p->Next(0));
+    }
+    *count = n;
+    return p;
+}
 
-    const auto* p_data = p->data->load();
-    if (unlikely(p_data->key != key)) {
-        return Retcode::NotFound;
+void SkipList::FreeNode(const SkipListNode* p) {
+    // Get may still be walking the memtable on another thread, so the node
+    // waits in the free log like its data
+    const Data* data = p->LoadData();
+    if (!p->IsInline(data)) {
+        destroy_obj(const_cast<Data*>(data));
     }
-    auto data_clone = *p_data;
-    data_clone.is_delete = true;
-    p->data->store(data_clone);
-    return Retcode::Success;
+    destroy_obj(const_cast<SkipListNode*>(p));
 }
 
-SstMeta* SkipList::dump_disk(const fs::path& filepath, FILE* file) {
-    return nullptr;
-    // // SstMeta* sst_meta = new SstMeta{
-    // //     .filepath = std::move(filepath),
-    // //     .key_min = std::numeric_limits<KeyT>::max(),
-    // //     .key_max = 0,
-    // // };
-
-    // // auto* sst_meta = scee::ptr_t<SstMeta>::create({
-    // //     .filepath = std::move(filepath),
-    // //     .key_min = std::numeric_limits<KeyT>::max(),
-    // //     .key_max = 0,
-    // // });
-
-    // // FIXME(kuriko): this will cause memory leak.
-    // auto* sst_meta = new SstMeta {
-    //     .filepath = std::move(filepath),
-    //     .key_min = std::numeric_limits<KeyT>::max(),
-    //     .key_max = 0,
-    // };
-
-    // BlkInfo blk_info;
-    // blk_info.blk_key_min = std::numeric_limits<KeyT>::max();
-    // blk_info.blk_key_max = 0;
-    // blk_info.offset_in_sst = 0;
-
-    // // SkipListNode const* p = head_->load()->next[0]->load();
-    // const SkipListNode* p = head_->load()->next.get()->v[0]->load();
-    // const auto* p_tail = tail_->load();
-    // while (p != p_tail) {
-    //     const auto* p_data = p->data->load();
-    //     auto key = p_data->key;
-
-    //     blk_info.blk_key_min = std::min(blk_info.blk_key_min, key);
-    //     blk_info.blk_key_max = std::max(blk_info.blk_key_max, key);
-    //     blk_info.count++;
-    //     FilterSetKey(blk_info.filter, key);
-
-    //     rt::fwrite(static_cast<void const*>(&p->data), sizeof(Data), 1, file);
-
-    //     // const auto* p_next = p->next[0]->load();
-    //     const auto* p_next = p->next.get()->v[0]->load();
-    //     if (blk_info.count >= BLK_CACHE_MAX_COUNT || p_next == p_tail) {
-    //         // KDEBUG(
-    //         //     "new blkinfo: id: %lu, offset_in_sst %u, blksz %u, min: "
-    //         //     "%ld, max: %ld",
-    //         //     sst_meta->blk_infos.size(), blk_info.offset_in_sst,
-    //         //     blk_info.count, blk_info.blk_key_min,
-    //         //     blk_info.blk_key_max);
-
-    //         sst_meta->key_min =
-    //             std::min(sst_meta->key_min, blk_info.blk_key_min);
-    //         sst_meta->key_max =
-    //             std::max(sst_meta->key_max, blk_info.blk_key_max);
-
-    //         sst_meta->blk_infos.emplace_back(blk_info);
-
-    //         blk_info = BlkInfo();
-    //         blk_info.offset_in_sst = static_cast<int>(rt::ftell(file));
-    //     }
-    //     p = p_next;
-    // }
-
-    // auto* ret = rt::cache_read(sst_meta);
-
-    // return ret;
+const SkipListNode* SkipList::Reclaim(const SkipListNode* p, int count) const {
+    if (p == nullptr) {
+        p = head_;
+    }
+    for (int i = 0; i < count; i++) {
+        const auto* p_next = rt::cache_read(p->Next(0));
+        FreeNode(p);
+        if (p == tail_) {
+            destroy_obj(height_);
+            return nullptr;
+        }
+        p = p_next;
+    }
+    return p;
 }
 
 }  // namespace NAMESPACE::lsmtree
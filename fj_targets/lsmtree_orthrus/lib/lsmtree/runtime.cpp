@@ -1,19 +1,24 @@
+#include <atomic>
 #include <iostream>
 #include <numeric>
+#include <random>
 #include "runtime.hpp"
 
 namespace NAMESPACE::lsmtree::rt {
 namespace mt {
-#include "mersenne-twister.h"
+// one generator per writer thread, seeded by the order threads first draw
+std::atomic<uint32_t> g_nthreads{0};
+
 struct gen {
-    gen() {
-        mt::seed(114514);
-    }
+    gen() : engine(114514 + g_nthreads.fetch_add(1)) {}
 
     uint32_t rand() {
-        return mt::rand_u32();
+        return engine();
     }
-} g_rnd;
+
+    std::mt19937 engine;
+};
+thread_local gen g_rnd;
 
 }
 
@@ -0,0 +1,912 @@
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "free_log.hpp"
+#include "sstable.hpp"
+
+namespace NAMESPACE::lsmtree {
+
+// L0 ssts merged by one compaction, the oldest ones
+constexpr int L0_MAX_COMPACT_COUNT = 2 * L0_COMPACTION_TRIGGER;
+constexpr uintptr_t PAGE_BYTES = 4096;
+// the first word of the manifest, "LSMMANI1"
+constexpr uint64_t MANIFEST_MAGIC = 0x31494e414d4d534cULL;
+
+static uint64_t LevelSize(const Version* version, int level) {
+    uint64_t size = 0;
+    for (const auto* sst_meta : version->levels[level]) {
+        size += sst_meta->size;
+    }
+    return size;
+}
+
+static bool Overlaps(const SstMeta* sst_meta, KeyT key_min, KeyT key_max) {
+    return sst_meta->key_min <= key_max && key_min <= sst_meta->key_max;
+}
+
+// The key range, filter and crc of the `count` entries of `blk`.
+static BlkInfo MakeBlkInfo(const Data* blk, int count, int64_t offset) {
+    BlkInfo blk_info;
+    blk_info.blk_key_min = blk[0].key;
+    blk_info.blk_key_max = blk[count - 1].key;
+    blk_info.offset_in_sst = offset;
+    blk_info.count = count;
+    blk_info.crc = kompute_crc32(blk, count * sizeof(Data));
+    for (int i = 0; i < count; i++) {
+        FilterSetKey(blk_info.filter, blk[i].key);
+    }
+    return blk_info;
+}
+
+static fs::path SstPath(const fs::path& sst_dir, uint64_t id) {
+    char sst_file_name[255];
+    sprintf(sst_file_name, "sst_%03lu.bin", id);
+    return sst_dir / sst_file_name;
+}
+
+// Runs fn(0) .. fn(nthreads - 1) on as many threads, the first on this one.
+template <typename F>
+static void RunThreads(int nthreads, const F& fn) {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; t++) {
+        threads.emplace_back(fn, t);
+    }
+    fn(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+TblCache::TblCache(const fs::path& sst_dir, uint64_t l1_max_size,
+                   size_t blk_cache_capacity, bool persistent)
+    : sst_dir_(sst_dir),
+      l1_max_size_(l1_max_size),
+      persistent_(persistent),
+      version_(new Version()),
+      blk_cache_(blk_cache_capacity) {
+    if (persistent_) {
+        Recover();
+    }
+}
+
+Retcode TblCache::Get(KeyT key, ValueT* value) {
+    const Version* version =
+        rt::app_read([&] { return version_.load(std::memory_order_acquire); });
+
+    // L0 ssts overlap, the newest first
+    const auto& l0 = version->levels[0];
+    for (int i = static_cast<int>(l0.size()) - 1; i >= 0; i--) {
+        if (auto ret = GetFromSst(l0[i], key, value); ret != Retcode::NotFound) {
+            return ret;
+        }
+    }
+
+    // at most one sst of a deeper level holds the key
+    for (int level = 1; level < LSM_MAX_LEVELS; level++) {
+        const auto& ssts = version->levels[level];
+        auto it = std::lower_bound(
+            ssts.begin(), ssts.end(), key,
+            [](const SstMeta* sst_meta, const KeyT& key) {
+                return sst_meta->key_max < key;
+            });
+        if (it == ssts.end()) {
+            continue;
+        }
+        if (auto ret = GetFromSst(*it, key, value); ret != Retcode::NotFound) {
+            return ret;
+        }
+    }
+
+    return Retcode::NotFound;
+}
+
+Retcode TblCache::GetFromSst(const SstMeta* p_sst_meta, KeyT key,
+                             ValueT* value) {
+    if (key < p_sst_meta->key_min || key > p_sst_meta->key_max) {
+        return Retcode::NotFound;
+    }
+
+    const auto& blk_infos = p_sst_meta->blk_infos;
+
+    // Binary Search the blk
+    int l = 0;
+    int r = static_cast<int>(blk_infos.size()) - 1;
+    int blk_id = -1;
+    while (l <= r) {
+        const int mid = (l + r) / 2;
+        if (key < blk_infos[mid]->blk_key_min) {
+            r = mid - 1;
+        } else if (blk_infos[mid]->blk_key_max < key) {
+            l = mid + 1;
+        } else {
+            blk_id = mid;
+            break;
+        }
+    }
+
+    if (blk_id == -1) {
+        return Retcode::NotFound;
+    }
+
+    // Use bloom hash to quick check whether the key inside the sst blk
+    const BlkInfo* blk_info = blk_infos[blk_id];
+    if (!IsFilterSetKey(blk_info->filter, key)) {
+        return Retcode::NotFound;
+    }
+
+    // Load data from cache, checking the blk on a miss. The blk stays pinned
+    // while the app reads it.
+    BlockCache::Entry* entry = nullptr;
+    const auto* data = static_cast<const Data*>(rt::mapped_read(
+        [&] {
+            entry = LoadBlk(p_sst_meta, blk_id);
+            return entry->blk_data->data;
+        },
+        blk_info->count * sizeof(Data), blk_info->crc));
+    if (data == nullptr) {
+        *value = -1;
+        return Retcode::Fail;
+    }
+
+    const auto* it = std::lower_bound(
+        data, data + blk_info->count, key,
+        [](const Data& data, const KeyT& key) { return data.key < key; });
+
+    Retcode ret = Retcode::Found;
+    if (it >= data + blk_info->count || it->key != key) {
+        // KDEBUG("Not Found in Current Block");
+        ret = Retcode::NotFound;
+    } else if (!it->check_crc(it->key, it->value, it->is_delete)) {
+        *value = -1;
+        ret = Retcode::Fail;
+    } else if (it->is_delete) {
+        *value = -1;
+        ret = Retcode::Deleted;
+    } else {
+        *value = it->value;
+    }
+
+    if constexpr (!rt::is_validator()) {
+        blk_cache_.Release(entry);
+    }
+    return ret;
+}
+
+bool TblCache::FlushBlock(const MemTable* tbl, uint64_t wal_seg) {
+    if constexpr (!rt::is_validator()) {
+        Reclaim();
+    }
+
+    const SkipListNode* p = rt::cache_read(flush_cursor_);
+    if (p == nullptr) {
+        p = tbl->Begin();
+        if (p == tbl->End()) {
+            return true;
+        }
+    }
+
+    Data blk[BLK_CACHE_MAX_COUNT];
+    int count = 0;
+    p = tbl->DumpBlock(p, blk, &count);
+    WriteBlock(&flush_writer_, blk, count);
+
+    bool const done = p == tbl->End();
+    if constexpr (!rt::is_validator()) {
+        stats_.flush_bytes += count * sizeof(Data);
+        flush_cursor_ = done ? nullptr : p;
+        if (done) {
+            wal_checkpoint_ = std::max(wal_checkpoint_, wal_seg);
+            Install({}, 0, {FinishSst(&flush_writer_)});
+        }
+    }
+    return done;
+}
+
+bool TblCache::Compact() {
+    if constexpr (!rt::is_validator()) {
+        Reclaim();
+    }
+
+    if (!rt::cache_read(compact_.active)) {
+        return rt::app_read([&] { return PickCompaction(); });
+    }
+
+    int const run_count =
+        rt::app_read([&] { return static_cast<int>(compact_.runs.size()); });
+    bool const drop_tombstones = rt::cache_read(compact_.drop_tombstones);
+
+    RunPos pos[L0_MAX_COMPACT_COUNT + 1];
+    MYASSERT(run_count <= L0_MAX_COMPACT_COUNT + 1);
+    for (int i = 0; i < run_count; i++) {
+        pos[i] = rt::app_read([&] { return RunPosition(i); });
+    }
+
+    // k-way merge into one block: the newest run wins on equal keys, and
+    // the older versions of the key are dropped
+    Data blk[BLK_CACHE_MAX_COUNT];
+    int count = 0;
+    int consumed = 0;
+    bool done = false;
+    while (count < BLK_CACHE_MAX_COUNT && consumed < COMPACT_MAX_INPUT_COUNT) {
+        int best = -1;
+        for (int i = 0; i < run_count; i++) {
+            if (pos[i].data == nullptr) continue;
+            if (best == -1 || pos[i].data[pos[i].entry].key <
+                                  pos[best].data[pos[best].entry].key) {
+                best = i;
+            }
+        }
+        if (best == -1) {
+            done = true;
+            break;
+        }
+
+        Data const data = pos[best].data[pos[best].entry];
+        // newer runs than `best` are past this key already
+        for (int i = best; i < run_count; i++) {
+            if (pos[i].data == nullptr ||
+                pos[i].data[pos[i].entry].key != data.key) {
+                continue;
+            }
+            consumed++;
+            if (++pos[i].entry == pos[i].count) {
+                pos[i] = rt::app_read([&] { return AdvanceRun(i); });
+            }
+        }
+
+        if (data.is_delete && drop_tombstones) {
+            continue;
+        }
+        blk[count++] = data;
+    }
+    if (!done) {
+        done = std::all_of(pos, pos + run_count,
+                           [](const RunPos& p) { return p.data == nullptr; });
+    }
+
+    if (count > 0) {
+        WriteBlock(&compact_.writer, blk, count);
+    }
+
+    if constexpr (!rt::is_validator()) {
+        for (int i = 0; i < run_count; i++) {
+            compact_.runs[i].entry_idx = pos[i].entry;
+        }
+        stats_.compact_read_bytes += consumed * sizeof(Data);
+        stats_.compact_write_bytes += count * sizeof(Data);
+
+        SstWriter* writer = &compact_.writer;
+        if (writer->sst != nullptr &&
+            (done || writer->sst->blk_infos.size() >= SST_MAX_BLK_COUNT)) {
+            compact_.outputs.emplace_back(FinishSst(writer));
+        }
+        if (done) {
+            Install(compact_.inputs, compact_.level + 1, compact_.outputs);
+            stats_.compactions++;
+            compact_ = CompactState();
+        }
+    }
+    return true;
+}
+
+bool TblCache::CompactDue() const {
+    if (compact_.active) {
+        return true;
+    }
+    const Version* version = version_.load(std::memory_order_acquire);
+    if (version->levels[0].size() >= L0_COMPACTION_TRIGGER) {
+        return true;
+    }
+    for (int level = 1; level < LSM_MAX_LEVELS - 1; level++) {
+        if (LevelSize(version, level) > MaxLevelSize(level)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TblCache::LevelCounts(int counts[LSM_MAX_LEVELS]) const {
+    const Version* version = version_.load(std::memory_order_acquire);
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+        counts[level] = static_cast<int>(version->levels[level].size());
+    }
+}
+
+void TblCache::Seek(KeyT key, std::vector<Iterator>* iters) {
+    const Version* version =
+        rt::app_read([&] { return version_.load(std::memory_order_acquire); });
+
+    const auto& l0 = version->levels[0];
+    iters->reserve(l0.size() + LSM_MAX_LEVELS);
+    for (int i = static_cast<int>(l0.size()) - 1; i >= 0; i--) {
+        iters->emplace_back(this, &l0[i], 1, key);
+    }
+    for (int level = 1; level < LSM_MAX_LEVELS; level++) {
+        const auto& ssts = version->levels[level];
+        if (!ssts.empty()) {
+            iters->emplace_back(this, ssts.data(), ssts.size(), key);
+        }
+    }
+}
+
+TblCache::Iterator::Iterator(TblCache* tbl_cache, const SstMeta* const* ssts,
+                             size_t sst_count, KeyT key)
+    : tbl_cache_(tbl_cache), ssts_(ssts), sst_count_(sst_count) {
+    // the first sst and blk that may hold keys not less than `key`
+    const auto* sst = std::lower_bound(
+        ssts, ssts + sst_count, key,
+        [](const SstMeta* sst_meta, const KeyT& key) {
+            return sst_meta->key_max < key;
+        });
+    if (sst == ssts + sst_count) {
+        return;
+    }
+    const auto& blk_infos = (*sst)->blk_infos;
+    auto blk = std::lower_bound(
+        blk_infos.begin(), blk_infos.end(), key,
+        [](const BlkInfo* blk_info, const KeyT& key) {
+            return blk_info->blk_key_max < key;
+        });
+    SetBlk(sst - ssts, blk - blk_infos.begin());
+    if (data_ != nullptr) {
+        entry_ = std::lower_bound(data_, data_ + count_, key,
+                                  [](const Data& data, const KeyT& key) {
+                                      return data.key < key;
+                                  }) -
+                 data_;
+    }
+}
+
+TblCache::Iterator::Iterator(Iterator&& other) noexcept
+    : tbl_cache_(other.tbl_cache_),
+      ssts_(other.ssts_),
+      sst_count_(other.sst_count_),
+      sst_idx_(other.sst_idx_),
+      blk_idx_(other.blk_idx_),
+      entry_(other.entry_),
+      count_(other.count_),
+      data_(other.data_),
+      pinned_(other.pinned_),
+      failed_(other.failed_) {
+    other.pinned_ = nullptr;
+}
+
+TblCache::Iterator::~Iterator() {
+    if constexpr (!rt::is_validator()) {
+        if (pinned_ != nullptr) tbl_cache_->blk_cache_.Release(pinned_);
+    }
+}
+
+void TblCache::Iterator::Next() {
+    if (++entry_ < count_) {
+        return;
+    }
+    if (blk_idx_ + 1 <
+        static_cast<int>(ssts_[sst_idx_]->blk_infos.size())) {
+        SetBlk(sst_idx_, blk_idx_ + 1);
+    } else {
+        SetBlk(sst_idx_ + 1, 0);
+    }
+}
+
+void TblCache::Iterator::SetBlk(size_t sst_idx, int blk_idx) {
+    if constexpr (!rt::is_validator()) {
+        if (pinned_ != nullptr) tbl_cache_->blk_cache_.Release(pinned_);
+    }
+    pinned_ = nullptr;
+    sst_idx_ = sst_idx;
+    blk_idx_ = blk_idx;
+    entry_ = 0;
+    if (sst_idx >= sst_count_) {
+        data_ = nullptr;
+        return;
+    }
+
+    const SstMeta* sst_meta = ssts_[sst_idx];
+    const BlkInfo* blk_info = sst_meta->blk_infos[blk_idx];
+    data_ = static_cast<const Data*>(rt::mapped_read(
+        [&] {
+            pinned_ = tbl_cache_->LoadBlk(sst_meta, blk_idx);
+            tbl_cache_->Prefetch(sst_meta, blk_idx + 1);
+            return pinned_->blk_data->data;
+        },
+        blk_info->count * sizeof(Data), blk_info->crc));
+    count_ = blk_info->count;
+    if (data_ == nullptr) {
+        failed_ = true;
+    }
+}
+
+void TblCache::BulkLoad(const KeyT* keys, const ValueT* values, size_t count,
+                        int nthreads) {
+    MYASSERT(!compact_.active);
+
+    // each thread sorts a slice, then neighbouring slices are merged in
+    // rounds, the earlier one first among equal keys
+    using Pair = std::pair<KeyT, ValueT>;
+    auto by_key = [](const Pair& a, const Pair& b) { return a.first < b.first; };
+    std::vector<Pair> pairs(count);
+    std::vector<size_t> bounds(nthreads + 1);
+    for (int t = 0; t <= nthreads; t++) {
+        bounds[t] = count * t / nthreads;
+    }
+    RunThreads(nthreads, [&](int t) {
+        for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+            pairs[i] = {keys[i], values[i]};
+        }
+        std::stable_sort(pairs.begin() + bounds[t],
+                         pairs.begin() + bounds[t + 1], by_key);
+    });
+    for (int width = 1; width < nthreads; width *= 2) {
+        RunThreads((nthreads + 2 * width - 1) / (2 * width), [&](int m) {
+            int const lo = 2 * width * m;
+            int const mid = std::min(lo + width, nthreads);
+            int const hi = std::min(lo + 2 * width, nthreads);
+            std::inplace_merge(pairs.begin() + bounds[lo],
+                               pairs.begin() + bounds[mid],
+                               pairs.begin() + bounds[hi], by_key);
+        });
+    }
+    // the last of equal keys wins, like repeated Sets
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n > 0 && pairs[n - 1].first == pairs[i].first) {
+            n--;
+        }
+        pairs[n++] = pairs[i];
+    }
+
+    // right above the shallowest level with overlapping ssts, which then
+    // stay older, or the bottom level
+    const Version* version = version_.load(std::memory_order_acquire);
+    KeyT const key_min = pairs[0].first;
+    KeyT const key_max = pairs[n - 1].first;
+    int level = LSM_MAX_LEVELS - 1;
+    for (int l = 0; l < LSM_MAX_LEVELS; l++) {
+        const auto& ssts = version->levels[l];
+        if (std::any_of(ssts.begin(), ssts.end(), [&](const SstMeta* sst_meta) {
+                return Overlaps(sst_meta, key_min, key_max);
+            })) {
+            level = std::max(l - 1, 0);
+            break;
+        }
+    }
+
+    size_t const sst_entries =
+        static_cast<size_t>(SST_MAX_BLK_COUNT) * BLK_CACHE_MAX_COUNT;
+    size_t const sst_count = (n + sst_entries - 1) / sst_entries;
+    uint64_t const first_id = sst_num_;
+    sst_num_ += sst_count;
+    std::vector<const SstMeta*> ssts(sst_count);
+    std::atomic<size_t> next_sst = 0;
+    RunThreads(nthreads, [&](int) {
+        Data blk[BLK_CACHE_MAX_COUNT];
+        for (size_t i; (i = next_sst.fetch_add(1)) < sst_count;) {
+            SstWriter writer{.sst = NewSst(first_id + i)};
+            size_t const end = std::min(n, (i + 1) * sst_entries);
+            for (size_t begin = i * sst_entries; begin < end;
+                 begin += BLK_CACHE_MAX_COUNT) {
+                int const blk_count = static_cast<int>(std::min<size_t>(
+                    BLK_CACHE_MAX_COUNT, end - begin));
+                for (int j = 0; j < blk_count; j++) {
+                    blk[j] = Data(pairs[begin + j].first,
+                                  pairs[begin + j].second, false);
+                }
+                WriteBlock(&writer, blk, blk_count);
+            }
+            ssts[i] = FinishSst(&writer);
+        }
+    });
+    Install({}, level, ssts);
+}
+
+uint64_t TblCache::MaxLevelSize(int level) const {
+    uint64_t size = l1_max_size_;
+    for (int i = 1; i < level; i++) {
+        size *= LEVEL_SIZE_MULTIPLIER;
+    }
+    return size;
+}
+
+SstMeta* TblCache::NewSst(uint64_t id) const {
+    fs::path filepath = SstPath(sst_dir_, id);
+    FILE* file = fopen(filepath.c_str(), "wb+");
+    MYASSERT(file != nullptr);
+
+    return new SstMeta{
+        .id = id,
+        .filepath = std::move(filepath),
+        .file = file,
+        .key_min = std::numeric_limits<KeyT>::max(),
+        .key_max = 0,
+        .size = 0,
+    };
+}
+
+void TblCache::WriteBlock(SstWriter* writer, const Data* blk, int count) {
+    if constexpr (!rt::is_validator()) {
+        if (writer->sst == nullptr) {
+            writer->sst = NewSst(sst_num_++);
+            writer->offset = 0;
+        }
+    }
+
+    const auto* p_blk_info = scee::ptr_t<BlkInfo>::make_obj(
+        MakeBlkInfo(blk, count, rt::cache_read(writer->offset)));
+
+    FILE* file = rt::app_read([&] { return writer->sst->file; });
+    rt::fwrite(blk, sizeof(Data), count, file);
+
+    if constexpr (!rt::is_validator()) {
+        SstMeta* sst_meta = writer->sst;
+        sst_meta->key_min = std::min(sst_meta->key_min, blk[0].key);
+        sst_meta->key_max = std::max(sst_meta->key_max, blk[count - 1].key);
+        sst_meta->size += count * sizeof(Data);
+        sst_meta->blk_infos.emplace_back(p_blk_info);
+        writer->offset += count * sizeof(Data);
+    }
+}
+
+SstMeta* TblCache::FinishSst(SstWriter* writer) {
+    SstMeta* sst_meta = writer->sst;
+    ::fflush(sst_meta->file);
+    if (persistent_) {
+        // before the manifest lists it
+        MYASSERT(::fdatasync(fileno(sst_meta->file)) == 0);
+    }
+    void* map = ::mmap(nullptr, sst_meta->size, PROT_READ, MAP_SHARED,
+                       fileno(sst_meta->file), 0);
+    MYASSERT(map != MAP_FAILED);
+    sst_meta->map = static_cast<const char*>(map);
+    fclose(sst_meta->file);
+    sst_meta->file = nullptr;
+    *writer = SstWriter();
+    return sst_meta;
+}
+
+BlockCache::Entry* TblCache::LoadBlk(const SstMeta* sst_meta, int blk_id) {
+    CacheKey const cache_key = hash_key(sst_meta->id, blk_id);
+    if (auto* entry = blk_cache_.Lookup(cache_key); entry != nullptr) {
+        return entry;
+    }
+
+    // served from the mapping, the crc is checked once per load
+    const BlkInfo* blk_info = sst_meta->blk_infos[blk_id];
+    const auto* data = reinterpret_cast<const Data*>(sst_meta->map +
+                                                     blk_info->offset_in_sst);
+    MYASSERT(kompute_crc32(data, blk_info->count * sizeof(Data)) ==
+             blk_info->crc);
+
+    // Get and compaction may read the same blk at once, Insert keeps one
+    return blk_cache_.Insert(cache_key, new BlkData{
+                                            .blk_info = blk_info,
+                                            .data = data,
+                                            .count = blk_info->count,
+                                        });
+}
+
+void TblCache::Prefetch(const SstMeta* sst_meta, int blk_id) {
+    const auto& blk_infos = sst_meta->blk_infos;
+    int const end = std::min(blk_id + SCAN_PREFETCH_BLK_COUNT,
+                             static_cast<int>(blk_infos.size()));
+    if (blk_id >= end) {
+        return;
+    }
+    const BlkInfo* last = blk_infos[end - 1];
+    auto const begin = reinterpret_cast<uintptr_t>(
+        sst_meta->map + blk_infos[blk_id]->offset_in_sst);
+    auto const page = begin & ~(PAGE_BYTES - 1);
+    auto const bytes = last->offset_in_sst + last->count * sizeof(Data) -
+                       (page - reinterpret_cast<uintptr_t>(sst_meta->map));
+    ::madvise(reinterpret_cast<void*>(page), bytes, MADV_WILLNEED);
+}
+
+bool TblCache::PickCompaction() {
+    const Version* version = version_.load(std::memory_order_acquire);
+
+    int level = -1;
+    if (version->levels[0].size() >= L0_COMPACTION_TRIGGER) {
+        level = 0;
+    } else {
+        for (int l = 1; l < LSM_MAX_LEVELS - 1; l++) {
+            if (LevelSize(version, l) > MaxLevelSize(l)) {
+                level = l;
+                break;
+            }
+        }
+    }
+    if (level == -1) {
+        return false;
+    }
+
+    CompactState& c = compact_;
+    std::vector<const SstMeta*> picked;
+    if (level == 0) {
+        // the oldest ones, which the newer L0 ssts keep shadowing
+        const auto& l0 = version->levels[0];
+        int const n =
+            std::min(static_cast<int>(l0.size()), L0_MAX_COMPACT_COUNT);
+        picked.assign(l0.begin(), l0.begin() + n);
+        for (int i = n - 1; i >= 0; i--) {
+            c.runs.emplace_back(MergeRun{.ssts = {picked[i]}});
+        }
+    } else {
+        // round robin over the key space of the level
+        const auto& ssts = version->levels[level];
+        auto it = std::find_if(ssts.begin(), ssts.end(),
+                               [&](const SstMeta* sst_meta) {
+                                   return sst_meta->key_min >
+                                          compact_pointer_[level];
+                               });
+        if (it == ssts.end()) {
+            it = ssts.begin();
+        }
+        picked.emplace_back(*it);
+        compact_pointer_[level] = (*it)->key_max;
+        c.runs.emplace_back(MergeRun{.ssts = {*it}});
+    }
+
+    KeyT key_min = std::numeric_limits<KeyT>::max();
+    KeyT key_max = std::numeric_limits<KeyT>::min();
+    for (const auto* sst_meta : picked) {
+        key_min = std::min(key_min, sst_meta->key_min);
+        key_max = std::max(key_max, sst_meta->key_max);
+    }
+
+    std::vector<const SstMeta*> overlaps;
+    for (const auto* sst_meta : version->levels[level + 1]) {
+        if (Overlaps(sst_meta, key_min, key_max)) {
+            overlaps.emplace_back(sst_meta);
+        }
+    }
+
+    if (level > 0 && overlaps.empty()) {
+        // nothing to merge with, move the sst down as is
+        Install(picked, level + 1, picked);
+        stats_.trivial_moves++;
+        c = CompactState();
+        return true;
+    }
+
+    if (!overlaps.empty()) {
+        c.runs.emplace_back(MergeRun{.ssts = overlaps});
+    }
+    c.inputs = std::move(picked);
+    c.inputs.insert(c.inputs.end(), overlaps.begin(), overlaps.end());
+
+    // tombstones can go once no deeper level may hold an older version
+    c.drop_tombstones = true;
+    for (int l = level + 2; l < LSM_MAX_LEVELS; l++) {
+        for (const auto* sst_meta : version->levels[l]) {
+            if (Overlaps(sst_meta, key_min, key_max)) {
+                c.drop_tombstones = false;
+            }
+        }
+    }
+
+    c.level = level;
+    c.active = true;
+    return true;
+}
+
+TblCache::RunPos TblCache::RunPosition(int run_id) {
+    MergeRun& run = compact_.runs[run_id];
+    if (run.sst_idx >= run.ssts.size()) {
+        return {nullptr, 0, 0};
+    }
+    const SstMeta* sst_meta = run.ssts[run.sst_idx];
+    if (run.pinned == nullptr) {
+        run.pinned = LoadBlk(sst_meta, run.blk_idx);
+    }
+    return {
+        run.pinned->blk_data->data,
+        sst_meta->blk_infos[run.blk_idx]->count,
+        run.entry_idx,
+    };
+}
+
+TblCache::RunPos TblCache::AdvanceRun(int run_id) {
+    MergeRun& run = compact_.runs[run_id];
+    blk_cache_.Release(run.pinned);
+    run.pinned = nullptr;
+    run.entry_idx = 0;
+    run.blk_idx++;
+    if (run.blk_idx == static_cast<int>(run.ssts[run.sst_idx]->blk_infos.size())) {
+        run.blk_idx = 0;
+        run.sst_idx++;
+    }
+    return RunPosition(run_id);
+}
+
+void TblCache::Install(const std::vector<const SstMeta*>& removed, int level,
+                       const std::vector<const SstMeta*>& added) {
+    const Version* old_version = version_.load(std::memory_order_acquire);
+    auto* version = new Version(*old_version);
+
+    auto contains = [](const std::vector<const SstMeta*>& ssts,
+                       const SstMeta* sst_meta) {
+        return std::find(ssts.begin(), ssts.end(), sst_meta) != ssts.end();
+    };
+    for (auto& ssts : version->levels) {
+        std::erase_if(ssts, [&](const SstMeta* sst_meta) {
+            return contains(removed, sst_meta);
+        });
+    }
+
+    auto& ssts = version->levels[level];
+    ssts.insert(ssts.end(), added.begin(), added.end());
+    if (level > 0) {
+        std::sort(ssts.begin(), ssts.end(),
+                  [](const SstMeta* a, const SstMeta* b) {
+                      return a->key_min < b->key_min;
+                  });
+    }
+    version_.store(version, std::memory_order_release);
+    if (persistent_) {
+        // before the removed ssts may be dropped
+        WriteManifest(version);
+    }
+
+    Retired retired{.tsc = scee::current_gc_tsc(), .version = old_version};
+    for (const auto* sst_meta : removed) {
+        if (!contains(added, sst_meta)) {
+            retired.ssts.emplace_back(sst_meta);
+        }
+    }
+    retired_.emplace_back(std::move(retired));
+}
+
+void TblCache::Reclaim() {
+    if (retired_.empty()) {
+        return;
+    }
+    // every closure started before this tick has been validated
+    uint64_t const earliest_tsc = scee::closure_start_log.poll_earliest_tsc();
+    while (!retired_.empty() && retired_.front().tsc < earliest_tsc) {
+        const Retired& retired = retired_.front();
+        delete retired.version;
+        for (const auto* sst_meta : retired.ssts) {
+            DropSst(sst_meta);
+        }
+        retired_.pop_front();
+    }
+}
+
+void TblCache::DropSst(const SstMeta* sst_meta) {
+    for (int blk_id = 0; blk_id < static_cast<int>(sst_meta->blk_infos.size());
+         blk_id++) {
+        blk_cache_.Erase(hash_key(sst_meta->id, blk_id));
+        scee::free_immutable(const_cast<BlkInfo*>(sst_meta->blk_infos[blk_id]));
+    }
+    ::munmap(const_cast<char*>(sst_meta->map), sst_meta->size);
+    fs::remove(sst_meta->filepath);
+    delete sst_meta;
+}
+
+// The manifest is a sequence of words: the magic, the WAL checkpoint,
+// sst_num_ and the sst count, then the level, id and blk count of each sst
+// followed by the count and crc of each of its blks, and last the crc of the
+// words before it. The ssts are listed in the order of their level.
+void TblCache::WriteManifest(const Version* version) const {
+    std::vector<uint64_t> words = {MANIFEST_MAGIC, wal_checkpoint_, sst_num_,
+                                   0};
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+        for (const auto* sst_meta : version->levels[level]) {
+            words.emplace_back(level);
+            words.emplace_back(sst_meta->id);
+            words.emplace_back(sst_meta->blk_infos.size());
+            for (const auto* blk_info : sst_meta->blk_infos) {
+                words.emplace_back(
+                    static_cast<uint64_t>(blk_info->count) << 32 |
+                    blk_info->crc);
+            }
+            words[3]++;
+        }
+    }
+    words.emplace_back(kompute_crc32(words.data(), words.size() * 8));
+
+    // replaced whole by the rename, the old one stays valid until then
+    fs::path const tmp_path = sst_dir_ / "MANIFEST.tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    MYASSERT(fd >= 0);
+    auto const bytes = static_cast<ssize_t>(words.size() * 8);
+    MYASSERT(::write(fd, words.data(), bytes) == bytes);
+    MYASSERT(::fdatasync(fd) == 0);
+    ::close(fd);
+    fs::rename(tmp_path, sst_dir_ / "MANIFEST");
+    fd = ::open(sst_dir_.c_str(), O_RDONLY | O_DIRECTORY);
+    MYASSERT(fd >= 0);
+    MYASSERT(::fsync(fd) == 0);
+    ::close(fd);
+}
+
+void TblCache::Recover() {
+    std::vector<uint64_t> words;
+    if (FILE* file = fopen((sst_dir_ / "MANIFEST").c_str(), "rb")) {
+        uint64_t word;
+        while (fread(&word, sizeof(word), 1, file) == 1) {
+            words.emplace_back(word);
+        }
+        fclose(file);
+        // renamed in place once synced, so never torn
+        MYASSERT(words.size() >= 5 && words[0] == MANIFEST_MAGIC);
+        MYASSERT(kompute_crc32(words.data(), (words.size() - 1) * 8) ==
+                 words.back());
+    }
+
+    auto* version = new Version();
+    std::vector<uint64_t> ids;
+    if (!words.empty()) {
+        wal_checkpoint_ = words[1];
+        sst_num_ = words[2];
+        size_t pos = 4;
+        for (uint64_t i = 0; i < words[3]; i++) {
+            auto const level = static_cast<int>(words[pos++]);
+            uint64_t const id = words[pos++];
+            uint64_t const blk_count = words[pos++];
+            MYASSERT(level < LSM_MAX_LEVELS && pos + blk_count < words.size());
+
+            fs::path filepath = SstPath(sst_dir_, id);
+            int fd = ::open(filepath.c_str(), O_RDONLY);
+            MYASSERT(fd >= 0);
+            struct stat st;
+            MYASSERT(::fstat(fd, &st) == 0);
+            void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            MYASSERT(map != MAP_FAILED);
+            ::close(fd);
+
+            auto* sst_meta = new SstMeta{
+                .id = id,
+                .filepath = std::move(filepath),
+                .file = nullptr,
+                .map = static_cast<const char*>(map),
+                .key_min = std::numeric_limits<KeyT>::max(),
+                .key_max = 0,
+                .size = 0,
+            };
+            // the filters and key ranges are rebuilt from the blks, whose
+            // crcs must match the manifest
+            for (uint64_t b = 0; b < blk_count; b++) {
+                auto const count = static_cast<int>(words[pos] >> 32);
+                auto const crc = static_cast<uint32_t>(words[pos++]);
+                MYASSERT(sst_meta->size + count * sizeof(Data) <=
+                         static_cast<uint64_t>(st.st_size));
+                const auto* blk =
+                    reinterpret_cast<const Data*>(sst_meta->map + sst_meta->size);
+                BlkInfo const blk_info = MakeBlkInfo(blk, count, sst_meta->size);
+                MYASSERT(blk_info.crc == crc);
+                sst_meta->key_min = std::min(sst_meta->key_min, blk[0].key);
+                sst_meta->key_max = std::max(sst_meta->key_max, blk[count - 1].key);
+                sst_meta->size += count * sizeof(Data);
+                sst_meta->blk_infos.emplace_back(
+                    scee::ptr_t<BlkInfo>::make_obj(blk_info));
+            }
+            version->levels[level].emplace_back(sst_meta);
+            ids.emplace_back(id);
+        }
+    }
+    delete version_.load(std::memory_order_relaxed);
+    version_.store(version, std::memory_order_release);
+
+    // written after the last manifest, or dropped before their removal
+    if (!fs::exists(sst_dir_)) {
+        return;
+    }
+    for (const auto& entry : fs::directory_iterator(sst_dir_)) {
+        std::string const name = entry.path().filename().string();
+        uint64_t id;
+        if (sscanf(name.c_str(), "sst_%lu.bin", &id) == 1 &&
+            std::find(ids.begin(), ids.end(), id) == ids.end()) {
+            fs::remove(entry.path());
+        }
+    }
+}
+
+}  // namespace NAMESPACE::lsmtree
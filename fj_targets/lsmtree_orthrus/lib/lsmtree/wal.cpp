@@ -0,0 +1,264 @@
+#include "wal.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace NAMESPACE::lsmtree {
+
+// is_delete of a batch header, whose value is the count of records after it
+constexpr uint64_t kBatchHeader = 2;
+
+static size_t round_up_page(size_t n) {
+    return (n + WAL_PAGE_SIZE - 1) / WAL_PAGE_SIZE * WAL_PAGE_SIZE;
+}
+
+static bool ValidRecord(const Data& rec) {
+    return rec.is_delete <= kBatchHeader &&
+           rec.check_crc(rec.key, rec.value, rec.is_delete);
+}
+
+Wal::Wal(const fs::path& dir, WalMode mode, uint64_t checkpoint,
+         const std::function<void(const Data&, uint64_t)>& replay)
+    : dir_(dir), mode_(mode) {
+    if (mode_ == WalMode::None) {
+        return;
+    }
+    create_directories(dir_);
+
+    std::vector<uint64_t> segs;
+    for (const auto& entry : fs::directory_iterator(dir_)) {
+        if (entry.path().extension() == ".wal") {
+            segs.push_back(std::stoull(entry.path().stem().string()));
+        }
+    }
+    std::sort(segs.begin(), segs.end());
+    // left behind by a crash before the logger removed them
+    while (!segs.empty() && segs.front() <= checkpoint) {
+        fs::remove(SegPath(segs.front()));
+        segs.erase(segs.begin());
+    }
+    for (uint64_t seg : segs) {
+        std::ifstream in(SegPath(seg), std::ios::binary);
+        auto read = [&](Data* rec) {
+            // the zero padding, or a torn write
+            return in.read(reinterpret_cast<char*>(rec), sizeof(*rec)) &&
+                   ValidRecord(*rec);
+        };
+        Data rec;
+        std::vector<Data> ops;
+        while (read(&rec)) {
+            if (rec.is_delete != kBatchHeader) {
+                replay(rec, seg);
+                replayed_++;
+                continue;
+            }
+            if (rec.value < 1 || rec.value > WRITE_BATCH_MAX_COUNT) {
+                break;
+            }
+            ops.resize(rec.value);
+            bool complete = true;
+            for (auto& op : ops) {
+                if (!read(&op) || op.is_delete == kBatchHeader) {
+                    complete = false;
+                    break;
+                }
+            }
+            if (!complete) {
+                break;
+            }
+            for (const auto& op : ops) {
+                replay(op, seg);
+            }
+            replayed_ += ops.size();
+        }
+    }
+
+    // ids only grow, past the removed segments too
+    seg_id_ = std::max(checkpoint, segs.empty() ? 0 : segs.back()) + 1;
+    removed_seg_ = segs.empty() ? seg_id_ - 1 : segs.front() - 1;
+    buf_ = static_cast<char*>(std::aligned_alloc(WAL_PAGE_SIZE, WAL_BUFFER_SIZE));
+    MYASSERT(buf_ != nullptr);
+    Open(seg_id_);
+    logger_ = std::thread([this] { Run(); });
+}
+
+Wal::~Wal() {
+    if (mode_ == WalMode::None) {
+        return;
+    }
+    {
+        std::unique_lock lock(mutex_);
+        stop_ = true;
+        Wake(lock);
+    }
+    logger_.join();
+    Close();
+    std::free(buf_);
+}
+
+uint64_t Wal::Queue(const Data* recs, size_t count, bool batch) {
+    std::unique_lock lock(mutex_);
+    if (batch) {
+        Data header;
+        header.key = 0;
+        header.value = count;
+        header.is_delete = kBatchHeader;
+        header.set_crc();
+        queue_.push_back(header);
+    }
+    queue_.insert(queue_.end(), recs, recs + count);
+    uint64_t const lsn = last_lsn_ += count;
+    Wake(lock);
+    return lsn;
+}
+
+void Wal::Wait(uint64_t lsn) {
+    if (mode_ != WalMode::Sync) {
+        return;
+    }
+    std::unique_lock lock(mutex_);
+    synced_cv_.wait(lock, [&] { return synced_lsn_ >= lsn; });
+}
+
+uint64_t Wal::Roll() {
+    if (mode_ == WalMode::None) {
+        return 0;
+    }
+    std::unique_lock lock(mutex_);
+    rolls_.push_back(queue_.size());
+    uint64_t const seg_id = seg_id_++;
+    Wake(lock);
+    return seg_id;
+}
+
+void Wal::Release(uint64_t seg_id) {
+    if (mode_ == WalMode::None) {
+        return;
+    }
+    std::unique_lock lock(mutex_);
+    release_seg_ = std::max(release_seg_, seg_id);
+    Wake(lock);
+}
+
+void Wal::Wake(std::unique_lock<std::mutex>& lock) {
+    if (idle_) {
+        idle_ = false;
+        lock.unlock();
+        work_cv_.notify_one();
+    }
+}
+
+void Wal::Run() {
+    std::vector<Data> batch;
+    std::vector<size_t> rolls;
+    uint64_t lsn = 0;
+    uint64_t release = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            synced_lsn_ = lsn;
+            synced_cv_.notify_all();
+            while (queue_.empty() && rolls_.empty() &&
+                   release_seg_ == release && !stop_) {
+                idle_ = true;
+                work_cv_.wait(lock);
+            }
+            if (queue_.empty() && rolls_.empty() && release_seg_ == release) {
+                break;  // stopped
+            }
+            batch.swap(queue_);
+            rolls.swap(rolls_);
+            lsn = last_lsn_;
+            release = release_seg_;
+        }
+
+        // one write and sync per segment of the batch
+        size_t begin = 0;
+        for (size_t end : rolls) {
+            Write(batch.data() + begin, end - begin);
+            Sync();
+            Close();
+            Open(fd_seg_ + 1);
+            begin = end;
+        }
+        if (begin < batch.size()) {
+            Write(batch.data() + begin, batch.size() - begin);
+            Sync();
+        }
+        batch.clear();
+        rolls.clear();
+
+        // only closed segments, the current one is still written to
+        for (; removed_seg_ < std::min(release, fd_seg_ - 1); removed_seg_++) {
+            fs::remove(SegPath(removed_seg_ + 1));
+        }
+    }
+}
+
+void Wal::Open(uint64_t seg_id) {
+    fs::path const path = SegPath(seg_id);
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd_ < 0 && errno == EINVAL) {
+        // tmpfs has no O_DIRECT, the page sized writes still work
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    MYASSERT(fd_ >= 0);
+    fd_seg_ = seg_id;
+    buf_len_ = 0;
+    buf_offset_ = 0;
+}
+
+void Wal::Write(const Data* recs, size_t count) {
+    size_t bytes = count * sizeof(Data);
+    const char* src = reinterpret_cast<const char*>(recs);
+    while (bytes > 0) {
+        size_t const n = std::min(bytes, WAL_BUFFER_SIZE - buf_len_);
+        memcpy(buf_ + buf_len_, src, n);
+        buf_len_ += n;
+        src += n;
+        bytes -= n;
+        if (buf_len_ == WAL_BUFFER_SIZE) {
+            ssize_t const written =
+                pwrite(fd_, buf_, WAL_BUFFER_SIZE, buf_offset_);
+            MYASSERT(written == static_cast<ssize_t>(WAL_BUFFER_SIZE));
+            buf_offset_ += WAL_BUFFER_SIZE;
+            buf_len_ = 0;
+        }
+    }
+}
+
+void Wal::Sync() {
+    if (buf_len_ > 0) {
+        size_t const len = round_up_page(buf_len_);
+        memset(buf_ + buf_len_, 0, len - buf_len_);
+        ssize_t const written = pwrite(fd_, buf_, len, buf_offset_);
+        MYASSERT(written == static_cast<ssize_t>(len));
+        // keep the partial page, the next batch rewrites it
+        size_t const full = buf_len_ / WAL_PAGE_SIZE * WAL_PAGE_SIZE;
+        memmove(buf_, buf_ + full, buf_len_ - full);
+        buf_len_ -= full;
+        buf_offset_ += full;
+    }
+    int const ret = fdatasync(fd_);
+    MYASSERT(ret == 0);
+}
+
+void Wal::Close() {
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+fs::path Wal::SegPath(uint64_t seg_id) const {
+    return dir_ / (std::to_string(seg_id) + ".wal");
+}
+
+}  // namespace NAMESPACE::lsmtree
@@ -13,6 +13,7 @@ namespace scee {
 
 // queue.hpp
 thread_local LogQueue log_queue;
+thread_local uint64_t enqueued_logs;
 
 // free_log.hpp
 thread_local ThreadGC thread_gc_instance;
@@ -41,8 +42,10 @@ void validate_one(LogHead *log) {
 // thread.hpp
 thread_local Thread validator_thread;
 thread_local std::atomic<bool> stop_validation;
+thread_local std::atomic<uint64_t> validated_logs;
 
-void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc) {
+void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc,
+              std::atomic<uint64_t> *validated) {
     app_thread_gc_instance = thread_gc;
     while (!stop) {
         while (queue->empty() && !stop) {
@@ -56,6 +59,7 @@ void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc) {
                 break;
             }
             validate_one(log);
+            validated->fetch_add(1, std::memory_order_release);
             validation_count++;
         }
         const uint64_t end = rdtsc();
@@ -65,8 +69,14 @@ void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc) {
 
 void AppThread::register_queue() {
     LogQueue *queue = &log_queue;
-    validator_thread =
-        Thread(validate, queue, std::ref(stop_validation), &thread_gc_instance);
+    validator_thread = Thread(validate, queue, std::ref(stop_validation),
+                              &thread_gc_instance, &validated_logs);
+}
+
+void wait_validation() {
+    while (validated_logs.load(std::memory_order_acquire) != enqueued_logs) {
+        cpu_relax();
+    }
 }
 
 void AppThread::unregister_queue() {
@@ -0,0 +1,192 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "log.hpp"
+#include "lsmtree-closure.hpp"
+#include "lsmtree.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+#include "scee.hpp"
+#include "thread.hpp"
+#include "utils.hpp"
+
+// Sets into a memtable large enough to hold them all, with keys in
+// sequential, zipfian or uniform order, to measure the skiplist inserts and
+// updates alone. Sequential keys resume from the finger of the last insert,
+// zipfian ones mostly update hot keys, uniform ones search from the head.
+// `batch` sets WRITE_BATCH_MAX_COUNT keys per batch, WRITE_BATCH_STEP_COUNT
+// per closure, `bulk` loads all of them into ssts at once.
+
+using namespace raw::lsmtree;
+
+constexpr const char* SST_DIR = "/dev/shm/lsmtree_insert";
+constexpr int NPrints = 8;
+
+enum RunType {
+    Baseline,
+    SCEE,
+    Batch,
+    Bulk,
+};
+
+enum class KeyOrder {
+    Sequential,
+    Zipf,
+    Uniform,
+};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+template <RunType RT>
+void set(void* lsm, KeyT key, ValueT value) {
+    if constexpr (RT == RunType::Baseline) {
+        raw::lsmtree_set(lsm, key, value);
+    } else if constexpr (RT == RunType::SCEE) {
+        scee::run2<int>(app::lsmtree_set, validator::lsmtree_set, lsm, key,
+                        value);
+    } else {
+        static WriteBatch batch;
+        batch.Put(key, value);
+        if (batch.Count() == WRITE_BATCH_MAX_COUNT) {
+            for (int from = 0; from < batch.Count();) {
+                from = scee::run2<int>(app::lsmtree_write,
+                                       validator::lsmtree_write, lsm,
+                                       static_cast<const void*>(&batch), from);
+            }
+            batch.Clear();
+        }
+    }
+}
+
+template <RunType RT>
+void insert_fn(KeyOrder order, uint64_t nkeys, uint64_t nops) {
+    std::filesystem::remove_all(SST_DIR);
+    auto* tree = new LSMTree(SST_DIR, MEMTABLE_MAX_SIZE);
+    void* lsm = tree;
+
+    std::mt19937 rng(1234567);
+    zipf_table_distribution<> zipf(nkeys, 0.99);
+    std::uniform_int_distribution<KeyT> uniform(1, nkeys);
+    std::vector<KeyT> keys(nops);
+    for (uint64_t i = 0; i < nops; ++i) {
+        switch (order) {
+        case KeyOrder::Sequential:
+            keys[i] = i % nkeys + 1;
+            break;
+        case KeyOrder::Zipf:
+            keys[i] = zipf(rng) + 1;
+            break;
+        case KeyOrder::Uniform:
+            keys[i] = uniform(rng);
+            break;
+        }
+    }
+
+    uint64_t start = now_ns();
+    if constexpr (RT == RunType::Bulk) {
+        std::vector<ValueT> values(nops);
+        for (uint64_t i = 0; i < nops; ++i) {
+            values[i] = keys[i] * 7 + i;
+        }
+        start = now_ns();
+        MYASSERT(tree->BulkLoad(keys.data(), values.data(), nops) ==
+                 Retcode::Success);
+        fprintf(stderr, "Bulk load %lu ops over %lu keys: %.0f ops/s\n", nops,
+                nkeys, nops * 1e9 / (now_ns() - start));
+        // the last value of each key, from the end
+        std::unordered_set<KeyT> seen;
+        for (uint64_t i = nops; i-- > 0 && seen.size() < 1000;) {
+            if (seen.insert(keys[i]).second) {
+                MYASSERT(raw::lsmtree_get(lsm, keys[i]) == values[i]);
+            }
+        }
+        tree->DumpStats(stderr);
+        return;
+    }
+    uint64_t round_start = start;
+    for (uint64_t i = 0; i < nops; ++i) {
+        set<RT>(lsm, keys[i], keys[i] * 7 + i);
+        if ((i + 1) % (nops / NPrints) == 0) {
+            uint64_t now = now_ns();
+            fprintf(stderr, "Insert %lu ops: %.0f ops/s\n", nops / NPrints,
+                    (nops / NPrints) * 1e9 / (now - round_start));
+            round_start = now;
+        }
+    }
+    fprintf(stderr, "Insert %lu ops over %lu keys: %.0f ops/s\n", nops, nkeys,
+            nops * 1e9 / (now_ns() - start));
+    tree->DumpStats(stderr);
+    // let the validator catch up before exiting
+    sleep(1);
+}
+
+int main_fn(RunType rt, KeyOrder order, uint64_t nkeys, uint64_t nops) {
+    switch (rt) {
+    case RunType::Baseline:
+        insert_fn<RunType::Baseline>(order, nkeys, nops);
+        break;
+    case RunType::SCEE:
+        insert_fn<RunType::SCEE>(order, nkeys, nops);
+        break;
+    case RunType::Batch:
+        insert_fn<RunType::Batch>(order, nkeys, nops);
+        break;
+    case RunType::Bulk:
+        insert_fn<RunType::Bulk>(order, nkeys, nops);
+        break;
+    }
+    return 0;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [baseline|scee|batch|bulk] [seq|zipf|uniform] "
+            "[nkeys=1M] "
+            "[nops=nkeys]\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 5) {
+        usage(argv[0]);
+        return 1;
+    }
+    KeyOrder order;
+    if (strcmp(argv[2], "seq") == 0) {
+        order = KeyOrder::Sequential;
+    } else if (strcmp(argv[2], "zipf") == 0) {
+        order = KeyOrder::Zipf;
+    } else if (strcmp(argv[2], "uniform") == 0) {
+        order = KeyOrder::Uniform;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    uint64_t nkeys = argc > 3 ? atol(argv[3]) : 1 << 20;
+    uint64_t nops = argc > 4 ? atol(argv[4]) : nkeys;
+    if (strcmp(argv[1], "baseline") == 0) {
+        scee::main_thread(main_fn, RunType::Baseline, order, nkeys, nops);
+    } else if (strcmp(argv[1], "scee") == 0) {
+        scee::main_thread(main_fn, RunType::SCEE, order, nkeys, nops);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        scee::main_thread(main_fn, RunType::Batch, order, nkeys, nops);
+    } else if (strcmp(argv[1], "bulk") == 0) {
+        scee::main_thread(main_fn, RunType::Bulk, order, nkeys, nops);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,290 @@
+#include <hdr/hdr_histogram.h>
+#include <unistd.h>
+
+#include <assert.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "log.hpp"
+#include "lsmtree-closure.hpp"
+#include "lsmtree.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+#include "scee.hpp"
+#include "thread.hpp"
+#include "utils.hpp"
+
+// YCSB over the lsmtree: a load of every key in random order, then zipfian
+// ops of workload A (50% gets / 50% updates) or E (95% scans of 1 to 100
+// pairs / 5% updates). Flush and compaction run on a maintenance thread in
+// scee, and inline one step per op in raw, where frees have no grace period
+// to wait for the other threads. In scee, both phases can be split across
+// several client threads, which insert into the memtable at once. Writes
+// may go through the wal, acknowledged once synced or not.
+
+using namespace raw::lsmtree;
+
+constexpr const char* SST_DIR = "/dev/shm/lsmtree_ycsb";
+constexpr int NPrints = 8;
+constexpr int MaxScanLength = 100;
+
+enum RunType {
+    Baseline,
+    SCEE,
+};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+ValueT mkval(KeyT key, uint64_t version) { return key * 7 + version; }
+
+template <RunType RT>
+int64_t get(void* lsm, KeyT key) {
+    if constexpr (RT == RunType::Baseline) {
+        return raw::lsmtree_get(lsm, key);
+    } else {
+        return scee::run2<int64_t>(app::lsmtree_get, validator::lsmtree_get,
+                                   lsm, key);
+    }
+}
+
+// scans in closures of at most SCAN_MAX_COUNT pairs
+template <RunType RT>
+int scan(void* lsm, KeyT start_key, int len) {
+    KeyT keys[SCAN_MAX_COUNT];
+    ValueT values[SCAN_MAX_COUNT];
+    int total = 0;
+    while (total < len && start_key != InvalidKey) {
+        int const count = std::min(len - total, SCAN_MAX_COUNT);
+        int found = 0;
+        int64_t next_key = InvalidKey;
+        if constexpr (RT == RunType::Baseline) {
+            raw::lsmtree_scan(lsm, start_key, count, keys, values, &found,
+                              &next_key);
+        } else {
+            scee::run2<uint64_t>(app::lsmtree_scan, validator::lsmtree_scan,
+                                 lsm, start_key, count, keys, values, &found,
+                                 &next_key);
+        }
+        assert(found >= 0);
+        total += found;
+        start_key = next_key;
+    }
+    return total;
+}
+
+// acknowledged once the wal has synced it in Sync mode, after the closure
+template <RunType RT>
+void set(void* lsm, KeyT key, ValueT value) {
+    uint64_t lsn = 0;
+    if constexpr (RT == RunType::Baseline) {
+        raw::lsmtree_set_logged(lsm, key, value, &lsn);
+    } else {
+        scee::run2<int>(app::lsmtree_set_logged,
+                        validator::lsmtree_set_logged, lsm, key, value, &lsn);
+    }
+    raw::lsmtree_wal_wait(lsm, lsn);
+}
+
+// one flush or compaction step, false if neither is due. A flush may wait
+// for the writers of the immutable memtable, compaction goes on meanwhile.
+template <RunType RT>
+bool maintain(void* lsm) {
+    if (raw::lsmtree_flush_due(lsm)) {
+        bool flushed;
+        if constexpr (RT == RunType::Baseline) {
+            flushed = raw::lsmtree_flush(lsm);
+        } else {
+            flushed = scee::run2<bool>(app::lsmtree_flush,
+                                       validator::lsmtree_flush, lsm);
+        }
+        if (flushed) return true;
+    }
+    if (!raw::lsmtree_compact_due(lsm)) return false;
+    if constexpr (RT == RunType::Baseline) {
+        return raw::lsmtree_compact(lsm);
+    } else {
+        return scee::run2<bool>(app::lsmtree_compact,
+                                validator::lsmtree_compact, lsm);
+    }
+}
+
+// Runs fn(tid) on `nthreads` app threads, the calling one included.
+template <typename F>
+void parallel(int nthreads, F&& fn) {
+    std::vector<scee::AppThread> threads;
+    for (int tid = 1; tid < nthreads; ++tid) {
+        threads.emplace_back([&fn, tid] { fn(tid); });
+    }
+    fn(0);
+    for (auto& thread : threads) thread.join();
+}
+
+template <RunType RT>
+void ycsb_fn(char workload, uint64_t nkeys, uint64_t nops, size_t memtable_size,
+             int nthreads, WalMode wal_mode) {
+    std::filesystem::remove_all(SST_DIR);
+    auto* tree = new LSMTree(SST_DIR, memtable_size, L1_MAX_SIZE,
+                             BLK_CACHE_CAPACITY, wal_mode);
+    void* lsm = tree;
+
+    std::atomic<bool> stop = false;
+    scee::AppThread maintainer;
+    if constexpr (RT == RunType::SCEE) {
+        maintainer = scee::AppThread([&] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!maintain<RT>(lsm)) usleep(100);
+            }
+        });
+    }
+
+    std::mt19937 rng(1234567);
+    std::vector<KeyT> order(nkeys);
+    for (uint64_t i = 0; i < nkeys; ++i) order[i] = i + 1;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    uint64_t start = now_ns();
+    parallel(nthreads, [&](int tid) {
+        for (uint64_t i = tid; i < nkeys; i += nthreads) {
+            set<RT>(lsm, order[i], mkval(order[i], 0));
+            if constexpr (RT == RunType::Baseline) maintain<RT>(lsm);
+        }
+    });
+    fprintf(stderr, "Load %lu keys: %.0f ops/s\n", nkeys,
+            nkeys * 1e9 / (now_ns() - start));
+    tree->DumpStats(stderr);
+
+    bool const scans = workload == 'e';
+    const char* read_op = scans ? "scan" : "get";
+    zipf_table_distribution<> zipf(nkeys, 0.99);
+    std::vector<hdr_histogram*> read_latency(nthreads);
+    std::atomic<uint64_t> misses = 0;
+
+    start = now_ns();
+    parallel(nthreads, [&](int tid) {
+        std::mt19937 rng(7654321 + tid);
+        zipf_table_distribution<> thread_zipf = zipf;
+        std::bernoulli_distribution is_read(scans ? 0.95 : 0.5);
+        std::uniform_int_distribution<int> scan_len(1, MaxScanLength);
+        hdr_histogram* latency;
+        hdr_init(1, 100'000'000, 3, &latency);
+        read_latency[tid] = latency;
+
+        uint64_t const thread_ops = nops / nthreads;
+        uint64_t round_start = now_ns();
+        for (uint64_t i = 0; i < thread_ops; ++i) {
+            KeyT key = thread_zipf(rng) + 1;
+            if (is_read(rng)) {
+                uint64_t read_start = now_ns();
+                if (scans) {
+                    // every key is loaded, only the end of the keys cuts it
+                    // short
+                    int len = scan_len(rng);
+                    if (scan<RT>(lsm, key, len) !=
+                        std::min<int64_t>(len, nkeys - key + 1)) {
+                        misses++;
+                    }
+                } else if (get<RT>(lsm, key) == -1) {
+                    misses++;
+                }
+                hdr_record_value(latency, now_ns() - read_start);
+            } else {
+                set<RT>(lsm, key, mkval(key, i * nthreads + tid + 1));
+            }
+            if constexpr (RT == RunType::Baseline) maintain<RT>(lsm);
+
+            // the first thread reports for all
+            if (tid == 0 && (i + 1) % (thread_ops / NPrints) == 0) {
+                uint64_t now = now_ns();
+                fprintf(stderr,
+                        "YCSB-%c %lu ops: %.0f ops/s, %s p50 = %ld ns, "
+                        "p99 = %ld ns, p99.9 = %ld ns, misses = %lu\n",
+                        toupper(workload), nops / NPrints,
+                        (nops / NPrints) * 1e9 / (now - round_start), read_op,
+                        hdr_value_at_percentile(latency, 50),
+                        hdr_value_at_percentile(latency, 99),
+                        hdr_value_at_percentile(latency, 99.9), misses.load());
+                round_start = now;
+            }
+        }
+    });
+    fprintf(stderr, "YCSB-%c %lu ops on %d threads: %.0f ops/s, misses = %lu\n",
+            toupper(workload), nops, nthreads, nops * 1e9 / (now_ns() - start),
+            misses.load());
+    tree->DumpStats(stderr);
+
+    if constexpr (RT == RunType::SCEE) {
+        stop.store(true);
+        maintainer.join();
+    }
+    for (auto* latency : read_latency) hdr_close(latency);
+    // let the validator catch up before exiting
+    sleep(1);
+}
+
+int main_fn(RunType rt, char workload, uint64_t nkeys, uint64_t nops,
+            size_t memtable_size, int nthreads, WalMode wal_mode) {
+    switch (rt) {
+    case RunType::Baseline:
+        ycsb_fn<RunType::Baseline>(workload, nkeys, nops, memtable_size,
+                                   nthreads, wal_mode);
+        break;
+    case RunType::SCEE:
+        ycsb_fn<RunType::SCEE>(workload, nkeys, nops, memtable_size, nthreads,
+                               wal_mode);
+        break;
+    }
+    return 0;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [baseline|scee] [a|e] [nkeys=1M] [nops=4M] "
+            "[memtable_mb=4] [threads=1, scee only] [wal=none|async|sync]\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 8 ||
+        (strcmp(argv[2], "a") != 0 && strcmp(argv[2], "e") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    char workload = argv[2][0];
+    uint64_t nkeys = argc > 3 ? atol(argv[3]) : 1 << 20;
+    uint64_t nops = argc > 4 ? atol(argv[4]) : 1 << 22;
+    size_t memtable_size = (argc > 5 ? atol(argv[5]) : 4) << 20;
+    int nthreads = argc > 6 ? atoi(argv[6]) : 1;
+    WalMode wal_mode = WalMode::None;
+    if (argc > 7) {
+        if (strcmp(argv[7], "async") == 0) {
+            wal_mode = WalMode::Async;
+        } else if (strcmp(argv[7], "sync") == 0) {
+            wal_mode = WalMode::Sync;
+        } else if (strcmp(argv[7], "none") != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (strcmp(argv[1], "baseline") == 0 && nthreads == 1) {
+        scee::main_thread(main_fn, RunType::Baseline, workload, nkeys, nops,
+                          memtable_size, nthreads, wal_mode);
+    } else if (strcmp(argv[1], "scee") == 0 && nthreads >= 1) {
+        scee::main_thread(main_fn, RunType::SCEE, workload, nkeys, nops,
+                          memtable_size, nthreads, wal_mode);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,7 +1,9 @@
 // #include <format>
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <random>
+#include <thread>
 
 #include "context.hpp"
 #include "ctltypes.hpp"
@@ -15,6 +17,20 @@
 #include "thread.hpp"
 
 constexpr int KEY_MAX = 100000;
+// small enough to flush a dozen memtables to ssts
+constexpr size_t MEMTABLE_SIZE = 1 << 19;
+// small enough to compact the ssts down to L2
+constexpr uint64_t L1_SIZE = 1 << 20;
+// a fraction of the blocks, so that gets evict cached blocks
+constexpr size_t BLK_CACHE_BLOCKS = 256;
+// keys deleted after the sets, mostly from ssts by then
+constexpr int DEL_EVERY = 10;
+// keys set through the wal, then recovered by a tree opened on its dir
+constexpr int WAL_KEY_MAX = 10000;
+constexpr const char* WAL_DIR = "/dev/shm/lsmtree_wal";
+// keys bulk loaded, the first ones a second time over a flushed memtable
+constexpr int BULK_RELOAD_MAX = 1000;
+constexpr const char* BULK_DIR = "/dev/shm/lsmtree_bulk";
 
 using namespace raw::lsmtree;
 std::array<KeyT, KEY_MAX> keys;
@@ -112,7 +128,23 @@ namespace scee {
 int main_fn() {
     init();
 
-    void* lsmtree = new LSMTree("/dev/shm/lsmtree");
+    void* lsmtree = new LSMTree("/dev/shm/lsmtree", MEMTABLE_SIZE, L1_SIZE,
+                                BLK_CACHE_BLOCKS);
+
+    auto flush = [&] {
+        while (raw::lsmtree_flush_due(lsmtree)) {
+            scee::run2<bool>(
+                app::lsmtree_flush,
+                validator::lsmtree_flush,
+                lsmtree);
+        }
+        while (raw::lsmtree_compact_due(lsmtree)) {
+            scee::run2<bool>(
+                app::lsmtree_compact,
+                validator::lsmtree_compact,
+                lsmtree);
+        }
+    };
 
     for (int i = 0; i < KEY_MAX; i++) {
         auto key = keys[i];
@@ -121,6 +153,45 @@ int main_fn() {
             app::lsmtree_set,
             validator::lsmtree_set,
             lsmtree, key, value);
+        flush();
+    }
+
+    for (int i = 0; i < KEY_MAX; i += DEL_EVERY) {
+        auto key = keys[i];
+        auto ret = scee::run2<int>(
+            app::lsmtree_del,
+            validator::lsmtree_del,
+            lsmtree, key);
+        flush();
+        values[i] = -1;
+        data[key] = -1;
+    }
+
+    // a scan of the whole key space skips the deleted keys
+    {
+        KeyT start_key = 0;
+        auto expect = data.begin();
+        KeyT scan_keys[SCAN_MAX_COUNT];
+        ValueT scan_values[SCAN_MAX_COUNT];
+        while (start_key != InvalidKey) {
+            int found = 0;
+            int64_t next_key = InvalidKey;
+            scee::run2<uint64_t>(
+                app::lsmtree_scan,
+                validator::lsmtree_scan,
+                lsmtree, start_key, SCAN_MAX_COUNT, scan_keys, scan_values,
+                &found, &next_key);
+            ASSERT_EQ(found >= 0, true);
+            for (int i = 0; i < found; i++) {
+                while (expect->second == -1) expect++;
+                ASSERT_EQ(scan_keys[i], expect->first);
+                ASSERT_EQ(scan_values[i], expect->second);
+                expect++;
+            }
+            start_key = next_key;
+        }
+        while (expect != data.end() && expect->second == -1) expect++;
+        ASSERT_EQ(expect == data.end(), true);
     }
 
     for (int i = 0; i < KEY_MAX; i++) {
@@ -148,13 +219,14 @@ int main_fn() {
         ASSERT_EQ(ret3, get_as_time_no_fault(value));
     }
 
-    sleep(2);
+    reinterpret_cast<LSMTree*>(lsmtree)->DumpStats(stderr);
+    scee::wait_validation();
 
     std::vector<int64_t> ret_values;
     std::vector<uint32_t> ret_crc32s;
     std::vector<double> ret_times;
 
-    for (int i = 0; i < keys.size(); i++) {
+    for (size_t i = 0; i < keys.size(); i++) {
         auto key = keys[i];
         auto ret = scee::run2<int64_t>(
             app::lsmtree_get,
@@ -176,9 +248,9 @@ int main_fn() {
         ret_times.push_back(ret3);
     }
 
-    sleep(2);
+    scee::wait_validation();
 
-    for (int i = 0; i < ret_values.size(); i++) {
+    for (size_t i = 0; i < ret_values.size(); i++) {
         // ASSERT_EQ_FINAL(ret_values[i], data[keys[i]]);
         ASSERT_EQ_FINAL(ret_crc32s[i], kompute_crc32_no_fault(&ret_values[i], sizeof(ret_values[i])));
         if (abs(ret_times[i] - get_as_time_no_fault(ret_values[i])) > 1.0) {
@@ -187,7 +259,158 @@ int main_fn() {
         }
     }
 
-
+    // the wal holds the writes of a memtable that is never flushed, until
+    // the tree that recovers them flushes its smaller memtables
+    std::filesystem::remove_all(WAL_DIR);
+    auto* wal_tree = new LSMTree(WAL_DIR, MEMTABLE_MAX_SIZE, L1_SIZE,
+                                 BLK_CACHE_BLOCKS, WalMode::Sync);
+    void* wal_lsmtree = wal_tree;
+    uint64_t lsn = 0;
+    for (int i = 0; i < WAL_KEY_MAX; i++) {
+        scee::run2<int>(app::lsmtree_set_logged, validator::lsmtree_set_logged,
+                        wal_lsmtree, keys[i], values[i] + 1, &lsn);
+        raw::lsmtree_wal_wait(wal_lsmtree, lsn);
+    }
+    for (int i = 0; i < WAL_KEY_MAX; i += DEL_EVERY) {
+        scee::run2<int>(app::lsmtree_del_logged, validator::lsmtree_del_logged,
+                        wal_lsmtree, keys[i], &lsn);
+        raw::lsmtree_wal_wait(wal_lsmtree, lsn);
+    }
+    // the next keys in batches, which the closures log
+    WriteBatch batch;
+    for (int i = WAL_KEY_MAX; i < 2 * WAL_KEY_MAX; i++) {
+        if (i % DEL_EVERY == 0) {
+            batch.Delete(keys[i]);
+        } else {
+            batch.Put(keys[i], values[i] + 1);
+        }
+        if (batch.Count() == WRITE_BATCH_MAX_COUNT || i == 2 * WAL_KEY_MAX - 1) {
+            for (int from = 0; from < batch.Count();) {
+                from = scee::run2<int>(app::lsmtree_write_logged,
+                                       validator::lsmtree_write_logged,
+                                       wal_lsmtree,
+                                       static_cast<const void*>(&batch), from,
+                                       &lsn);
+            }
+            raw::lsmtree_wal_wait(wal_lsmtree, lsn);
+            batch.Clear();
+        }
+    }
+    // the closures are validated before the tree goes, its wal is closed
+    // before another one opens the segments
+    scee::wait_validation();
+    delete wal_tree;
+    uint64_t const wal_records = 2 * WAL_KEY_MAX + WAL_KEY_MAX / DEL_EVERY;
+    auto check_recovered = [&](LSMTree* tree) {
+        for (int i = 0; i < 2 * WAL_KEY_MAX; i++) {
+            ASSERT_EQ(tree->Get(keys[i]),
+                      i % DEL_EVERY == 0 ? (ValueT)-1 : values[i] + 1);
+        }
+    };
+    auto* recovered = new LSMTree(WAL_DIR, MEMTABLE_SIZE, L1_SIZE,
+                                  BLK_CACHE_BLOCKS, WalMode::Sync);
+    ASSERT_EQ(recovered->WalReplayed(), wal_records);
+    check_recovered(recovered);
+    delete recovered;
+    // the flushed segments are gone, their records are in the ssts of the
+    // manifest
+    recovered = new LSMTree(WAL_DIR, MEMTABLE_SIZE, L1_SIZE, BLK_CACHE_BLOCKS,
+                            WalMode::Sync);
+    ASSERT_EQ(recovered->WalReplayed() < wal_records, true);
+    check_recovered(recovered);
+    recovered->DumpStats(stderr);
+    delete recovered;
+
+    // a bulk load keeps the last of equal keys, and goes above the ssts it
+    // overlaps
+    std::filesystem::remove_all(BULK_DIR);
+    auto* bulk_tree =
+        new LSMTree(BULK_DIR, MEMTABLE_SIZE, L1_SIZE, BLK_CACHE_BLOCKS);
+    void* bulk_lsmtree = bulk_tree;
+    std::vector<KeyT> bulk_keys(keys.begin(), keys.end());
+    std::vector<ValueT> bulk_values(KEY_MAX, 0);
+    bulk_keys.insert(bulk_keys.end(), keys.rbegin(), keys.rend());
+    bulk_values.insert(bulk_values.end(), values.rbegin(), values.rend());
+    ASSERT_EQ(bulk_tree->BulkLoad(bulk_keys.data(), bulk_values.data(),
+                                  bulk_keys.size(), 4) == Retcode::Success,
+              true);
+    for (int i = 0; i < BULK_RELOAD_MAX; i++) {
+        scee::run2<int>(app::lsmtree_set, validator::lsmtree_set, bulk_lsmtree,
+                        keys[i], values[i] + 1);
+    }
+    // the memtable is newer
+    ASSERT_EQ(bulk_tree->BulkLoad(keys.data(), values.data(),
+                                  BULK_RELOAD_MAX) == Retcode::Fail,
+              true);
+    // above the first load
+    constexpr int RELOAD_BEGIN = KEY_MAX / 2;
+    std::vector<ValueT> reload_values(BULK_RELOAD_MAX);
+    for (int i = 0; i < BULK_RELOAD_MAX; i++) {
+        reload_values[i] = values[RELOAD_BEGIN + i] + 2;
+    }
+    ASSERT_EQ(bulk_tree->BulkLoad(&keys[RELOAD_BEGIN], reload_values.data(),
+                                  BULK_RELOAD_MAX, 2) == Retcode::Success,
+              true);
+    for (int i = 0; i < KEY_MAX; i++) {
+        ValueT expect = values[i];
+        if (i < BULK_RELOAD_MAX) {
+            expect = values[i] + 1;
+        } else if (i >= RELOAD_BEGIN && i < RELOAD_BEGIN + BULK_RELOAD_MAX) {
+            expect = values[i] + 2;
+        }
+        auto ret = scee::run2<int64_t>(app::lsmtree_get,
+                                       validator::lsmtree_get, bulk_lsmtree,
+                                       keys[i]);
+        ASSERT_EQ(ret, expect);
+    }
+    // not while a swapped out memtable waits for its flush
+    KeyT tail_key = *std::max_element(keys.begin(), keys.end()) + 1;
+    while (!raw::lsmtree_flush_due(bulk_lsmtree)) {
+        scee::run2<int>(app::lsmtree_set, validator::lsmtree_set, bulk_lsmtree,
+                        tail_key++, ValueT{0});
+    }
+    ValueT const tail_value = 1;
+    ASSERT_EQ(bulk_tree->BulkLoad(&tail_key, &tail_value, 1) == Retcode::Fail,
+              true);
+    while (raw::lsmtree_flush_due(bulk_lsmtree)) {
+        scee::run2<bool>(app::lsmtree_flush, validator::lsmtree_flush,
+                         bulk_lsmtree);
+    }
+    ASSERT_EQ(
+        bulk_tree->BulkLoad(&tail_key, &tail_value, 1) == Retcode::Success,
+        true);
+    ASSERT_EQ(scee::run2<int64_t>(app::lsmtree_get, validator::lsmtree_get,
+                                  bulk_lsmtree, tail_key),
+              tail_value);
+    // waits for the compaction that the first step starts, while this
+    // thread runs the others
+    while (!raw::lsmtree_compact_due(bulk_lsmtree)) {
+        scee::run2<int>(app::lsmtree_set, validator::lsmtree_set, bulk_lsmtree,
+                        ++tail_key, ValueT{0});
+        while (raw::lsmtree_flush_due(bulk_lsmtree)) {
+            scee::run2<bool>(app::lsmtree_flush, validator::lsmtree_flush,
+                             bulk_lsmtree);
+        }
+    }
+    scee::run2<bool>(app::lsmtree_compact, validator::lsmtree_compact,
+                     bulk_lsmtree);
+    KeyT const compact_key = ++tail_key;
+    std::atomic<bool> loaded = false;
+    std::thread loader([&] {
+        ASSERT_EQ(bulk_tree->BulkLoad(&compact_key, &tail_value, 1) ==
+                      Retcode::Success,
+                  true);
+        loaded = true;
+    });
+    while (!loaded) {
+        scee::run2<bool>(app::lsmtree_compact, validator::lsmtree_compact,
+                         bulk_lsmtree);
+    }
+    loader.join();
+    ASSERT_EQ(scee::run2<int64_t>(app::lsmtree_get, validator::lsmtree_get,
+                                  bulk_lsmtree, compact_key),
+              tail_value);
+    bulk_tree->DumpStats(stderr);
 
     return 0;
 }
@@ -24,33 +24,50 @@ namespace app {
 namespace validator {
 #include "closure.hpp"
 }  // namespace validator
+namespace app_readonly {
+#include "closure.hpp"
+}  // namespace app_readonly
+namespace validator_readonly {
+#include "closure.hpp"
+}  // namespace validator_readonly
 
 using namespace raw;
 
 std::mt19937 rng(1234567);
 
-std::map<std::string, Val> dict;
+std::map<std::string, std::string> dict;
 
-std::pair<Key, Val> mkentry(const int alphaSize, bool inside = false) {
-    Key key;
-    Val val;
+// keys and values of random lengths, in [1/4, 1] of these
+constexpr size_t KeyLen = 64, ValLen = 256;
+
+std::string mkstring(size_t max_len, char base, const int alphaSize) {
+    std::string str(max_len / 4 + rng() % (max_len - max_len / 4 + 1), ' ');
+    for (char &ch : str) ch = rng() % alphaSize + base;
+    return str;
+}
+
+std::pair<std::string, std::string> mkentry(const int alphaSize,
+                                            bool inside = false) {
+    std::string key;
     while (true) {
-        for (size_t i = 0; i < KEY_LEN; ++i)
-            key.ch[i] = rng() % alphaSize + 'A';
+        key = mkstring(KeyLen, 'A', alphaSize);
         if (inside) {
             assert(dict.size() > 0);
-            auto it = dict.lower_bound(key.to_string());
+            auto it = dict.lower_bound(key);
             if (it == dict.end()) it = dict.begin();
-            for (size_t i = 0; i < KEY_LEN; ++i) key.ch[i] = it->first[i];
+            key = it->first;
             break;
-        } else if (!dict.count(key.to_string()))
+        } else if (!dict.count(key))
             break;
     }
-    for (size_t i = 0; i < VAL_LEN; ++i) val.ch[i] = rng() % alphaSize + 'a';
-    return std::make_pair(key, val);
+    return std::make_pair(key, mkstring(ValLen, 'a', alphaSize));
+}
+
+scee::bytes_t bytes_of(const std::string &str) {
+    return {str.data(), str.size()};
 }
 
-constexpr int MaxCap = 1 << 23, NSets = 1 << 23, NUpdates = 1 << 23,
+constexpr int InitCap = 1 << 16, NSets = 1 << 23, NUpdates = 1 << 23,
               NGets = 1 << 25, Alphabet = 26;
 constexpr int NPrints = 4;
 
@@ -60,43 +77,61 @@ enum RunType {
     SCEEProfile,
 };
 
+// run one resize closure if the hashmap is due for a resize
+template <RunType RT>
+void resize_if_due(ptr_t<hashmap_t> *hm_safe) {
+    if (!hashmap_resize_due(hm_safe)) return;
+    if constexpr (RT == RunType::Baseline) {
+        hashmap_resize(hm_safe);
+    } else {
+        using HashmapResizeType = bool (*)(scee::ptr_t<hashmap_t> *);
+        auto app_fn = reinterpret_cast<HashmapResizeType>(app::hashmap_resize);
+        auto val_fn =
+            reinterpret_cast<HashmapResizeType>(validator::hashmap_resize);
+        scee::run2(app_fn, val_fn, hm_safe);
+    }
+}
+
 template <RunType RT>
 void benchmark_fn() {
     rng.seed(1);
-    hashmap_t hmap_unsafe = hashmap_t::make(MaxCap);
+    hashmap_t hmap_unsafe = hashmap_t::make(InitCap);
     ptr_t<hashmap_t> *hm_safe = ptr_t<hashmap_t>::create(hmap_unsafe);
 
     uint64_t sum_rdtsc;
     sum_rdtsc = 0;
 
     for (int i = 0; i < NSets; ++i) {
-        std::pair<Key, Val> entry = mkentry(Alphabet, 0);
-        dict[entry.first.to_string()] = entry.second;
+        auto entry = mkentry(Alphabet, 0);
+        dict[entry.first] = entry.second;
+        Key key = bytes_of(entry.first);
+        scee::bytes_t val = bytes_of(entry.second);
         if constexpr (RT == RunType::Baseline) {
             uint64_t start = _rdtsc();
-            RetType ret = hashmap_set(hm_safe, entry.first, entry.second);
+            RetType ret = hashmap_set(hm_safe, key, val);
             sum_rdtsc += _rdtsc() - start;
             assert(ret == kCreated);
         } else {
             using HashmapSetType =
-                RetType (*)(scee::ptr_t<hashmap_t> *, Key, Val);
+                RetType (*)(scee::ptr_t<hashmap_t> *, Key, scee::bytes_t);
             auto app_fn = reinterpret_cast<HashmapSetType>(app::hashmap_set);
             auto val_fn =
                 reinterpret_cast<HashmapSetType>(validator::hashmap_set);
             RetType ret;
             if constexpr (RT == RunType::SCEE) {
                 uint64_t start = _rdtsc();
-                ret = scee::run2(app_fn, val_fn, hm_safe, entry.first,
-                                 entry.second);
+                ret = scee::run2(app_fn, val_fn, hm_safe, key, val);
                 sum_rdtsc += _rdtsc() - start;
             } else {
                 uint64_t cycles;
-                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_safe,
-                                         entry.first, entry.second);
+                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_safe, key,
+                                         val);
                 sum_rdtsc += cycles;
             }
             assert(ret == kCreated);
         }
+        // not included in the set latency
+        resize_if_due<RT>(hm_safe);
         if ((i + 1) % (NSets / NPrints) == 0) {
             fprintf(stderr, "Set %d keys: time = %lu\n", NSets / NPrints,
                     sum_rdtsc / (NSets / NPrints));
@@ -105,29 +140,30 @@ void benchmark_fn() {
     }
 
     for (int i = 0; i < NUpdates; ++i) {
-        std::pair<Key, Val> entry = mkentry(Alphabet, 1);
-        dict[entry.first.to_string()] = entry.second;
+        auto entry = mkentry(Alphabet, 1);
+        dict[entry.first] = entry.second;
+        Key key = bytes_of(entry.first);
+        scee::bytes_t val = bytes_of(entry.second);
         if constexpr (RT == RunType::Baseline) {
             uint64_t start = _rdtsc();
-            RetType ret = hashmap_set(hm_safe, entry.first, entry.second);
+            RetType ret = hashmap_set(hm_safe, key, val);
             sum_rdtsc += _rdtsc() - start;
             assert(ret == kStored);
         } else {
             using HashmapSetType =
-                RetType (*)(scee::ptr_t<hashmap_t> *, Key, Val);
+                RetType (*)(scee::ptr_t<hashmap_t> *, Key, scee::bytes_t);
             auto app_fn = reinterpret_cast<HashmapSetType>(app::hashmap_set);
             auto val_fn =
                 reinterpret_cast<HashmapSetType>(validator::hashmap_set);
             RetType ret;
             if constexpr (RT == RunType::SCEE) {
                 uint64_t start = _rdtsc();
-                ret = scee::run2(app_fn, val_fn, hm_safe, entry.first,
-                                 entry.second);
+                ret = scee::run2(app_fn, val_fn, hm_safe, key, val);
                 sum_rdtsc += _rdtsc() - start;
             } else {
                 uint64_t cycles;
-                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_safe,
-                                         entry.first, entry.second);
+                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_safe, key,
+                                         val);
                 sum_rdtsc += cycles;
             }
             assert(ret == kStored);
@@ -140,32 +176,39 @@ void benchmark_fn() {
     }
 
     for (int i = 0; i < NGets; ++i) {
-        std::pair<Key, Val> entry = mkentry(Alphabet, 1);
+        auto entry = mkentry(Alphabet, 1);
+        Key key = bytes_of(entry.first);
         if constexpr (RT == RunType::Baseline) {
             uint64_t start = _rdtsc();
-            const Val *ret = hashmap_get(hm_safe, entry.first);
+            const Val *ret = hashmap_get(hm_safe, key);
             sum_rdtsc += _rdtsc() - start;
             assert(ret != nullptr);
-            assert(*ret == dict[entry.first.to_string()]);
+            assert(ret->to_string() == dict[entry.first]);
         } else {
             using HashmapGetType =
-                const Val *(*)(scee::ptr_t<hashmap_t> *, Key);
-            auto app_fn = reinterpret_cast<HashmapGetType>(app::hashmap_get);
-            auto val_fn =
-                reinterpret_cast<HashmapGetType>(validator::hashmap_get);
+                const Val *(*)(const scee::ptr_t<hashmap_t> *, Key);
+            const scee::ptr_t<hashmap_t> *hm_const = hm_safe;
             const Val *ret;
             if constexpr (RT == RunType::SCEE) {
+                auto app_fn = reinterpret_cast<HashmapGetType>(
+                    app_readonly::hashmap_get);
+                auto val_fn = reinterpret_cast<HashmapGetType>(
+                    validator_readonly::hashmap_get);
                 uint64_t start = _rdtsc();
-                ret = scee::run2(app_fn, val_fn, hm_safe, entry.first);
+                ret = scee::run_readonly(app_fn, val_fn, hm_const, key);
                 sum_rdtsc += _rdtsc() - start;
             } else {
+                auto app_fn =
+                    reinterpret_cast<HashmapGetType>(app::hashmap_get);
+                auto val_fn =
+                    reinterpret_cast<HashmapGetType>(validator::hashmap_get);
                 uint64_t cycles;
-                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_safe,
-                                         entry.first);
+                ret = scee::run2_profile(cycles, app_fn, val_fn, hm_const,
+                                         key);
                 sum_rdtsc += cycles;
             }
             assert(ret != nullptr);
-            assert(*ret == dict[entry.first.to_string()]);
+            assert(ret->to_string() == dict[entry.first]);
         }
         if ((i + 1) % (NGets / NPrints) == 0) {
             fprintf(stderr, "Get %d keys: time = %lu\n", NGets / NPrints,
@@ -174,6 +217,8 @@ void benchmark_fn() {
         }
     }
 
+    // let the validator catch up before destroying in raw
+    scee::wait_validation();
     destroy_obj(const_cast<hashmap_t *>(hm_safe->load()));
     hm_safe->destroy();
     dict.clear();
@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <random>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "custom_stl.hpp"
+#include "log.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+#include "scee.hpp"
+#include "thread.hpp"
+#include "utils.hpp"
+
+namespace raw {
+#include "closure.hpp"
+}  // namespace raw
+namespace app {
+#include "closure.hpp"
+}  // namespace app
+namespace validator {
+#include "closure.hpp"
+}  // namespace validator
+namespace app_readonly {
+#include "closure.hpp"
+}  // namespace app_readonly
+namespace validator_readonly {
+#include "closure.hpp"
+}  // namespace validator_readonly
+
+using namespace raw;
+
+// a look-aside cache: zipfian gets over NKeys keys, and a set of the key on
+// every miss. The keys take about 8x the memory limit, so the hit rate
+// depends on what eviction keeps.
+constexpr int InitCap = 1 << 16, NKeys = 1 << 18, NOps = 1 << 22;
+constexpr int NPrints = 8;
+constexpr size_t KeyLen = 64, ValLen = 256;
+constexpr size_t MemLimit = hashmap_t::item_size(KeyLen, ValLen) * NKeys / 8;
+
+enum RunType {
+    Baseline,
+    SCEE,
+};
+
+char key_buf[KeyLen], val_buf[ValLen];
+
+Key mkkey(uint64_t id) {
+    memset(key_buf, 'k', KeyLen);
+    for (size_t i = 0; i < 16; ++i) key_buf[i] = 'a' + ((id >> (i * 4)) & 15);
+    return {key_buf, KeyLen};
+}
+
+scee::bytes_t mkval(uint64_t id) {
+    memset(val_buf, 'a' + id % 26, ValLen);
+    return {val_buf, ValLen};
+}
+
+size_t rss_kb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+template <RunType RT>
+const Val *get(ptr_t<hashmap_t> *hm_safe, uint64_t id) {
+    if constexpr (RT == RunType::Baseline) {
+        return hashmap_get(hm_safe, mkkey(id));
+    } else {
+        using HashmapGetType =
+            const Val *(*)(const scee::ptr_t<hashmap_t> *, Key);
+        auto app_fn =
+            reinterpret_cast<HashmapGetType>(app_readonly::hashmap_get);
+        auto val_fn =
+            reinterpret_cast<HashmapGetType>(validator_readonly::hashmap_get);
+        const scee::ptr_t<hashmap_t> *hm_const = hm_safe;
+        return scee::run_readonly(app_fn, val_fn, hm_const, mkkey(id));
+    }
+}
+
+template <RunType RT>
+RetType set(ptr_t<hashmap_t> *hm_safe, uint64_t id) {
+    if constexpr (RT == RunType::Baseline) {
+        return hashmap_set(hm_safe, mkkey(id), mkval(id));
+    } else {
+        using HashmapSetType =
+            RetType (*)(scee::ptr_t<hashmap_t> *, Key, scee::bytes_t);
+        auto app_fn = reinterpret_cast<HashmapSetType>(app::hashmap_set);
+        auto val_fn = reinterpret_cast<HashmapSetType>(validator::hashmap_set);
+        return scee::run2(app_fn, val_fn, hm_safe, mkkey(id), mkval(id));
+    }
+}
+
+template <RunType RT>
+void touch(ptr_t<hashmap_t> *hm_safe, const touch_t &touches) {
+    if constexpr (RT == RunType::Baseline) {
+        hashmap_touch(hm_safe, touches.bytes());
+    } else {
+        using HashmapTouchType =
+            void (*)(scee::ptr_t<hashmap_t> *, scee::bytes_t);
+        auto app_fn = reinterpret_cast<HashmapTouchType>(app::hashmap_touch);
+        auto val_fn =
+            reinterpret_cast<HashmapTouchType>(validator::hashmap_touch);
+        scee::run2(app_fn, val_fn, hm_safe, touches.bytes());
+    }
+}
+
+// run resize and evict closures while the hashmap is due for them
+template <RunType RT>
+void maintain(ptr_t<hashmap_t> *hm_safe) {
+    using HashmapStepType = bool (*)(scee::ptr_t<hashmap_t> *);
+    if (hashmap_resize_due(hm_safe)) {
+        if constexpr (RT == RunType::Baseline) {
+            hashmap_resize(hm_safe);
+        } else {
+            auto app_fn =
+                reinterpret_cast<HashmapStepType>(app::hashmap_resize);
+            auto val_fn =
+                reinterpret_cast<HashmapStepType>(validator::hashmap_resize);
+            scee::run2(app_fn, val_fn, hm_safe);
+        }
+    }
+    bool busy = true;
+    while (busy && hashmap_evict_due(hm_safe)) {
+        if constexpr (RT == RunType::Baseline) {
+            busy = hashmap_evict(hm_safe);
+        } else {
+            auto app_fn =
+                reinterpret_cast<HashmapStepType>(app::hashmap_evict);
+            auto val_fn =
+                reinterpret_cast<HashmapStepType>(validator::hashmap_evict);
+            busy = scee::run2(app_fn, val_fn, hm_safe);
+        }
+    }
+}
+
+// one in `sample` gets marks its key referenced, 0 for none (FIFO order)
+template <RunType RT>
+void cache_fn(uint32_t sample) {
+    ptr_t<hashmap_t> *hm_safe =
+        ptr_t<hashmap_t>::create(hashmap_t::make(InitCap));
+    hashmap_set_limit(hm_safe, MemLimit);
+    std::mt19937 rng(1234567);
+    zipf_table_distribution<> zipf(NKeys, 0.99);
+    touch_t touches;
+
+    uint64_t sum_rdtsc = 0, hits = 0;
+    for (uint64_t i = 0; i < NOps; ++i) {
+        uint64_t id = zipf(rng);
+        uint64_t start = _rdtsc();
+        const Val *val = get<RT>(hm_safe, id);
+        if (val != nullptr) {
+            assert(val->length == ValLen && val->v[0] == 'a' + id % 26);
+            hits++;
+            if (sample != 0 && i % sample == 0) {
+                if (!touches.push(mkkey(id))) {
+                    touch<RT>(hm_safe, touches);
+                    touches.clear();
+                    touches.push(mkkey(id));
+                }
+            }
+        } else {
+            RetType ret = set<RT>(hm_safe, id);
+            assert(ret == kCreated);
+            maintain<RT>(hm_safe);
+        }
+        if (touches.full()) {
+            touch<RT>(hm_safe, touches);
+            touches.clear();
+        }
+        sum_rdtsc += _rdtsc() - start;
+        if ((i + 1) % (NOps / NPrints) == 0) {
+            fprintf(stderr,
+                    "Cache %d ops: time = %lu, hit rate = %.3f, "
+                    "bytes = %lu KB, evictions = %lu, rss = %lu KB\n",
+                    NOps / NPrints, sum_rdtsc / (NOps / NPrints),
+                    (double)hits / (NOps / NPrints),
+                    hashmap_bytes(hm_safe) / 1024, hashmap_evictions(hm_safe),
+                    rss_kb());
+            sum_rdtsc = hits = 0;
+        }
+    }
+
+    // let the validator catch up before destroying in raw
+    scee::wait_validation();
+    destroy_obj(const_cast<hashmap_t *>(hm_safe->load()));
+    hm_safe->destroy();
+    fprintf(stderr, "Test passed!!!\n");
+}
+
+int main_fn(RunType rt, uint32_t sample) {
+    switch (rt) {
+    case RunType::Baseline:
+        cache_fn<RunType::Baseline>(sample);
+        break;
+    case RunType::SCEE:
+        cache_fn<RunType::SCEE>(sample);
+        break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s [baseline|scee] [sample=8]\n", argv[0]);
+        return 1;
+    }
+    uint32_t sample = argc == 3 ? atoi(argv[2]) : 8;
+    if (strcmp(argv[1], "baseline") == 0) {
+        scee::main_thread(main_fn, RunType::Baseline, sample);
+    } else if (strcmp(argv[1], "scee") == 0) {
+        scee::main_thread(main_fn, RunType::SCEE, sample);
+    } else {
+        fprintf(stderr, "Usage: %s [baseline|scee] [sample=8]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
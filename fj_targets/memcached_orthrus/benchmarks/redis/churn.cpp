@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "custom_stl.hpp"
+#include "log.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+#include "scee.hpp"
+#include "thread.hpp"
+
+namespace raw {
+#include "closure.hpp"
+}  // namespace raw
+namespace app {
+#include "closure.hpp"
+}  // namespace app
+namespace validator {
+#include "closure.hpp"
+}  // namespace validator
+
+using namespace raw;
+
+// set/del churn: a sliding window of NLive keys, each op sets a new key and
+// deletes the oldest one. The number of keys is constant, so RSS should stay
+// bounded once deleted entries are reclaimed through the free log.
+constexpr int InitCap = 1 << 16, NLive = 1 << 18, NRounds = 1 << 24;
+constexpr int NPrints = 16;
+
+enum RunType {
+    Baseline,
+    SCEE,
+};
+
+constexpr size_t KeyLen = 64, ValLen = 256;
+char key_buf[KeyLen], val_buf[ValLen];
+
+Key mkkey(uint64_t id) {
+    memset(key_buf, 'k', KeyLen);
+    for (size_t i = 0; i < 16; ++i) key_buf[i] = 'a' + ((id >> (i * 4)) & 15);
+    return {key_buf, KeyLen};
+}
+
+scee::bytes_t mkval(uint64_t id) {
+    memset(val_buf, 'a' + id % 26, ValLen);
+    return {val_buf, ValLen};
+}
+
+size_t rss_kb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+template <RunType RT>
+RetType set(ptr_t<hashmap_t> *hm_safe, uint64_t id) {
+    if constexpr (RT == RunType::Baseline) {
+        return hashmap_set(hm_safe, mkkey(id), mkval(id));
+    } else {
+        using HashmapSetType =
+            RetType (*)(scee::ptr_t<hashmap_t> *, Key, scee::bytes_t);
+        auto app_fn = reinterpret_cast<HashmapSetType>(app::hashmap_set);
+        auto val_fn = reinterpret_cast<HashmapSetType>(validator::hashmap_set);
+        return scee::run2(app_fn, val_fn, hm_safe, mkkey(id), mkval(id));
+    }
+}
+
+template <RunType RT>
+RetType del(ptr_t<hashmap_t> *hm_safe, uint64_t id) {
+    if constexpr (RT == RunType::Baseline) {
+        return hashmap_del(hm_safe, mkkey(id));
+    } else {
+        using HashmapDelType = RetType (*)(scee::ptr_t<hashmap_t> *, Key);
+        auto app_fn = reinterpret_cast<HashmapDelType>(app::hashmap_del);
+        auto val_fn = reinterpret_cast<HashmapDelType>(validator::hashmap_del);
+        return scee::run2(app_fn, val_fn, hm_safe, mkkey(id));
+    }
+}
+
+// run one resize closure if the hashmap is due for a resize
+template <RunType RT>
+void resize_if_due(ptr_t<hashmap_t> *hm_safe) {
+    if (!hashmap_resize_due(hm_safe)) return;
+    if constexpr (RT == RunType::Baseline) {
+        hashmap_resize(hm_safe);
+    } else {
+        using HashmapResizeType = bool (*)(scee::ptr_t<hashmap_t> *);
+        auto app_fn = reinterpret_cast<HashmapResizeType>(app::hashmap_resize);
+        auto val_fn =
+            reinterpret_cast<HashmapResizeType>(validator::hashmap_resize);
+        scee::run2(app_fn, val_fn, hm_safe);
+    }
+}
+
+template <RunType RT>
+void churn_fn() {
+    ptr_t<hashmap_t> *hm_safe =
+        ptr_t<hashmap_t>::create(hashmap_t::make(InitCap));
+    for (uint64_t id = 0; id < NLive; ++id) {
+        RetType ret = set<RT>(hm_safe, id);
+        assert(ret == kCreated);
+        resize_if_due<RT>(hm_safe);
+    }
+    fprintf(stderr, "Loaded %d keys: rss = %lu KB\n", NLive, rss_kb());
+
+    uint64_t sum_rdtsc = 0;
+    for (uint64_t i = 0; i < NRounds; ++i) {
+        uint64_t start = _rdtsc();
+        RetType ret = set<RT>(hm_safe, NLive + i);
+        assert(ret == kCreated);
+        ret = del<RT>(hm_safe, i);
+        assert(ret == kDeleted);
+        sum_rdtsc += _rdtsc() - start;
+        resize_if_due<RT>(hm_safe);
+        if ((i + 1) % (NRounds / NPrints) == 0) {
+            fprintf(stderr, "Churn %d set+del: time = %lu, rss = %lu KB\n",
+                    NRounds / NPrints, sum_rdtsc / (NRounds / NPrints),
+                    rss_kb());
+            sum_rdtsc = 0;
+        }
+    }
+
+    // let the validator catch up before destroying in raw
+    scee::wait_validation();
+    destroy_obj(const_cast<hashmap_t *>(hm_safe->load()));
+    hm_safe->destroy();
+    fprintf(stderr, "Test passed!!!\n");
+}
+
+int main_fn(RunType rt) {
+    switch (rt) {
+    case RunType::Baseline:
+        churn_fn<RunType::Baseline>();
+        break;
+    case RunType::SCEE:
+        churn_fn<RunType::SCEE>();
+        break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s [baseline|scee]\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "baseline") == 0) {
+        scee::main_thread(main_fn, RunType::Baseline);
+    } else if (strcmp(argv[1], "scee") == 0) {
+        scee::main_thread(main_fn, RunType::SCEE);
+    } else {
+        fprintf(stderr, "Usage: %s [baseline|scee]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
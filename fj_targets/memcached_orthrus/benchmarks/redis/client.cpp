@@ -1,11 +1,14 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <deque>
 #include <random>
 #include <thread>
 #include <vector>
@@ -14,12 +17,14 @@
 #include "monitor.hpp"
 #include "utils.hpp"
 
-// client reside on any server that is not shared with others
-constexpr int kNumClientCores = 16;
 // const int kLowestCore = 4;
 
+// sizes of the generated keys and values
+constexpr size_t KEY_LEN = 64, VAL_LEN = 256;
+
 static std::string ip, output_file;
-static uint32_t port, nsets, ngets, nclients, rps;
+static uint32_t port, nsets, ngets, nclients, rps, nports, nconns, nstalled;
+static double get_ratio;
 
 static inline void write_all(int fd, const char *buf, size_t len) {
     size_t written = 0;
@@ -47,10 +52,12 @@ private:
 
 static inline size_t prepare_setcmd(char *dst, const char *key,
                                     const char *val) {
+    char head[32];
+    int head_len = snprintf(head, sizeof(head), " %zu\r\n", VAL_LEN);
     MemcpyMonad m(dst);
     m.Copy("set ", strlen("set "))
         .Copy(key, KEY_LEN)
-        .Copy(" ", 1)
+        .Copy(head, head_len)
         .Copy(val, VAL_LEN)
         .Copy(kCrlf, strlen(kCrlf));
     return m.Offset();
@@ -72,6 +79,30 @@ static inline size_t prepare_delcmd(char *dst, const char *key) {
     return m.Offset();
 }
 
+// the length of a complete response at the front of rx_buf, 0 if incomplete:
+// one line, or "VALUE <bytes>\r\n<value>\r\n"
+static inline size_t response_len(const char *rx_buf, size_t rx_len) {
+    const char *eol = (const char *)memchr(rx_buf, '\n', rx_len);
+    if (eol == nullptr) return 0;
+    size_t len = eol - rx_buf + 1;
+    size_t prefix_len = strlen(kRetVals[kValue]);
+    if (strncmp(rx_buf, kRetVals[kValue], prefix_len) == 0) {
+        len += strtoul(rx_buf + prefix_len, nullptr, 10) + strlen(kCrlf);
+    }
+    return len <= rx_len ? len : 0;
+}
+
+static inline size_t read_response(int fd, char *rx_buf, size_t buf_len) {
+    size_t rx_len = 0, len = 0;
+    while (len == 0) {
+        ssize_t ret = read(fd, rx_buf + rx_len, buf_len - rx_len);
+        assert(ret > 0);
+        rx_len += ret;
+        len = response_len(rx_buf, rx_len);
+    }
+    return len;
+}
+
 static inline int parse_getret(char *rx_buf, size_t rx_len, char *value,
                                size_t value_buf_len, size_t *value_len) {
     size_t prefix_len = strlen(kRetVals[kValue]);
@@ -81,8 +112,8 @@ static inline int parse_getret(char *rx_buf, size_t rx_len, char *value,
     if (rx_buf[rx_len - 2] != '\r' || rx_buf[rx_len - 1] != '\n') {
         return -1;
     }
-    const char *p = rx_buf + prefix_len;
-    size_t vlen = rx_len - prefix_len - 2;
+    const char *p = (const char *)memchr(rx_buf, '\n', rx_len) + 1;
+    size_t vlen = rx_len - (p - rx_buf) - 2;
     assert(vlen <= value_buf_len);
     memcpy(value, p, vlen);
     *value_len = vlen;
@@ -94,6 +125,12 @@ inline std::chrono::steady_clock::time_point microtime(void) {
     return start;
 }
 
+inline uint64_t nanotime(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
 inline uint64_t microtime_diff(
     const std::chrono::steady_clock::time_point &start,
     const std::chrono::steady_clock::time_point &end) {
@@ -115,6 +152,11 @@ const uint32_t kMaxNumThreads = 32;
 const uint32_t kMaxPrintIntervalUs = 1000000;
 const uint32_t kMaxNumOps = 1 << 25;
 const int kBufferSize = 1024;
+// requests sent but not answered on a connection of the open-loop client:
+// beyond this, it reads before sending more, so neither side blocks on a
+// full socket buffer
+const uint32_t kMaxInflight = 256;
+const size_t kRxBufferSize = 1 << 16;
 
 FILE *logger;
 uint32_t kNumThreads, kNumOpsPerThread;
@@ -147,7 +189,9 @@ void init_rng() {
     }
 }
 
-int connect_server() {
+// client i connects to port + i % nports: nports = 1 for servers sharing a
+// port (SO_REUSEPORT), nports = num_servers for one port per server
+int connect_server(uint32_t i) {
     struct sockaddr_in server_addr;
     int fd;
 
@@ -159,7 +203,7 @@ int connect_server() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     inet_aton(ip.c_str(), &server_addr.sin_addr);
-    server_addr.sin_port = htons(port);
+    server_addr.sin_port = htons(port + i % nports);
 
     if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         assert(false);
@@ -229,7 +273,7 @@ void run_set() {
     is_init = false;
     for (uint32_t i = 0; i < kNumThreads; ++i) {
         threads.emplace_back([i, &monitor]() {
-            int fd = connect_server();
+            int fd = connect_server(i);
             assert(fd >= 0);
             std::vector<char> tx_buf(kBufferSize);
             std::vector<char> rx_buf(kBufferSize);
@@ -239,10 +283,11 @@ void run_set() {
                 random_string(val.data, VAL_LEN, rngs[i].get());
                 size_t len = prepare_setcmd(tx_buf.data(), key.data, val.data);
 
-                uint64_t timestamp = rdtsc();
+                uint64_t timestamp = nanotime();
                 write_all(fd, tx_buf.data(), len);
-                size_t rx_len = read(fd, rx_buf.data(), kBufferSize);
-                monitor.latency[k] = rdtsc() - timestamp;
+                size_t rx_len =
+                    read_response(fd, rx_buf.data(), kBufferSize);
+                monitor.record(i, nanotime() - timestamp);
 
                 assert(rx_len > 0);
                 if (strncmp(rx_buf.data(), kRetVals[ret_type],
@@ -250,7 +295,6 @@ void run_set() {
                     printf("Set error: key %s\n",
                            std::string(key.data, KEY_LEN).c_str());
                 }
-                monitor.cnts[i].c++;
 
                 uint64_t completed = (uint64_t)(k + kNumThreads) * kNumPrints;
                 if (completed % kNumKVPairs < kNumThreads * kNumPrints) {
@@ -269,55 +313,183 @@ void run_set() {
     threads.clear();
 }
 
-void run_get() {
+// a request in flight: which key, and when it was meant to be sent
+struct pending_t {
+    uint32_t key_idx;
+    bool is_get;
+    uint64_t intended_ns;
+};
+
+struct conn_t {
+    int fd;
+    std::deque<pending_t> inflight;
+    std::vector<char> rx_buf;
+    size_t rx_len;
+};
+
+// check the response to a request of the mixed phase
+static void check_response(const pending_t &req, char *rx_buf, size_t rx_len) {
+    auto &key = all_keys[req.key_idx];
+    auto &val = all_vals[req.key_idx];
+    if (!req.is_get) {
+        if (strncmp(rx_buf, kRetVals[kStored], strlen(kRetVals[kStored]))) {
+            printf("Set error: key %s\n",
+                   std::string(key.data, KEY_LEN).c_str());
+        }
+        return;
+    }
+    char buf[VAL_LEN];
+    size_t val_len;
+    int r = parse_getret(rx_buf, rx_len, buf, VAL_LEN, &val_len);
+    if (r != 0) {
+        printf("Get error: key %s\n", std::string(key.data, KEY_LEN).c_str());
+    } else {
+        assert(val_len == VAL_LEN);
+        if (memcmp(val.data, buf, VAL_LEN)) {
+            printf("Get error: key %s, val %s %s\n",
+                   std::string(key.data, KEY_LEN).c_str(),
+                   std::string(val.data, VAL_LEN).c_str(),
+                   std::string(buf, VAL_LEN).c_str());
+            assert(false);
+        }
+    }
+}
+
+/**
+ * The measured phase: each thread runs kNumOpsPerThread zipfian requests over
+ * nconns connections, a get with probability get_ratio and otherwise a set of
+ * the key to its current value (so gets still see the values of run_set()).
+ *
+ * Closed loop (rps = 0): one request in flight per connection. Open loop:
+ * requests are sent at Poisson arrivals of rps / nclients per thread,
+ * whether or not earlier ones were answered, and pipelined on the
+ * connections in turn. Latency is counted from the intended send time, so
+ * a server that falls behind is charged for the queueing it causes.
+ */
+/**
+ * Connections that send gets until the server stops reading, and never read
+ * the responses: the server must go on serving the other connections, and
+ * must not keep the values of the stalled responses pinned meanwhile.
+ */
+std::vector<int> stall_conns() {
+    std::vector<int> fds;
+    std::vector<char> tx_buf(kBufferSize);
+    for (uint32_t c = 0; c < nstalled; ++c) {
+        int fd = connect_server(c);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        size_t len = prepare_getcmd(tx_buf.data(), all_keys[0].data);
+        while (write(fd, tx_buf.data(), len) == (ssize_t)len) {
+        }
+        fds.push_back(fd);
+    }
+    if (nstalled > 0) {
+        fprintf(stderr, "%d stalled connections\n", nstalled);
+    }
+    return fds;
+}
+
+void run_mix() {
     prepare_zipf_index();
-    fprintf(stderr, "GET (nthreads=%d) start running...\n", kNumThreads);
+    std::vector<int> stalled = stall_conns();
+    const char *task = get_ratio >= 1 ? "GET" : "MIX";
+    fprintf(stderr, "%s (nthreads=%d, nconns=%d, rps=%d) start running...\n",
+            task, kNumThreads, nconns, rps);
     std::vector<std::thread> threads;
     monitor::evaluation monitor(logger, kNumOpsPerThread * kNumThreads,
-                                kNumThreads, "GET");
+                                kNumThreads, task);
     for (uint32_t i = 0; i < kNumThreads; ++i) {
         threads.emplace_back([i, &monitor]() {
-            int fd = connect_server();
-            assert(fd >= 0);
-            Value val;
+            std::vector<conn_t> conns(nconns);
+            std::vector<pollfd> pfds(nconns);
+            for (uint32_t c = 0; c < nconns; ++c) {
+                conns[c].fd = connect_server(i + c * kNumThreads);
+                conns[c].rx_buf.resize(kRxBufferSize);
+                conns[c].rx_len = 0;
+                pfds[c] = {conns[c].fd, POLLIN, 0};
+            }
+            std::mt19937 &rng = *rngs[i];
+            std::bernoulli_distribution is_get(get_ratio);
+            std::exponential_distribution<double> interval(
+                rps / 1e9 / kNumThreads);
             std::vector<char> tx_buf(kBufferSize);
-            std::vector<char> rx_buf(kBufferSize);
-            for (uint32_t k = 0; k < kNumOpsPerThread; ++k) {
-                auto &key = all_keys[zipf_key_indices[k * kNumThreads + i]];
-                auto &val = all_vals[zipf_key_indices[k * kNumThreads + i]];
-                char buf[VAL_LEN];
-                size_t val_len;
-                size_t len = prepare_getcmd(tx_buf.data(), key.data);
-                uint64_t timestamp = rdtsc();
-                write_all(fd, tx_buf.data(), len);
-                size_t rx_len = read(fd, rx_buf.data(), kBufferSize);
-                monitor.latency[k * kNumThreads + i] = rdtsc() - timestamp;
-                assert(rx_len > 0);
-                int r =
-                    parse_getret(rx_buf.data(), rx_len, buf, VAL_LEN, &val_len);
-                if (r != 0) {
-                    printf("Get error: key %s\n",
-                           std::string(key.data, KEY_LEN).c_str());
+
+            auto send = [&](conn_t &conn, uint32_t k, uint64_t intended) {
+                uint32_t idx = zipf_key_indices[k * kNumThreads + i];
+                bool get = is_get(rng);
+                size_t len =
+                    get ? prepare_getcmd(tx_buf.data(), all_keys[idx].data)
+                        : prepare_setcmd(tx_buf.data(), all_keys[idx].data,
+                                         all_vals[idx].data);
+                conn.inflight.push_back({idx, get, intended});
+                write_all(conn.fd, tx_buf.data(), len);
+            };
+
+            uint32_t sent = 0, done = 0, next_conn = 0;
+            uint64_t next_send = nanotime();
+            while (done < kNumOpsPerThread) {
+                uint64_t now = nanotime();
+                bool throttled = false;
+                if (rps == 0) {
+                    for (auto &conn : conns) {
+                        if (sent < kNumOpsPerThread && conn.inflight.empty()) {
+                            send(conn, sent++, now);
+                        }
+                    }
                 } else {
-                    assert(val_len == VAL_LEN);
-                    if (memcmp(val.data, buf, VAL_LEN)) {
-                        printf("Get error: key %s, val %s %s\n",
-                               std::string(key.data, KEY_LEN).c_str(),
-                               std::string(val.data, VAL_LEN).c_str(),
-                               std::string(buf, VAL_LEN).c_str());
-                        assert(false);
+                    while (sent < kNumOpsPerThread && next_send <= now) {
+                        conn_t &conn = conns[next_conn];
+                        if (conn.inflight.size() >= kMaxInflight) {
+                            throttled = true;
+                            break;
+                        }
+                        send(conn, sent++, next_send);
+                        next_send += interval(rng);
+                        next_conn = (next_conn + 1) % nconns;
                     }
                 }
-                monitor.cnts[i].c++;
 
-                uint64_t completed = (uint64_t)(k + 1) * kNumPrints;
-                if (completed % kNumOpsPerThread < kNumPrints) {
-                    completed /= kNumOpsPerThread;
-                    if (completed % kNumThreads == i) {
-                        monitor.report();
+                // wait for responses, or until the next request is due
+                timespec timeout{0, 0}, *ptimeout = nullptr;
+                if (rps != 0 && sent < kNumOpsPerThread && !throttled) {
+                    now = nanotime();
+                    uint64_t wait = next_send > now ? next_send - now : 0;
+                    timeout.tv_sec = wait / 1000000000;
+                    timeout.tv_nsec = wait % 1000000000;
+                    ptimeout = &timeout;
+                }
+                int ret = ppoll(pfds.data(), nconns, ptimeout, nullptr);
+                assert(ret >= 0);
+                for (uint32_t c = 0; c < nconns && ret > 0; ++c) {
+                    if (pfds[c].revents == 0) continue;
+                    conn_t &conn = conns[c];
+                    ssize_t n = read(conn.fd, conn.rx_buf.data() + conn.rx_len,
+                                     kRxBufferSize - conn.rx_len);
+                    assert(n > 0);
+                    conn.rx_len += n;
+                    size_t off = 0, len;
+                    while ((len = response_len(conn.rx_buf.data() + off,
+                                               conn.rx_len - off)) > 0) {
+                        assert(!conn.inflight.empty());
+                        pending_t req = conn.inflight.front();
+                        conn.inflight.pop_front();
+                        monitor.record(i, nanotime() - req.intended_ns);
+                        check_response(req, conn.rx_buf.data() + off, len);
+                        off += len;
+
+                        uint64_t completed = (uint64_t)(++done) * kNumPrints;
+                        if (completed % kNumOpsPerThread < kNumPrints) {
+                            completed /= kNumOpsPerThread;
+                            if (completed % kNumThreads == i) {
+                                monitor.report();
+                            }
+                        }
                     }
+                    memmove(conn.rx_buf.data(), conn.rx_buf.data() + off,
+                            conn.rx_len - off);
+                    conn.rx_len -= off;
                 }
             }
+            for (auto &conn : conns) close(conn.fd);
         });
         // bind_core(threads[i].native_handle(), i + kLowestCore);
     }
@@ -325,18 +497,24 @@ void run_get() {
         threads[i].join();
     }
     threads.clear();
+    for (int fd : stalled) close(fd);
 }
 
 int main(int argc, char **argv) {
-    if (argc >= 9 || argc <= 1) {
+    if (argc >= 13 || argc <= 1) {
         fprintf(stderr,
                 "Usage: %s <ip> <port> <log_file> <nclients> <nsets> <ngets> "
-                "<rps>\n",
+                "<rps> <nports> <get_ratio> <nconns> <nstalled>\n",
                 argv[0]);
         fprintf(stderr,
                 "Default values: ip=127.0.0.1, port=6379, "
                 "log_file=build/client.log, nclients=16, nsets=1<<22, "
-                "ngets=1<<20, rps=0\n");
+                "ngets=1<<20, rps=0, nports=1, get_ratio=1, nconns=1, "
+                "nstalled=0\n");
+        fprintf(stderr,
+                "ngets: requests per client in the measured phase, "
+                "rps: offered load of all clients (0 for closed loop), "
+                "nstalled: connections that never read their responses\n");
         return 1;
     }
     ip = argc >= 2 ? argv[1] : "127.0.0.1";
@@ -346,13 +524,17 @@ int main(int argc, char **argv) {
     nsets = argc >= 6 ? 1 << atoi(argv[5]) : 1 << 22;
     ngets = argc >= 7 ? 1 << atoi(argv[6]) : 1 << 20;
     rps = argc >= 8 ? atoi(argv[7]) : 0;
+    nports = argc >= 9 ? atoi(argv[8]) : 1;
+    get_ratio = argc >= 10 ? atof(argv[9]) : 1;
+    nconns = argc >= 11 ? atoi(argv[10]) : 1;
+    nstalled = argc >= 12 ? atoi(argv[11]) : 0;
     logger = fopen(output_file.c_str(), "w");
     init_array();
     init_rng();
     prepare_key();
     run_set<kCreated>();  // set
     run_set<kStored>();   // update
-    run_get();            // get
+    run_mix();            // get, or a mix of gets and updates
     fclose(logger);
     return 0;
 }
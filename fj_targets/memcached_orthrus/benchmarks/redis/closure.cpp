@@ -1,3 +1,5 @@
+#include <immintrin.h>
+
 #include <algorithm>
 #include <cstdint>
 #include <cstring>
@@ -14,109 +16,179 @@ namespace NAMESPACE {
 
 using namespace ::scee;
 
-hashmap_t::entry_t::entry_t(Key key, Val val, fixed_ptr_t<entry_t> next)
-    : key(key), val_ptr(ptr_t<Val>::create(val)), next(next) {}
+#include "lookup.hpp"
+
+// the CLOCK reference bit is the low bit of a value pointer
+static bool is_referenced(const Val *val) { return uintptr_t(val) & 1; }
+
+static const Val *referenced(const Val *val) {
+    return reinterpret_cast<const Val *>(uintptr_t(val) | 1);
+}
+
+hashmap_t::entry_t::entry_t(Key key, uint32_t hash, bytes_t val,
+                            fixed_ptr_t<entry_t> next)
+    : val_ptr(ptr_t<Val>::create(Val(val))),
+      next(next),
+      key(key.data),
+      hash(hash),
+      klen(key.len) {}
+
+hashmap_t::entry_t::entry_t(const entry_t *entry, fixed_ptr_t<entry_t> next)
+    : val_ptr(entry->val_ptr),
+      next(next),
+      key(entry->key),
+      hash(entry->hash),
+      klen(entry->klen) {}
+
+void hashmap_t::entry_t::write_at(void *shadow, void *real, size_t size) const {
+    void *real_key = add_byte_offset(real, sizeof(entry_t));
+    memcpy(shadow, this, sizeof(entry_t));
+    static_cast<entry_t *>(shadow)->key = static_cast<const char *>(real_key);
+    memcpy(add_byte_offset(shadow, sizeof(entry_t)), key, klen);
+}
 
 void hashmap_t::entry_t::destroy() const {
     if (val_ptr != nullptr) {
-        destroy_obj(const_cast<Val *>(val_ptr->load()));
+        destroy_obj(const_cast<Val *>(unreferenced(val_ptr->load())));
         val_ptr->destroy();
     }
 }
 
-void hashmap_t::entry_t::setv(Val val) const { val_ptr->store(val); }
+size_t hashmap_t::entry_t::setv(bytes_t val) const {
+    const Val *old = unreferenced(val_ptr->load());
+    size_t old_len = old->length;
+    val_ptr->reref(referenced(ptr_t<Val>::make_obj(Val(val))));
+    destroy_obj(const_cast<Val *>(old));
+    return old_len;
+}
 
-const Val *hashmap_t::entry_t::getv() const { return val_ptr->load(); }
+void hashmap_t::entry_t::touch() const {
+    const Val *val = val_ptr->load();
+    if (!is_referenced(val)) val_ptr->reref(referenced(val));
+}
 
-hashmap_t hashmap_t::make(size_t capacity) {
+const Val *hashmap_t::entry_t::clear(bool *was_referenced) const {
+    const Val *val = val_ptr->load();
+    *was_referenced = is_referenced(val);
+    if (*was_referenced) val_ptr->reref(unreferenced(val));
+    return unreferenced(val);
+}
+
+hashmap_t hashmap_t::make(size_t capacity, size_t nstripes) {
     hashmap_t hm;
-    hm.capacity = capacity;
-    if (capacity > 0) {
-        mut_array_t<entry_t> zeros(nullptr, capacity);
-        hm.buckets = ptr_t<mut_array_t<entry_t>>::create_fixed(zeros);
-        hm.locks = mutable_list_t<mutex_t>::create(capacity);
-    }
+    hm.map = map_t::make(capacity, nstripes);
+    hm.hand = ptr_t<size_t>::create(size_t{0});
+    hm.ctl = new (alloc_ctl(sizeof(ctl_t))) ctl_t();
     return hm;
 }
 
 void hashmap_t::destroy() const {
-    if (capacity > 0) {
-        for (size_t i = 0; i < capacity; ++i) {
-            const entry_t *entry = buckets.get()->v[i]->load();
-            if (entry != nullptr) {
-                entry = entry->next.get();
-                while (entry != nullptr) {  // next will not be nullptr
-                    const entry_t *enext = entry->next.get();
-                    destroy_obj(const_cast<entry_t *>(entry));
-                    entry = enext;
-                }
-            }
-        }
-        buckets.destroy();
-        locks.destroy();
-    }
+    map.destroy();
+    destroy_obj(const_cast<size_t *>(hand->load()));
+    hand->destroy();
+    if constexpr (!is_validator()) ctl->~ctl_t();
+    free_ctl(ctl);
 }
 
-const Val *hashmap_t::get(const Key &key) const {
-    uint32_t hv = key.hash() % capacity;
-    lock_guard_t guard(&locks.v[hv]);
-    const entry_t *bucket = buckets.get()->v[hv]->load();
-    while (bucket != nullptr) {
-        if (bucket->key == key) {
-            return bucket->getv();
+RetType hashmap_t::set(Key key, bytes_t val) const {
+    uint32_t hash = key_hash(key);
+    map_t::stripe_guard_t guard(map.stripe_of(hash));
+    auto slot = map.locate(key, hash);
+    if (slot.entry != nullptr) {
+        size_t old_len = slot.entry->setv(val);
+        if constexpr (!is_validator()) {
+            ctl->bytes += val.len;
+            ctl->bytes -= old_len;
         }
-        bucket = bucket->next.get();
-    }
-    return nullptr;
-}
-
-RetType hashmap_t::set(const Key &key, const Val &val) const {
-    uint32_t hv = key.hash() % capacity;
-    lock_guard_t guard(&locks.v[hv]);
-    const mut_array_t<entry_t> *_buckets = buckets.get();
-    const entry_t *head = _buckets->v[hv]->load();
-    const entry_t *bucket = head;
-    while (bucket != nullptr) {
-        if (bucket->key == key) {
-            bucket->setv(val);
-            return kStored;
-        }
-        bucket = bucket->next.get();
+        return kStored;
     }
     // originally, we are changing entry_t*, will become ptr_t.reref
-    const entry_t *new_entry =
-        ptr_t<entry_t>::make_obj(entry_t(key, val, fixed_ptr_t<entry_t>(head)));
-    _buckets->v[hv]->reref(new_entry);
+    const entry_t *new_entry = ptr_t<entry_t>::make_obj(
+        entry_t(key, hash, val, fixed_ptr_t<entry_t>(slot.last().first)));
+    map.insert(slot, new_entry);
+    if constexpr (!is_validator()) ctl->bytes += item_size(key.len, val.len);
     return kCreated;
 }
 
-RetType hashmap_t::del(const Key &key) const {
-    std::abort();
-    /*
-    uint32_t hv = key.hash() % capacity;
-    // lock_guard_t guard(&locks.v[hv]);
-    ptr_t<entry_t> *head = buckets.get()->v[hv];
-    const entry_t *bucket = head->load();
-    while (bucket != nullptr) {
-        if (bucket->key == key) {
-            const entry_t *next = bucket->next->load();
-            head->reref(next);
-            bucket->next->destroy();
-            destroy_obj(const_cast<entry_t *>(bucket));
-            return kDeleted;
-        }
-        head = bucket->next;
-        bucket = head->load();
+void hashmap_t::touch(Key key) const {
+    uint32_t hash = key_hash(key);
+    map_t::stripe_guard_t guard(map.stripe_of(hash));
+    auto slot = map.locate(key, hash);
+    if (slot.entry != nullptr) slot.entry->touch();
+}
+
+// the caller holds the stripe of head
+void hashmap_t::remove(ptr_t<entry_t> *head, const entry_t *first,
+                       const entry_t *target, const Val *val) const {
+    map.remove(head, first, target);
+    if constexpr (!is_validator()) {
+        ctl->bytes -= item_size(target->klen, val->length);
     }
-    return kNotFound;
-    */
+    // not destroy_obj(target): entry_t::destroy() loads val_ptr at run() only
+    destroy_obj(const_cast<Val *>(val));
+    target->val_ptr->destroy();
+    free_obj(const_cast<entry_t *>(target));
+}
+
+RetType hashmap_t::del(Key key) const {
+    uint32_t hash = key_hash(key);
+    map_t::stripe_guard_t guard(map.stripe_of(hash));
+    auto slot = map.locate(key, hash);
+    if (slot.entry == nullptr) return kNotFound;
+    const auto &chain = slot.chains[slot.chain];
+    remove(chain.head, chain.first, slot.entry, slot.entry->getv());
+    return kDeleted;
+}
+
+bool hashmap_t::resize_due() const { return map.resize_due(); }
+
+bool hashmap_t::resize_step() const { return map.resize_step(); }
+
+bool hashmap_t::evict_due() const {
+    return ctl->limit != 0 && ctl->bytes > ctl->limit;
 }
 
-const Val *hashmap_get(ptr_t<hashmap_t> *hmap, Key key) {
-    return hmap->load()->get(key);
+bool hashmap_t::evict_step() const {
+    // the hand is an index into the current table: let a resize in
+    // progress finish first
+    return map.exclusive([this] { return !map.resizing() && evict(); });
 }
 
-RetType hashmap_set(ptr_t<hashmap_t> *hmap, Key key, Val val) {
+bool hashmap_t::evict() const {
+    const map_t::table_t *table = map.table();
+    size_t from = *hand->load();
+    bool due = true;
+    size_t i = 0;
+    while (i < EVICT_STEP && due) {
+        size_t b = (from + i++) & (table->length - 1);
+        {
+            // all keys of bucket b share this stripe
+            map_t::stripe_guard_t guard(map.stripe_of(b));
+            ptr_t<entry_t> *head = table->at(b);
+            const entry_t *first = head->load();
+            const entry_t *victim = nullptr;
+            const Val *victim_val = nullptr;
+            for (const entry_t *e = first; e != nullptr; e = e->next.get()) {
+                bool referenced;
+                const Val *val = e->clear(&referenced);
+                if (!referenced && victim == nullptr) {
+                    victim = e;
+                    victim_val = val;
+                }
+            }
+            if (victim != nullptr) {
+                remove(head, first, victim, victim_val);
+                if constexpr (!is_validator()) ctl->evictions++;
+            }
+        }
+        if constexpr (!is_validator()) due = evict_due();
+        due = external_return(due);
+    }
+    hand->store((from + i) & (table->length - 1));
+    return due;
+}
+
+RetType hashmap_set(ptr_t<hashmap_t> *hmap, Key key, bytes_t val) {
     return hmap->load()->set(key, val);
 }
 
@@ -124,4 +196,72 @@ RetType hashmap_del(ptr_t<hashmap_t> *hmap, Key key) {
     return hmap->load()->del(key);
 }
 
+batch_ret_t hashmap_batch(ptr_t<hashmap_t> *hmap, bytes_t cmds) {
+    const hashmap_t *hm = hmap->load();
+    // zeroed: the validator compares the whole struct
+    batch_ret_t ret{};
+    size_t pos = 0;
+    for (uint32_t i = 0; i < batch_t::kMaxCmds && pos < cmds.len; ++i) {
+        batch_t::cmd_t cmd;
+        memcpy(&cmd, cmds.data + pos, sizeof(cmd));
+        Key key = {cmds.data + pos + sizeof(cmd), cmd.klen};
+        bytes_t val = {key.data + cmd.klen, cmd.vlen};
+        pos += sizeof(cmd) + cmd.klen + cmd.vlen;
+        switch (cmd.op) {
+        case 's':
+            ret.rets[i] = hm->set(key, val);
+            break;
+        case 'g':
+            ret.vals[i] = hm->get(key);
+            ret.rets[i] = ret.vals[i] != nullptr ? kValue : kNotFound;
+            break;
+        case 'd':
+            ret.rets[i] = hm->del(key);
+            break;
+        default:
+            ret.rets[i] = kError;
+        }
+    }
+    return ret;
+}
+
+void hashmap_touch(ptr_t<hashmap_t> *hmap, bytes_t keys) {
+    const hashmap_t *hm = hmap->load();
+    size_t pos = 0;
+    for (uint32_t i = 0; i < touch_t::kMaxKeys && pos < keys.len; ++i) {
+        uint32_t klen;
+        memcpy(&klen, keys.data + pos, sizeof(klen));
+        hm->touch({keys.data + pos + sizeof(klen), klen});
+        pos += sizeof(klen) + klen;
+    }
+}
+
+bool hashmap_resize(ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->resize_step();
+}
+
+bool hashmap_evict(ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->evict_step();
+}
+
+bool hashmap_resize_due(const ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->resize_due();
+}
+
+bool hashmap_evict_due(const ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->evict_due();
+}
+
+void hashmap_set_limit(const ptr_t<hashmap_t> *hmap, size_t bytes) {
+    hmap->load()->ctl->limit = bytes;
+}
+
+size_t hashmap_bytes(const ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->ctl->bytes;
+}
+
+size_t hashmap_evictions(const ptr_t<hashmap_t> *hmap) {
+    return hmap->load()->ctl->evictions;
+}
+
 }  // namespace NAMESPACE
@@ -1,5 +1,7 @@
 /*
 Following are the required headers:
+#include <immintrin.h>
+
 #include <cstring>
 
 #include "context.hpp"
@@ -10,59 +12,234 @@ Following are the required headers:
 */
 #include "common.hpp"
 
-struct Key {
-    char ch[KEY_LEN];
-    uint32_t hash() const {
-        uint32_t hash = 5381;
-        for (size_t i = 0; i < KEY_LEN; i++) {
-            hash = ((hash << 5) + hash) + ((uint32_t)ch[i]);
-        }
-        return hash;
-    }
-    bool operator==(const Key &other) const {
-        return memcmp(ch, other.ch, KEY_LEN) == 0;
+// keys are passed to closures as bytes, logged with the closure
+using Key = scee::bytes_t;
+
+// CRC32C over 8-byte words, then the tail. Buckets and stripes are picked
+// by the low bits of the hash, which CRC32C spreads well
+__attribute__((target("sse4.2"))) inline uint32_t key_hash(Key key) {
+    const char *p = key.data;
+    size_t len = key.len;
+    uint64_t crc = ~0U;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
     }
-    std::string to_string() const { return std::string(ch, KEY_LEN); }
-};
+    uint32_t crc32 = static_cast<uint32_t>(crc);
+    for (; len > 0; ++p, --len) crc32 = _mm_crc32_u8(crc32, *p);
+    return ~crc32;
+}
 
-struct Val {
-    char ch[VAL_LEN];
-    static const Val empty() {
-        Val val;
-        memset(val.ch, 0, VAL_LEN);
-        return val;
+// compare keys of the same length 16 bytes at a time (64 per step for long
+// keys), the last chunk overlapping the previous one
+inline bool key_equal(const char *a, const char *b, size_t len) {
+    if (len < 16) {
+        if (len < 8) return memcmp(a, b, len) == 0;
+        uint64_t a0, a1, b0, b1;
+        memcpy(&a0, a, 8);
+        memcpy(&b0, b, 8);
+        memcpy(&a1, a + len - 8, 8);
+        memcpy(&b1, b + len - 8, 8);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
     }
-    bool operator==(const Val &other) const {
-        return memcmp(ch, other.ch, VAL_LEN) == 0;
+    auto eq16 = [&](size_t i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        return _mm_cmpeq_epi8(x, y);
+    };
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i eq = _mm_and_si128(_mm_and_si128(eq16(i), eq16(i + 16)),
+                                   _mm_and_si128(eq16(i + 32), eq16(i + 48)));
+        if (_mm_movemask_epi8(eq) != 0xffff) return false;
     }
-    std::string to_string() const { return std::string(ch, VAL_LEN); }
+    for (; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(eq16(i)) != 0xffff) return false;
+    }
+    return i == len || _mm_movemask_epi8(eq16(len - 16)) == 0xffff;
+}
+
+// a value, size-prefixed: the bytes are stored right after it
+struct Val : public scee::imm_string_t {
+    explicit Val(scee::bytes_t val) : imm_string_t((void *)val.data, val.len) {}
+    std::string to_string() const { return std::string(v, length); }
 };
 
 struct hashmap_t : public scee::imm_nonunique_t {
     size_t size() const { return sizeof(*this); }
+    /**
+     * The key is stored inline, right after the entry (as imm_array_t), so
+     * an entry takes as many bytes as its key. In non-versioned memory, `key`
+     * points to the bytes to copy. The hash is kept to skip most key
+     * comparisons, and to rehash without reading the key.
+     */
     struct entry_t : public scee::imm_nonunique_t {
-        size_t size() const { return sizeof(*this); }
-        Key key;
         scee::ptr_t<Val> *val_ptr;
         scee::fixed_ptr_t<entry_t> next;
-        entry_t(Key key, Val val, scee::fixed_ptr_t<entry_t> next);
+        const char *key;
+        uint32_t hash;
+        uint32_t klen;
+        size_t size() const { return sizeof(*this) + klen; }
+        entry_t(Key key, uint32_t hash, scee::bytes_t val,
+                scee::fixed_ptr_t<entry_t> next);
+        // relink an existing key and value into another chain
+        entry_t(const entry_t *entry, scee::fixed_ptr_t<entry_t> next);
+        void write_at(void *shadow, void *real, size_t size) const;
         void destroy() const;
-        void setv(Val val) const;
+        bool matches(Key k, uint32_t h) const {
+            return hash == h && klen == k.len && key_equal(key, k.data, klen);
+        }
+        // store a new value, marked referenced; return the old length
+        size_t setv(scee::bytes_t val) const;
         const Val *getv() const;
+        // set the reference bit of the value
+        void touch() const;
+        // clear the reference bit, return the value and whether it was set
+        const Val *clear(bool *was_referenced) const;
     };
     static_assert(std::has_unique_object_representations_v<entry_t>);
-    size_t capacity;
-    scee::fixed_ptr_t<scee::mut_array_t<entry_t>> buckets;
-    scee::mutable_list_t<scee::mutex_t> locks;
-    hashmap_t() { capacity = 0; }
+    using map_t = scee::versioned_hash_map<entry_t>;
+    // non-versioned data, only used to decide when to evict
+    struct ctl_t {
+        std::atomic<size_t> bytes;  // item_size() of all keys
+        size_t limit;               // of bytes, 0 if unbounded
+        std::atomic<size_t> evictions;
+    };
+    static constexpr size_t DEFAULT_STRIPES = map_t::DEFAULT_STRIPES;
+    // buckets swept by one hashmap_evict() closure
+    static constexpr size_t EVICT_STEP = 16;
+    /**
+     * Keys are in `map`, see versioned_hash_map for the locking and the
+     * incremental resize.
+     *
+     * Once `bytes` exceeds `limit`, keys are evicted by CLOCK: the hand
+     * (`hand`, a bucket of the current table) sweeps EVICT_STEP buckets per
+     * evict closure, clears the reference bits it passes, and evicts one
+     * unreferenced entry per bucket. Eviction and resizes exclude each other
+     * (map_t::exclusive()), and eviction waits for a resize in progress to
+     * finish. The reference bit of an entry is the low bit of its value
+     * pointer, so it is versioned with the value. Sets mark values
+     * referenced; gets do not store, and are sampled into hashmap_touch()
+     * closures by the caller instead.
+     */
+    map_t map;
+    scee::ptr_t<size_t> *hand;
+    ctl_t *ctl;
+    hashmap_t() {
+        hand = nullptr;
+        ctl = nullptr;
+    }
     // make: create a hashmap instance in non-versioned memory
-    static hashmap_t make(size_t cap);
+    // see versioned_hash_map::make() for cap and nstripes
+    static hashmap_t make(size_t cap, size_t nstripes = DEFAULT_STRIPES);
     void destroy() const;
-    const Val *get(const Key &key) const;
-    RetType set(const Key &key, const Val &val) const;
-    RetType del(const Key &key) const;
+    const Val *get(Key key) const;
+    RetType set(Key key, scee::bytes_t val) const;
+    RetType del(Key key) const;
+    void touch(Key key) const;
+    bool resize_step() const;
+    bool resize_due() const;
+    bool evict_step() const;
+    bool evict_due() const;
+    // bytes accounted to a key, with its entry and value objects
+    static constexpr size_t item_size(size_t klen, size_t vlen) {
+        return sizeof(entry_t) + klen + sizeof(Val) + vlen;
+    }
+
+private:
+    bool evict() const;
+    // unlink target from the chain at head and free it; val is its value
+    void remove(scee::ptr_t<entry_t> *head, const entry_t *first,
+                const entry_t *target, const Val *val) const;
+};
+
+/**
+ * Commands run (and validated) as one closure, see hashmap_batch().
+ * They are packed into one buffer, logged with the closure:
+ * | cmd_t | key | value | cmd_t | key | value | ...
+ */
+struct batch_t {
+    // bounded by the closure log: every command is copied into it
+    static constexpr uint32_t kMaxCmds = 4;
+    static constexpr size_t kMaxBytes = 2048;
+    struct cmd_t {
+        uint32_t op;  // 's', 'g' or 'd'
+        uint32_t klen;
+        uint32_t vlen;  // only used by set
+    };
+    static_assert(sizeof(cmd_t) + KEY_MAX_LEN + VAL_MAX_LEN <= kMaxBytes);
+    uint32_t ncmds;
+    size_t len;
+    char ops[kMaxCmds];
+    char buf[kMaxBytes];
+    batch_t() : ncmds(0), len(0) {}
+    bool full() const { return ncmds == kMaxCmds; }
+    // false if the command does not fit: run the batch first
+    bool push(char op, Key key, scee::bytes_t val) {
+        size_t size = sizeof(cmd_t) + key.len + val.len;
+        if (full() || len + size > kMaxBytes) return false;
+        cmd_t cmd = {.op = (uint32_t)op,
+                     .klen = (uint32_t)key.len,
+                     .vlen = (uint32_t)val.len};
+        memcpy(buf + len, &cmd, sizeof(cmd));
+        memcpy(buf + len + sizeof(cmd), key.data, key.len);
+        memcpy(buf + len + sizeof(cmd) + key.len, val.data, val.len);
+        len += size;
+        ops[ncmds++] = op;
+        return true;
+    }
+    void clear() { ncmds = len = 0; }
+    scee::bytes_t bytes() const { return {buf, len}; }
+};
+
+/**
+ * Keys of sampled gets, marked referenced in one closure, see
+ * hashmap_touch(). Packed as | uint32_t length | key | length | key | ...
+ */
+struct touch_t {
+    // bounded by the closure log, as batch_t
+    static constexpr uint32_t kMaxKeys = 16;
+    static constexpr size_t kMaxBytes = 1024;
+    static_assert(sizeof(uint32_t) + KEY_MAX_LEN <= kMaxBytes);
+    uint32_t nkeys;
+    size_t len;
+    char buf[kMaxBytes];
+    touch_t() : nkeys(0), len(0) {}
+    bool full() const { return nkeys == kMaxKeys; }
+    // false if the key does not fit: run the touches first
+    bool push(Key key) {
+        uint32_t klen = key.len;
+        if (full() || len + sizeof(klen) + klen > kMaxBytes) return false;
+        memcpy(buf + len, &klen, sizeof(klen));
+        memcpy(buf + len + sizeof(klen), key.data, klen);
+        len += sizeof(klen) + klen;
+        nkeys++;
+        return true;
+    }
+    void clear() { nkeys = len = 0; }
+    scee::bytes_t bytes() const { return {buf, len}; }
+};
+
+struct batch_ret_t {
+    RetType rets[batch_t::kMaxCmds];
+    const Val *vals[batch_t::kMaxCmds];  // only used by get
 };
 
-const Val *hashmap_get(scee::ptr_t<hashmap_t> *hmap, Key key);
-RetType hashmap_set(scee::ptr_t<hashmap_t> *hmap, Key key, Val val);
+const Val *hashmap_get(const scee::ptr_t<hashmap_t> *hmap, Key key);
+RetType hashmap_set(scee::ptr_t<hashmap_t> *hmap, Key key, scee::bytes_t val);
 RetType hashmap_del(scee::ptr_t<hashmap_t> *hmap, Key key);
+// cmds: the packed commands of a batch_t
+batch_ret_t hashmap_batch(scee::ptr_t<hashmap_t> *hmap, scee::bytes_t cmds);
+// keys: the packed keys of a touch_t
+void hashmap_touch(scee::ptr_t<hashmap_t> *hmap, scee::bytes_t keys);
+// migrate one range of buckets, return false if there is nothing to do
+bool hashmap_resize(scee::ptr_t<hashmap_t> *hmap);
+// sweep one range of buckets, return false if there is nothing to do
+bool hashmap_evict(scee::ptr_t<hashmap_t> *hmap);
+// called outside closures: only read or write non-versioned data
+bool hashmap_resize_due(const scee::ptr_t<hashmap_t> *hmap);
+bool hashmap_evict_due(const scee::ptr_t<hashmap_t> *hmap);
+void hashmap_set_limit(const scee::ptr_t<hashmap_t> *hmap, size_t bytes);
+size_t hashmap_bytes(const scee::ptr_t<hashmap_t> *hmap);
+size_t hashmap_evictions(const scee::ptr_t<hashmap_t> *hmap);
@@ -0,0 +1,24 @@
+// hashmap_get() for run_readonly(), compiled in the read-only contexts: the
+// read path can not store or allocate, see context/readonly_run.hpp
+#include <immintrin.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include "compiler.hpp"
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "custom_stl.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+
+static_assert(IS_READONLY_CONTEXT, "build with a read-only NAMESPACE");
+
+namespace NAMESPACE {
+#include "closure.hpp"
+
+using namespace ::scee;
+
+#include "lookup.hpp"
+
+}  // namespace NAMESPACE
@@ -14,5 +14,7 @@ static const char *kRetVals[] = {"ERROR\r\n",  "DELETED\r\n", "NOT_FOUND\r\n",
                                  "VALUE "};
 static const char kCrlf[] = "\r\n";
 
-constexpr size_t KEY_LEN = 64;
-constexpr size_t VAL_LEN = 256;
\ No newline at end of file
+// keys and values are variable-length, up to these sizes: keys as in
+// memcached, values bounded by the closure log they are copied into
+constexpr size_t KEY_MAX_LEN = 250;
+constexpr size_t VAL_MAX_LEN = 1024;
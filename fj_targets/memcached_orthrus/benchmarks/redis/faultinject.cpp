@@ -37,6 +37,7 @@ constexpr int MaxCap = 1 << VV, NKeys = 1 << VV, NUpdates = 2 << VV,
               NGets = 2 << VV;
 constexpr int NOps = (NKeys + NUpdates + NGets) / NThreads;
 
+constexpr size_t KEY_LEN = 64, VAL_LEN = 256;
 char keys[NKeys][KEY_LEN], vals[NKeys][VAL_LEN];
 char tmps[NKeys][VAL_LEN];
 char datas[NUpdates + NGets][VAL_LEN];
@@ -57,7 +58,7 @@ void ASSERT_EQ(const T& val1, const T& val2) {
 struct cmd {
     int opcode;
     Key key;
-    Val val;
+    scee::bytes_t val;
 };
 
 void prepare_dataset(int test_id) {
@@ -94,14 +95,14 @@ cmd &advance(int thread_id, int op_id) {
     int cmd_id = op_id * NThreads + thread_id;
     if (cmd_id < NKeys) {
         t.opcode = 0;
-        memcpy(t.key.ch, keys[cmd_id], KEY_LEN);
-        memcpy(t.val.ch, vals[cmd_id], VAL_LEN);
+        t.key = {keys[cmd_id], KEY_LEN};
+        t.val = {vals[cmd_id], VAL_LEN};
     } else {
         cmd_id -= NKeys;
-        memcpy(t.key.ch, keys[key_id[cmd_id]], KEY_LEN);
+        t.key = {keys[key_id[cmd_id]], KEY_LEN};
         if (task_id[cmd_id]) {  // update
             t.opcode = 1;
-            memcpy(t.val.ch, datas[cmd_id], VAL_LEN);
+            t.val = {datas[cmd_id], VAL_LEN};
         } else {  // get
             t.opcode = 2;
         }
@@ -118,7 +119,9 @@ void send(int thread_id, int op_id, void *val) {
         if (task_id[cmd_id]) {  // update
             assert((uint64_t)val == (uint64_t)kStored);
         } else {  // get
-            assert(memcmp(datas[cmd_id], val, VAL_LEN) == 0);
+            const Val *v = (const Val *)val;
+            assert(v->length == VAL_LEN);
+            assert(memcmp(datas[cmd_id], v->v, VAL_LEN) == 0);
         }
     }
 }
@@ -127,14 +130,14 @@ void final_check() {
     fprintf(stderr, "final check started\n");
     assert(hmap != nullptr);
     assert(hmap_addr == hmap->load());
-    for (int i = 0; i < MaxCap; ++i) {
-        auto **bucket =
-            (const hashmap_t::entry_t **)hmap_addr->buckets.get()->v[i];
-        if (bucket == nullptr) continue;
+    // no resize is triggered: NKeys does not exceed MaxCap
+    auto *table = *(const hashmap_t::map_t::table_t **)hmap_addr->map.buckets;
+    for (size_t i = 0; i < table->length; ++i) {
+        auto **bucket = (const hashmap_t::entry_t **)&table->cells[i];
         auto *entry = *bucket;
         while (entry != nullptr) {
-            std::string kk(entry->key.ch, KEY_LEN);
-            std::string vv((*(const Val **)entry->val_ptr)->ch, VAL_LEN);
+            std::string kk(entry->key, entry->klen);
+            std::string vv = entry->getv()->to_string();
             if (key_map.count(kk) == 0 || marked[key_map[kk]] != 0) {
                 fprintf(stderr, "key: %s, key_map[kk]: %d, marked[key_map[kk]]: %d\n", kk.c_str(), key_map[kk], marked[key_map[kk]]);
                 fprintf(stderr, "SDC Not Detected\n");
@@ -176,7 +179,8 @@ int benchmark_fn() {
                 // t.opcode);
                 if (t.opcode < 2) {
                     using HashmapSetType =
-                        RetType (*)(scee::ptr_t<hashmap_t> *, Key, Val);
+                        RetType (*)(scee::ptr_t<hashmap_t> *, Key,
+                                    scee::bytes_t);
                     auto app_fn =
                         reinterpret_cast<HashmapSetType>(app::hashmap_set);
                     auto val_fn = reinterpret_cast<HashmapSetType>(
@@ -0,0 +1,585 @@
+#pragma once
+
+/**
+ * I/O backends of the benchmark servers: the request logic is written once
+ * as a Worker, and served by either epoll or io_uring.
+ *
+ * A Worker is created per connection (Worker(int fd)) and provides:
+ *   char *recv_space(size_t &room)  where to put received bytes, room > 0
+ *   void received(size_t n)         n bytes were put there
+ *   void process()                  run the complete commands received so
+ *                                   far, until the responses fill up
+ *   int pending(struct iovec *&iov) responses to send, 0 if none
+ *   void hold(const struct iovec *iov, int iovcnt)
+ *                                   the socket is full, iov is what is left
+ *                                   of the responses: keep a copy, pending()
+ *                                   returns it, and process() runs nothing
+ *                                   until it is sent
+ *   void sent()                     the responses have been sent
+ * The iovecs returned by pending() must stay valid until sent(), or until
+ * hold(): a client that does not read must not stall the worker's closures.
+ */
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+enum class IOBackend {
+    Epoll,
+    Uring,
+};
+
+// skip n bytes that have been sent, a piece may be sent partially
+static inline void skip_sent(struct iovec *&iov, int &iovcnt, size_t n) {
+    while (iovcnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        ++iov;
+        --iovcnt;
+    }
+    if (iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+}
+
+// write as much as the socket takes, false if it filled up before the end;
+// a broken connection drops the rest, and is closed once epoll reports it
+static inline bool writev_some(int fd, struct iovec *&iov, int &iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (ret <= 0) break;
+        skip_sent(iov, iovcnt, ret);
+    }
+    return true;
+}
+
+// the server stops after this long without any event, once a client came
+static constexpr int kIdleTimeoutMs = 5000;
+
+// drain a readable socket: run commands as they arrive, send their responses
+template <typename Worker>
+void drain_socket(int fd, Worker &worker) {
+    while (true) {
+        worker.process();
+        struct iovec *iov;
+        int iovcnt = worker.pending(iov);
+        if (iovcnt > 0) {
+            if (!writev_some(fd, iov, iovcnt)) {
+                // the client is not reading: resume on EPOLLOUT
+                worker.hold(iov, iovcnt);
+                return;
+            }
+            worker.sent();
+            continue;  // commands may be left, when responses filled up
+        }
+        size_t room;
+        char *space = worker.recv_space(room);
+        ssize_t ret = read(fd, space, room);
+        if (ret <= 0) {
+            // closed, broken, or drained (EAGAIN): edge-triggered, wait
+            return;
+        }
+        worker.received(ret);
+    }
+}
+
+template <typename Worker>
+void serve_epoll(int listen_fd) {
+    const int MAX_EVENTS = 128;  // max total active connections
+
+    int efd = epoll_create1(0);
+    if (efd == -1) {
+        assert("epoll create error" && false);
+    }
+
+    struct epoll_event ev, events[MAX_EVENTS];
+    auto epoll_init = [&](int fd) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        ev.data.fd = fd;
+        // EPOLLOUT: a socket that was full can take held responses again
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            assert("epoll ctl error" && false);
+        }
+    };
+    epoll_init(listen_fd);
+
+    std::map<int, std::unique_ptr<Worker>> workers;
+
+    int timeout = -1;
+
+    while (true) {
+        int nfds = epoll_wait(efd, events, MAX_EVENTS, timeout);
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                // avoid the interrupt caused by strace
+                continue;
+            }
+            assert("epoll wait error" && false);
+        }
+        if (nfds == 0) {
+            DEBUG("server stopped due to inactivity.\n");
+            break;
+        }
+        for (int i = 0; i < nfds; ++i) {
+            int fd = events[i].data.fd;
+            uint32_t state = events[i].events;
+            if (fd == listen_fd) {
+                // new client connection
+                while (true) {
+                    int conn_fd = accept(listen_fd, nullptr, nullptr);
+                    if (conn_fd == -1) {
+                        assert((errno == EAGAIN) || (errno == EWOULDBLOCK));
+                        break;
+                    }
+                    epoll_init(conn_fd);
+                    workers[conn_fd] = std::make_unique<Worker>(conn_fd);
+                }
+            } else if ((state & (EPOLLERR | EPOLLHUP)) && !(state & EPOLLIN)) {
+                // client connection closed
+                close(fd);
+                workers.erase(fd);
+            } else {
+                // receive message on this client socket
+                drain_socket(fd, *workers[fd]);
+                timeout = kIdleTimeoutMs;
+            }
+        }
+    }
+    close(efd);
+}
+
+/**
+ * A minimal io_uring, on the raw system calls (no liburing).
+ * Received data goes to a ring of provided buffers (registered with the
+ * kernel once), so a single multishot recv per connection keeps receiving.
+ */
+class uring_t {
+public:
+    uring_t(unsigned entries, unsigned nbufs, unsigned buf_size)
+        : nbufs(nbufs), buf_size(buf_size) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_fd < 0) {
+            perror("io_uring_setup");
+            abort();
+        }
+        assert(p.features & IORING_FEAT_SINGLE_MMAP);
+        ring_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                             p.cq_off.cqes +
+                                 p.cq_entries * sizeof(struct io_uring_cqe));
+        ring = mmap_ring(ring_size, IORING_OFF_SQ_RING);
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)mmap_ring(sqes_size, IORING_OFF_SQES);
+
+        sq_head = (unsigned *)((char *)ring + p.sq_off.head);
+        sq_tail = (unsigned *)((char *)ring + p.sq_off.tail);
+        sq_mask = *(unsigned *)((char *)ring + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        unsigned *sq_array = (unsigned *)((char *)ring + p.sq_off.array);
+        // sqes are used in ring order
+        for (unsigned i = 0; i < sq_entries; ++i) sq_array[i] = i;
+        cq_head = (unsigned *)((char *)ring + p.cq_off.head);
+        cq_tail = (unsigned *)((char *)ring + p.cq_off.tail);
+        cq_mask = *(unsigned *)((char *)ring + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)((char *)ring + p.cq_off.cqes);
+        sq_local_tail = *sq_tail;
+
+        register_buffers();
+    }
+
+    ~uring_t() {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = kBufGroup;
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_PBUF_RING,
+                &reg, 1);
+        munmap(buf_ring, buf_ring_size);
+        free(bufs);
+        munmap(sqes, sqes_size);
+        munmap(ring, ring_size);
+        close(ring_fd);
+    }
+
+    static constexpr uint16_t kBufGroup = 0;
+
+    // a zeroed sqe, submitted by the next enter()
+    struct io_uring_sqe *get_sqe() {
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+            sq_entries) {
+            enter(0);  // the submission queue is full, submit it
+        }
+        struct io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        ++sq_local_tail;
+        return sqe;
+    }
+
+    // submit the queued sqes, and wait for a completion if wait is set
+    // return false if nothing completed within timeout_ms
+    bool enter(bool wait, int timeout_ms = -1) {
+        unsigned to_submit = sq_local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        void *argp = nullptr;
+        size_t argsz = 0;
+        if (wait && timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (uint64_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        while (true) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                              wait ? 1 : 0, flags, argp, argsz);
+            if (ret >= 0) return true;
+            if (errno == ETIME) return false;
+            if (errno == EINTR) {
+                to_submit = 0;
+                continue;
+            }
+            perror("io_uring_enter");
+            abort();
+        }
+    }
+
+    template <typename Fn>
+    unsigned for_each_cqe(Fn &&fn) {
+        unsigned head = *cq_head, count = 0;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            // copied: the slot may be reused once cq_head moves
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            ++head;
+            ++count;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            fn(cqe);
+        }
+        return count;
+    }
+
+    char *buffer(unsigned bid) { return bufs + (size_t)bid * buf_size; }
+
+    // give a provided buffer back to the kernel
+    void recycle(unsigned bid) {
+        struct io_uring_buf *buf = &buf_ring[buf_tail & (nbufs - 1)];
+        buf->addr = (uint64_t)buffer(bid);
+        buf->len = buf_size;
+        buf->bid = bid;
+        ++buf_tail;
+        // the ring tail overlays the resv field of the first entry
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    void *mmap_ring(size_t size, off_t offset) {
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        if (ptr == MAP_FAILED) {
+            perror("io_uring mmap");
+            abort();
+        }
+        return ptr;
+    }
+
+    void register_buffers() {
+        assert((nbufs & (nbufs - 1)) == 0);
+        buf_ring_size = nbufs * sizeof(struct io_uring_buf);
+        // struct io_uring_buf_ring is not used: its flexible array member
+        // has a different offset in C++
+        buf_ring = (struct io_uring_buf *)mmap(
+            nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(buf_ring != MAP_FAILED);
+        bufs = (char *)malloc((size_t)nbufs * buf_size);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = nbufs;
+        reg.bgid = kBufGroup;
+        if (syscall(__NR_io_uring_register, ring_fd,
+                    IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            perror("io_uring register buffers");
+            abort();
+        }
+        buf_tail = 0;
+        for (unsigned bid = 0; bid < nbufs; ++bid) recycle(bid);
+    }
+
+    int ring_fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries, sq_local_tail;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    unsigned nbufs, buf_size;
+    uint16_t buf_tail;
+};
+
+/**
+ * io_uring backend: one multishot accept, one multishot recv per connection
+ * into provided buffers, and one sendmsg per batch of responses. The
+ * sendmsg does not wait for a full socket: what is left is held by the
+ * worker and sent by a second, waiting, sendmsg. All sqes queued while
+ * handling completions are submitted by a single enter(), which also waits
+ * for the next completions.
+ *
+ * The provided buffers are shared by all connections: a connection holds at
+ * most kMaxInbox of them. Beyond that, its recv is cancelled until the
+ * worker catches up, and what a multishot recv delivered before the cancel
+ * is copied out of the buffers. A recv that finds no buffer left (ENOBUFS)
+ * is rearmed once one is recycled.
+ */
+template <typename Worker>
+void serve_uring(int listen_fd) {
+    static constexpr unsigned kEntries = 256, kNumBufs = 256,
+                              kBufSize = 1 << 12, kMaxInbox = kNumBufs / 8;
+    enum Op : uint64_t { Accept, Recv, Send, Cancel };
+
+    // a provided buffer received, bytes [off, len) not yet copied
+    struct inbound_t {
+        unsigned bid;
+        size_t off, len;
+    };
+    struct conn_t {
+        int fd;
+        Worker worker;
+        // provided buffers received but not yet copied to the worker
+        std::deque<inbound_t> inbox;
+        // received past kMaxInbox buffers, bytes [spill_off, size) not copied
+        std::string spill;
+        size_t spill_off = 0;
+        struct msghdr msg;
+        bool recv_armed = false, sending = false, closed = false;
+        bool paused = false;  // its recv is being cancelled
+        bool send_wait = false;  // the sendmsg in flight waits for room
+        conn_t(int fd) : fd(fd), worker(fd) {}
+    };
+
+    uring_t ring(kEntries, kNumBufs, kBufSize);
+    std::map<int, std::unique_ptr<conn_t>> conns;
+    // connections whose recv found no buffer left, to rearm on a recycle
+    std::deque<int> starved;
+    unsigned nreceived = 0;  // provided buffers not yet recycled
+
+    auto user_data = [](Op op, int fd) { return ((uint64_t)fd << 2) | op; };
+    auto arm_accept = [&]() {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = user_data(Accept, listen_fd);
+    };
+    auto arm_recv = [&](conn_t *conn) {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = uring_t::kBufGroup;
+        sqe->user_data = user_data(Recv, conn->fd);
+        conn->recv_armed = true;
+        conn->paused = false;
+    };
+    auto cancel_recv = [&](conn_t *conn) {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(Recv, conn->fd);
+        sqe->user_data = user_data(Cancel, conn->fd);
+        conn->paused = true;
+    };
+    auto wants_recv = [&](conn_t *conn) {
+        return !conn->recv_armed && !conn->closed &&
+               conn->inbox.size() < kMaxInbox && conn->spill.empty();
+    };
+    auto recycle = [&](unsigned bid) {
+        ring.recycle(bid);
+        --nreceived;
+        while (!starved.empty()) {
+            auto it = conns.find(starved.front());
+            starved.pop_front();
+            conn_t *conn = it == conns.end() ? nullptr : it->second.get();
+            if (conn && wants_recv(conn)) {
+                arm_recv(conn);
+                break;
+            }
+        }
+    };
+    auto arm_send = [&](conn_t *conn, struct iovec *iov, int iovcnt,
+                        bool wait) {
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = iov;
+        conn->msg.msg_iovlen = iovcnt;
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)&conn->msg;
+        sqe->msg_flags = MSG_NOSIGNAL | (wait ? MSG_WAITALL : MSG_DONTWAIT);
+        sqe->user_data = user_data(Send, conn->fd);
+        conn->sending = true;
+        conn->send_wait = wait;
+    };
+    // run commands of received data, until a send is in flight
+    auto pump = [&](conn_t *conn) {
+        while (!conn->sending) {
+            conn->worker.process();
+            struct iovec *iov;
+            int iovcnt = conn->worker.pending(iov);
+            if (iovcnt > 0) {
+                arm_send(conn, iov, iovcnt, false);
+                return;
+            }
+            if (conn->inbox.empty() && conn->spill.empty()) return;
+            size_t room;
+            char *space = conn->worker.recv_space(room);
+            if (!conn->inbox.empty()) {
+                inbound_t &in = conn->inbox.front();
+                size_t n = std::min(in.len - in.off, room);
+                memcpy(space, ring.buffer(in.bid) + in.off, n);
+                conn->worker.received(n);
+                in.off += n;
+                if (in.off < in.len) continue;
+                recycle(in.bid);
+                conn->inbox.pop_front();
+            } else {
+                size_t n = std::min(conn->spill.size() - conn->spill_off, room);
+                memcpy(space, conn->spill.data() + conn->spill_off, n);
+                conn->worker.received(n);
+                conn->spill_off += n;
+                if (conn->spill_off < conn->spill.size()) continue;
+                conn->spill.clear();
+                conn->spill_off = 0;
+            }
+            if (wants_recv(conn)) arm_recv(conn);  // the worker caught up
+        }
+    };
+    auto maybe_close = [&](conn_t *conn) {
+        if (!conn->closed || conn->recv_armed || conn->sending) return;
+        for (auto &in : conn->inbox) recycle(in.bid);
+        close(conn->fd);
+        conns.erase(conn->fd);
+    };
+
+    arm_accept();
+    int timeout = -1;
+    while (true) {
+        if (!ring.enter(true, timeout)) {
+            DEBUG("server stopped due to inactivity.\n");
+            break;
+        }
+        ring.for_each_cqe([&](const struct io_uring_cqe &cqe) {
+            Op op = (Op)(cqe.user_data & 3);
+            int fd = cqe.user_data >> 2;
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            if (op == Accept) {
+                if (cqe.res >= 0) {
+                    auto conn = std::make_unique<conn_t>(cqe.res);
+                    arm_recv(conn.get());
+                    conns[cqe.res] = std::move(conn);
+                }
+                if (!more) arm_accept();
+                return;
+            }
+            if (op == Cancel) return;  // the recv completes with ECANCELED
+            conn_t *conn = conns[fd].get();
+            if (op == Recv) {
+                timeout = kIdleTimeoutMs;
+                conn->recv_armed = more;
+                if (cqe.res > 0) {
+                    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    ++nreceived;
+                    if (conn->inbox.size() < kMaxInbox &&
+                        conn->spill.empty()) {
+                        conn->inbox.push_back({bid, 0, (size_t)cqe.res});
+                    } else {
+                        // over its share: copy it, give the buffer back
+                        conn->spill.append(ring.buffer(bid), cqe.res);
+                        recycle(bid);
+                    }
+                    pump(conn);
+                    if (conn->recv_armed && !conn->paused &&
+                        conn->inbox.size() >= kMaxInbox) {
+                        cancel_recv(conn);  // the worker is not keeping up
+                    }
+                }
+                if (cqe.res == -ENOBUFS && nreceived == kNumBufs) {
+                    starved.push_back(fd);  // out of buffers
+                } else if (cqe.res == 0 || (cqe.res < 0 &&
+                                            cqe.res != -ENOBUFS &&
+                                            cqe.res != -ECANCELED)) {
+                    conn->closed = true;  // closed by the client, or error
+                } else if (wants_recv(conn)) {
+                    arm_recv(conn);
+                }
+            } else {  // Send
+                conn->sending = false;
+                struct iovec *iov;
+                int iovcnt = conn->worker.pending(iov);
+                if (conn->send_wait) {
+                    // MSG_WAITALL: short only if the connection broke
+                    iovcnt = 0;
+                } else if (cqe.res >= 0 || cqe.res == -EAGAIN) {
+                    skip_sent(iov, iovcnt, std::max(cqe.res, 0));
+                }
+                if (cqe.res < 0 && cqe.res != -EAGAIN) {
+                    conn->closed = true;
+                } else if (iovcnt > 0) {
+                    // the client is not reading: hold the rest
+                    conn->worker.hold(iov, iovcnt);
+                    iovcnt = conn->worker.pending(iov);
+                    arm_send(conn, iov, iovcnt, true);
+                } else {
+                    conn->worker.sent();
+                    if (!conn->closed) pump(conn);
+                }
+            }
+            maybe_close(conn);
+        });
+    }
+    for (auto &[fd, conn] : conns) close(fd);
+}
+
+template <typename Worker>
+void serve(IOBackend backend, int listen_fd) {
+    switch (backend) {
+    case IOBackend::Epoll:
+        serve_epoll<Worker>(listen_fd);
+        break;
+    case IOBackend::Uring:
+        serve_uring<Worker>(listen_fd);
+        break;
+    }
+}
@@ -0,0 +1,25 @@
+/*
+The read path of hashmap_t, shared by closure.cpp and the read-only contexts
+(closure_readonly.cpp). Included after closure.hpp, in the same namespace.
+*/
+
+// the CLOCK reference bit is the low bit of a value pointer, clear it
+static const Val *unreferenced(const Val *val) {
+    return reinterpret_cast<const Val *>(uintptr_t(val) & ~uintptr_t{1});
+}
+
+const Val *hashmap_t::entry_t::getv() const {
+    return unreferenced(val_ptr->load());
+}
+
+const Val *hashmap_t::get(Key key) const {
+    uint32_t hash = key_hash(key);
+    return map.read(hash, [&] {
+        const entry_t *entry = map.locate(key, hash).entry;
+        return entry != nullptr ? entry->getv() : nullptr;
+    });
+}
+
+const Val *hashmap_get(const ptr_t<hashmap_t> *hmap, Key key) {
+    return hmap->load()->get(key);
+}
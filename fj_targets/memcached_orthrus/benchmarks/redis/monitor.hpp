@@ -3,13 +3,13 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/times.h>
-#include <sys/vtimes.h>
 
 #include <atomic>
 #include <chrono>
 #include <string>
 #include <vector>
 
+#include "hdr/hdr_histogram.h"
 #include "utils.hpp"
 
 namespace monitor {
@@ -60,7 +60,9 @@ struct process_cpu {
 // n_threads: number of threads executing the ops
 // task: task name of the evaluation
 // cnts: # of operations executed on each thread
-// latency: the latency for each operation by counting with rdtsc()
+// hists: latency histogram of each thread, in nanoseconds
+// record: count an operation of a thread and its latency, the first and last
+// eighth of the operations of a thread are not in the latency summary
 // report: report on stderr for most recent throughput, with last_scnt and
 // last_rdtsc value
 struct evaluation {
@@ -74,11 +76,14 @@ struct evaluation {
     struct alignas(64) Cnt {
         uint64_t c;
     };
-    std::vector<uint64_t> latency;
+    // latencies up to a minute, to 3 significant digits
+    static constexpr int64_t max_latency_ns = 60'000'000'000;
     Cnt cnts[max_n_threads];
+    hdr_histogram *hists[max_n_threads];
     std::vector<std::pair<std::chrono::steady_clock::time_point, uint64_t>>
         records;
     std::vector<uint64_t> scnts;
+    void record(int thread, uint64_t latency_ns);
     void report();
 };
 
@@ -197,34 +202,53 @@ double process_cpu::record() {
 evaluation::evaluation(FILE *log, uint64_t num_ops, int n_threads,
                        std::string task)
     : log(log), num_ops(num_ops), n_threads(n_threads), task(task) {
-    latency.resize(num_ops);
     records.emplace_back(std::chrono::steady_clock::now(), 0);
     for (int i = 0; i < max_n_threads; ++i) cnts[i].c = 0;
+    for (int i = 0; i < n_threads; ++i) {
+        hdr_init(1, max_latency_ns, 3, &hists[i]);
+    }
 }
 
 evaluation::~evaluation() {
     uint64_t n_phases = std::min(num_ops, 8LU);
-    uint64_t l = num_ops / n_phases, r = num_ops * (n_phases - 1) / n_phases;
-    std::sort(latency.begin() + l, latency.begin() + r);
-    uint64_t p90 = nanosecond(0, latency[l + uint64_t((r - l) * .9)]);
-    uint64_t p95 = nanosecond(0, latency[l + uint64_t((r - l) * .95)]);
-    uint64_t p99 = nanosecond(0, latency[l + uint64_t((r - l) * .99)]);
-    uint64_t avg = nanosecond(0, std::accumulate(latency.begin() + l,
-                                                 latency.begin() + r, 0ULL)) /
-                   (r - l);
+    hdr_histogram *total;
+    hdr_init(1, max_latency_ns, 3, &total);
+    for (int i = 0; i < n_threads; ++i) {
+        hdr_add(total, hists[i]);
+        hdr_close(hists[i]);
+    }
+    uint64_t p50 = hdr_value_at_percentile(total, 50);
+    uint64_t p90 = hdr_value_at_percentile(total, 90);
+    uint64_t p95 = hdr_value_at_percentile(total, 95);
+    uint64_t p99 = hdr_value_at_percentile(total, 99);
+    uint64_t p999 = hdr_value_at_percentile(total, 99.9);
+    uint64_t avg = hdr_mean(total);
+    hdr_close(total);
     auto period = std::chrono::duration_cast<std::chrono::microseconds>(
         std::chrono::steady_clock::now() - records[0].first);
     fprintf(stderr, "Finished task %s. Time: %ld us; Throughput: %f/s.\n",
             task.c_str(), period.count(), num_ops * 1e6 / period.count());
-    l = ((uint64_t)records.size() - 1) / n_phases,
-    r = ((uint64_t)records.size() - 1) * (n_phases - 1) / n_phases;
+    fprintf(stderr,
+            "Latency (ns): avg %lu p50 %lu p90 %lu p99 %lu p99.9 %lu\n", avg,
+            p50, p90, p99, p999);
+    uint64_t l = ((uint64_t)records.size() - 1) / n_phases,
+             r = ((uint64_t)records.size() - 1) * (n_phases - 1) / n_phases;
     period = std::chrono::duration_cast<std::chrono::microseconds>(
         records[r + 1].first - records[l].first);
     uint64_t put = (records[r + 1].second - records[l].second) * 1000000LL /
                    period.count();
     fprintf(stderr, "Estimated (operation) throughput: %lu/s\n", put);
-    fprintf(log, "%s put %lu avg %lu p90 %lu p95 %lu p99 %lu\n", task.c_str(),
-            put, avg, p90, p95, p99);
+    fprintf(log, "%s put %lu avg %lu p90 %lu p95 %lu p99 %lu p999 %lu\n",
+            task.c_str(), put, avg, p90, p95, p99, p999);
+}
+
+void evaluation::record(int thread, uint64_t latency_ns) {
+    uint64_t k = cnts[thread].c++;
+    uint64_t per_thread = num_ops / n_threads;
+    if (k >= per_thread / 8 && k < per_thread - per_thread / 8) {
+        hdr_record_value(hists[thread],
+                         std::min<uint64_t>(latency_ns, max_latency_ns));
+    }
 }
 
 void evaluation::report() {
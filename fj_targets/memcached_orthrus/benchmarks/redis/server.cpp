@@ -1,13 +1,15 @@
 #include <arpa/inet.h>
-#include <fcntl.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
-#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <memory>
 #include <regex>
+#include <string>
 #include <vector>
 
 #include "context.hpp"
@@ -18,6 +20,9 @@
 #include "ptr.hpp"
 #include "scee.hpp"
 #include "thread.hpp"
+#include "utils.hpp"
+
+#include "io.hpp"
 
 namespace raw {
 #include "closure.hpp"
@@ -28,6 +33,12 @@ namespace app {
 namespace validator {
 #include "closure.hpp"
 }  // namespace validator
+namespace app_readonly {
+#include "closure.hpp"
+}  // namespace app_readonly
+namespace validator_readonly {
+#include "closure.hpp"
+}  // namespace validator_readonly
 
 using namespace raw;
 
@@ -35,78 +46,219 @@ enum RunType {
     Baseline,
     SCEE,
     SCEEProfile,
+    SCEEBatch,  // pipelined commands are grouped into one closure
 };
 
-static inline void write_all(int fd, const char *buf, size_t len) {
-    size_t written = 0;
-    while (written < len) {
-        ssize_t ret = write(fd, buf + written, len - written);
-        assert(ret > 0);
-        written += ret;
-    }
-}
+static constexpr size_t kBufferSize = 1 << 14, kMaxCmdLen = 1 << 12;
+// a response has at most 3 pieces: "VALUE <bytes>\r\n", the value and "\r\n"
+static constexpr size_t kMaxRespIovs = 3, kMaxIovs = 1024;
+static constexpr size_t kMaxValueHead = 32;
+static_assert(KEY_MAX_LEN + VAL_MAX_LEN + kMaxValueHead <= kMaxCmdLen);
 
-static constexpr size_t kBufferSize = 1 << 14, kMaxCmdLen = 1 << 10;
+/**
+ * A command of the text protocol, pointing into the receive buffer:
+ *   get <key>\r\n
+ *   del <key>\r\n
+ *   set <key> <bytes>\r\n<value>\r\n
+ * A malformed command, or a key or a value too long, is answered by ERROR;
+ * so is a line longer than kMaxCmdLen, which is dropped as it arrives.
+ */
+struct command_t {
+    char op;  // 's', 'g', 'd', or 0 for an error
+    Key key;
+    scee::bytes_t val;  // only used by set
+};
 
 struct fd_reader {
     int fd;
-    char *rd_buffer, *packet;
+    char *rd_buffer;
+    // received but unparsed bytes are rd_buffer[cur_pos, cur_pos + rx_bytes)
     size_t rx_bytes, cur_pos;
+    // bytes still to drop, of a value too long to store
+    size_t discard;
+    // dropping a line too long to be a command, up to its end
+    bool overlong;
     fd_reader(int _fd) {
         fd = _fd;
         rd_buffer = (char *)malloc(kBufferSize);
-        packet = nullptr;
-        rx_bytes = cur_pos = 0;
+        rx_bytes = cur_pos = discard = 0;
+        overlong = false;
     }
     ~fd_reader() { free(rd_buffer); }
-    int read_from_socket() {
-        ssize_t ret = read(fd, rd_buffer + rx_bytes, kBufferSize - rx_bytes);
-        if (ret <= 0) {
-            return -1;
-        }
-        rx_bytes += ret;
-        return 0;
-    }
-    int read_packet() {
-        if (cur_pos >= kBufferSize || rx_bytes == 0) {
-            cur_pos = 0;
-            if (read_from_socket() < 0) {
-                assert((errno == EAGAIN) || (errno == EWOULDBLOCK));
-                return 0;
-            }
-        }
-        void *end = memchr(rd_buffer + cur_pos, '\n', rx_bytes);
+    // free space after the unparsed bytes, to receive into
+    char *recv_space(size_t &room) {
+        // only a partial command is left: keep it at the front
+        memmove(rd_buffer, rd_buffer + cur_pos, rx_bytes);
+        cur_pos = 0;
+        assert(rx_bytes <= kMaxCmdLen);
+        room = kBufferSize - rx_bytes;
+        return rd_buffer + rx_bytes;
+    }
+    void received(size_t n) {
+        rx_bytes += n;
+        drop();
+    }
+    void consume(size_t len) {
+        cur_pos += len;
+        rx_bytes -= len;
+    }
+    void drop() {
+        size_t len = std::min(discard, rx_bytes);
+        consume(len);
+        discard -= len;
+    }
+    // parse the next complete command in the buffer, false if there is none;
+    // what is left unparsed is shorter than kMaxCmdLen
+    bool read_packet(command_t &cmd) {
+        char *line = rd_buffer + cur_pos;
+        char *end = (char *)memchr(line, '\n', rx_bytes);
         if (!end) {
-            assert(rx_bytes <= kMaxCmdLen);
-            memcpy(rd_buffer, rd_buffer + cur_pos, rx_bytes);
-            cur_pos = 0;
-            if (read_from_socket() < 0) {
-                assert((errno == EAGAIN) || (errno == EWOULDBLOCK));
-                return 0;
+            if (overlong || rx_bytes >= kMaxCmdLen) {
+                overlong = true;
+                consume(rx_bytes);
             }
-            end = memchr(rd_buffer + cur_pos, '\n', rx_bytes);
+            return false;
         }
-        if (!end) {
-            return 0;
+        size_t len = end - line + 1;
+        cmd = {};
+        if (overlong) {
+            overlong = false;
+            consume(len);
+            return true;
         }
-        packet = rd_buffer + cur_pos;
-        size_t len = (char *)end - (rd_buffer + cur_pos) + 1;
-        cur_pos += len;
-        rx_bytes -= len;
-        return len;
+        char *eol = end > line && end[-1] == '\r' ? end - 1 : end;
+        char op = line[0];
+        if ((op != 's' && op != 'g' && op != 'd') || eol - line < 5) {
+            consume(len);
+            return true;
+        }
+        char *key = line + 4;
+        char *key_end = (char *)memchr(key, ' ', eol - key);
+        if (key_end == nullptr) key_end = eol;
+        cmd.key = {key, (size_t)(key_end - key)};
+        bool key_ok = cmd.key.len > 0 && cmd.key.len <= KEY_MAX_LEN;
+        if (op != 's') {
+            if (key_ok && key_end == eol) cmd.op = op;
+            consume(len);
+            return true;
+        }
+        size_t vlen = 0, digits = 0;
+        bool len_ok = true;
+        for (char *p = key_end + 1; p < eol && len_ok; ++p, ++digits) {
+            len_ok = *p >= '0' && *p <= '9' && digits < 9;
+            vlen = vlen * 10 + (*p & 15);
+        }
+        len_ok = len_ok && digits > 0;
+        if (!key_ok || !len_ok || vlen > VAL_MAX_LEN) {
+            // the value of a set that fails is dropped with the command
+            if (len_ok) discard = vlen + 2;
+            consume(len);
+            drop();
+            return true;
+        }
+        if (rx_bytes < len + vlen + 2) {
+            return false;
+        }
+        cmd.op = op;
+        cmd.val = {end + 1, vlen};
+        consume(len + vlen + 2);
+        return true;
     }
 };
 
 ptr_t<hashmap_t> *hm_safe = nullptr;
+// memory limit of the hashmap, see hashmap_t; 0 if unbounded
+size_t mem_limit = 0;
+
+// run one resize closure if the hashmap is due for a resize
+template <RunType RT>
+void resize_if_due() {
+    if (!hashmap_resize_due(hm_safe)) return;
+    if constexpr (RT == RunType::Baseline) {
+        hashmap_resize(hm_safe);
+    } else {
+        using HashmapResizeType = bool (*)(scee::ptr_t<hashmap_t> *);
+        auto app_fn = reinterpret_cast<HashmapResizeType>(app::hashmap_resize);
+        auto val_fn =
+            reinterpret_cast<HashmapResizeType>(validator::hashmap_resize);
+        scee::run2(app_fn, val_fn, hm_safe);
+    }
+}
+
+// run evict closures until the hashmap is back under its memory limit
+template <RunType RT>
+void evict_if_due() {
+    bool busy = true;
+    while (busy && hashmap_evict_due(hm_safe)) {
+        if constexpr (RT == RunType::Baseline) {
+            busy = hashmap_evict(hm_safe);
+        } else {
+            using HashmapEvictType = bool (*)(scee::ptr_t<hashmap_t> *);
+            auto app_fn =
+                reinterpret_cast<HashmapEvictType>(app::hashmap_evict);
+            auto val_fn =
+                reinterpret_cast<HashmapEvictType>(validator::hashmap_evict);
+            busy = scee::run2(app_fn, val_fn, hm_safe);
+        }
+    }
+}
+
+// one in kTouchSample gets marks its key referenced for eviction, in
+// batches: gets stay read-only closures
+static constexpr uint32_t kTouchSample = 8;
+thread_local touch_t touches;
+thread_local uint32_t nsampled;
+
+template <RunType RT>
+void run_touches() {
+    if constexpr (RT == RunType::Baseline) {
+        hashmap_touch(hm_safe, touches.bytes());
+    } else {
+        using HashmapTouchType =
+            void (*)(scee::ptr_t<hashmap_t> *, scee::bytes_t);
+        auto app_fn = reinterpret_cast<HashmapTouchType>(app::hashmap_touch);
+        auto val_fn =
+            reinterpret_cast<HashmapTouchType>(validator::hashmap_touch);
+        scee::run2(app_fn, val_fn, hm_safe, touches.bytes());
+    }
+    touches.clear();
+}
+
+template <RunType RT>
+void sample_get(Key key) {
+    if (mem_limit == 0 || ++nsampled % kTouchSample != 0) return;
+    if (!touches.push(key)) {
+        run_touches<RT>();
+        touches.push(key);
+    }
+    if (touches.full()) run_touches<RT>();
+}
 
 template <RunType RT>
 struct fd_worker {
+    /**
+     * Responses of the commands received so far, sent at once by the I/O
+     * backend (see io.hpp). Pieces point at constant strings and at the Val
+     * objects themselves, which are immutable until freed: the objects are
+     * pinned against the free log from before the closures that load them
+     * until sent(), or until hold() copies what is left into `held` for a
+     * client that does not read. Baseline frees immediately, so values are
+     * copied into wt_buffer.
+     */
+    struct iovec iovs[kMaxIovs];
+    int niovs;
     char *wt_buffer;
     size_t len;
+    std::string held;
     fd_reader reader;
+    batch_t batch;
+    bool pinned;
+    uint64_t pin_tsc;
     fd_worker(int _fd) : reader(_fd) {
         wt_buffer = (char *)malloc(kBufferSize);
+        niovs = 0;
         len = 0;
+        pinned = false;
     }
     int64_t parse_head_id(char *&packet, int &len) {
         int64_t head_id = 0;
@@ -119,83 +271,196 @@ struct fd_worker {
         --len;
         return head_id;
     }
-    void run() {
-        while ((len = reader.read_packet())) {
-            if (reader.packet[0] == 's') {  // set
-                Key key;
-                Val val;
-                memcpy(key.ch, reader.packet + 4, KEY_LEN);
-                memcpy(val.ch, reader.packet + 4 + KEY_LEN + 1, VAL_LEN);
-                RetType ret;
-                if constexpr (RT == RunType::Baseline) {
-                    ret = hashmap_set(hm_safe, key, val);
-                } else {
-                    using HashmapSetType =
-                        RetType (*)(scee::ptr_t<hashmap_t> *, Key, Val);
-                    auto app_fn =
-                        reinterpret_cast<HashmapSetType>(app::hashmap_set);
-                    auto val_fn = reinterpret_cast<HashmapSetType>(
-                        validator::hashmap_set);
-                    ret = scee::run2(app_fn, val_fn, hm_safe, key, val);
-                }
-                memcpy(wt_buffer, kRetVals[ret], strlen(kRetVals[ret]) + 1);
-            } else if (reader.packet[0] == 'g') {  // get
-                Key key;
-                memcpy(key.ch, reader.packet + 4, KEY_LEN);
-                const Val *val;
-                if constexpr (RT == RunType::Baseline) {
-                    val = hashmap_get(hm_safe, key);
-                } else {
-                    using HashmapGetType =
-                        const Val *(*)(scee::ptr_t<hashmap_t> *, Key);
-                    auto app_fn =
-                        reinterpret_cast<HashmapGetType>(app::hashmap_get);
-                    auto val_fn = reinterpret_cast<HashmapGetType>(
-                        validator::hashmap_get);
-                    val = scee::run2(app_fn, val_fn, hm_safe, key);
-                }
-                if (val != nullptr) {
-                    std::string ans = kRetVals[kValue];
-                    ans += std::string(val->ch, VAL_LEN);
-                    ans += kCrlf;
-                    memcpy(wt_buffer, ans.data(), ans.size());
-                    wt_buffer[ans.size()] = '\0';
-                } else {
-                    memcpy(wt_buffer, kRetVals[kNotFound],
-                           strlen(kRetVals[kNotFound]) + 1);
-                }
-            } else if (reader.packet[0] == 'd') {  // del
-                Key key;
-                memcpy(key.ch, reader.packet + 4, KEY_LEN);
-                RetType ret;
-                if constexpr (RT == RunType::Baseline) {
-                    ret = hashmap_del(hm_safe, key);
-                } else {
-                    using HashmapDelType =
-                        RetType (*)(scee::ptr_t<hashmap_t> *, Key);
-                    auto app_fn =
-                        reinterpret_cast<HashmapDelType>(app::hashmap_del);
-                    auto val_fn = reinterpret_cast<HashmapDelType>(
-                        validator::hashmap_del);
-                    ret = scee::run2(app_fn, val_fn, hm_safe, key);
-                }
-                memcpy(wt_buffer, kRetVals[ret], strlen(kRetVals[ret]) + 1);
+    void append(const char *data, size_t size) {
+        iovs[niovs++] = {.iov_base = (void *)data, .iov_len = size};
+    }
+    void append_ret(RetType ret) {
+        append(kRetVals[ret], strlen(kRetVals[ret]));
+    }
+    void append_val(const Val *val) {
+        if (val != nullptr) {
+            char *head = wt_buffer + len;
+            int n = snprintf(head, kMaxValueHead, "%s%zu\r\n",
+                             kRetVals[kValue], val->length);
+            append(head, n);
+            len += n;
+            if constexpr (RT == RunType::Baseline) {
+                memcpy(wt_buffer + len, val->v, val->length);
+                append(wt_buffer + len, val->length);
+                len += val->length;
+            } else {
+                append(val->v, val->length);
+            }
+            append(kCrlf, strlen(kCrlf));
+        } else {
+            append_ret(kNotFound);
+        }
+    }
+    // room for the responses of a full batch
+    bool full() const {
+        return niovs + batch_t::kMaxCmds * kMaxRespIovs > kMaxIovs ||
+               len + batch_t::kMaxCmds * (kMaxValueHead + VAL_MAX_LEN) >
+                   kBufferSize;
+    }
+    void pin() {
+        if constexpr (RT != RunType::Baseline) {
+            if (!pinned) pin_tsc = scee::closure_start_log.pin();
+            pinned = true;
+        }
+    }
+    void unpin() {
+        if constexpr (RT != RunType::Baseline) {
+            if (pinned) scee::closure_start_log.unpin(pin_tsc);
+            pinned = false;
+        }
+    }
+    void execute(const command_t &cmd) {
+        Key key = cmd.key;
+        if (cmd.op == 's') {  // set
+            scee::bytes_t val = cmd.val;
+            RetType ret;
+            if constexpr (RT == RunType::Baseline) {
+                ret = hashmap_set(hm_safe, key, val);
             } else {
-                memcpy(wt_buffer, kRetVals[kError],
-                       strlen(kRetVals[kError]) + 1);
+                using HashmapSetType =
+                    RetType (*)(scee::ptr_t<hashmap_t> *, Key, scee::bytes_t);
+                auto app_fn =
+                    reinterpret_cast<HashmapSetType>(app::hashmap_set);
+                auto val_fn =
+                    reinterpret_cast<HashmapSetType>(validator::hashmap_set);
+                ret = scee::run2(app_fn, val_fn, hm_safe, key, val);
+            }
+            resize_if_due<RT>();
+            evict_if_due<RT>();
+            append_ret(ret);
+        } else if (cmd.op == 'g') {  // get
+            const Val *val;
+            if constexpr (RT == RunType::Baseline) {
+                val = hashmap_get(hm_safe, key);
+            } else {
+                using HashmapGetType =
+                    const Val *(*)(const scee::ptr_t<hashmap_t> *, Key);
+                auto app_fn = reinterpret_cast<HashmapGetType>(
+                    app_readonly::hashmap_get);
+                auto val_fn = reinterpret_cast<HashmapGetType>(
+                    validator_readonly::hashmap_get);
+                val = scee::run_readonly(
+                    app_fn, val_fn,
+                    static_cast<const scee::ptr_t<hashmap_t> *>(hm_safe), key);
+            }
+            append_val(val);
+            sample_get<RT>(key);
+        } else if (cmd.op == 'd') {  // del
+            RetType ret;
+            if constexpr (RT == RunType::Baseline) {
+                ret = hashmap_del(hm_safe, key);
+            } else {
+                using HashmapDelType =
+                    RetType (*)(scee::ptr_t<hashmap_t> *, Key);
+                auto app_fn =
+                    reinterpret_cast<HashmapDelType>(app::hashmap_del);
+                auto val_fn =
+                    reinterpret_cast<HashmapDelType>(validator::hashmap_del);
+                ret = scee::run2(app_fn, val_fn, hm_safe, key);
+            }
+            resize_if_due<RT>();
+            append_ret(ret);
+        } else {
+            append_ret(kError);
+        }
+    }
+    // queue a command into the batch, run the batch once it is full
+    void enqueue(const command_t &cmd) {
+        if (cmd.op == 'g') sample_get<RT>(cmd.key);
+        if (!batch.push(cmd.op, cmd.key, cmd.val)) {
+            run_batch();
+            batch.push(cmd.op, cmd.key, cmd.val);
+        }
+        if (batch.full()) run_batch();
+    }
+    void run_batch() {
+        if (batch.ncmds == 0) return;
+        using HashmapBatchType =
+            batch_ret_t (*)(scee::ptr_t<hashmap_t> *, scee::bytes_t);
+        auto app_fn = reinterpret_cast<HashmapBatchType>(app::hashmap_batch);
+        auto val_fn =
+            reinterpret_cast<HashmapBatchType>(validator::hashmap_batch);
+        batch_ret_t ret = scee::run2(app_fn, val_fn, hm_safe, batch.bytes());
+        for (uint32_t i = 0; i < batch.ncmds; ++i) {
+            if (batch.ops[i] == 'g') {
+                append_val(ret.vals[i]);
+            } else {
+                append_ret(ret.rets[i]);
+            }
+        }
+        batch.clear();
+        resize_if_due<RT>();
+        evict_if_due<RT>();
+    }
+    // Worker of io.hpp
+    char *recv_space(size_t &room) { return reader.recv_space(room); }
+    void received(size_t n) { reader.received(n); }
+    void process() {
+        if (!held.empty()) return;
+        pin();
+        command_t cmd;
+        while (!full() && reader.read_packet(cmd)) {
+            if constexpr (RT == RunType::SCEEBatch) {
+                enqueue(cmd);
+            } else {
+                execute(cmd);
             }
-            write_all(reader.fd, wt_buffer, strlen(wt_buffer));
         }
+        if constexpr (RT == RunType::SCEEBatch) run_batch();
+        if (niovs == 0) unpin();
+    }
+    int pending(struct iovec *&iov) {
+        iov = iovs;
+        return niovs;
+    }
+    void hold(const struct iovec *iov, int iovcnt) {
+        std::string rest;
+        for (int i = 0; i < iovcnt; ++i) {
+            rest.append((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+        held.swap(rest);
+        niovs = 0;
+        len = 0;
+        append(held.data(), held.size());
+        unpin();
+    }
+    void sent() {
+        niovs = 0;
+        len = 0;
+        held.clear();
+        unpin();
+    }
+    ~fd_worker() {
+        unpin();
+        free(wt_buffer);
     }
-    ~fd_worker() { free(wt_buffer); }
 };
 
-template <RunType RT>
-void Start(int port) {
-    const int MAX_EVENTS = 128;  // max total active connections
+enum Layout {
+    ReusePort,     // all servers listen on one port, SO_REUSEPORT balances
+    ReusePortCPU,  // as ReusePort, steered to the server on the same core
+    PortPerServer, // server i listens on port + i, clients shard by port
+};
+
+// a deep enough backlog for bursts of new connections
+static constexpr int kListenBacklog = SOMAXCONN;
 
+int listen_on(uint32_t port, bool reuseport) {
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     assert(listen_fd >= 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) <
+            0) {
+        perror("setsockopt SO_REUSEPORT");
+        abort();
+    }
 
     struct sockaddr_in server_addr = {
         .sin_family = AF_INET,
@@ -204,95 +469,86 @@ void Start(int port) {
     };
     if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
         0) {
-        close(listen_fd);
-        assert("bind error" && false);
-    }
-    if (listen(listen_fd, 1) < 0) {
-        close(listen_fd);
-        assert("listen error" && false);
+        perror("bind");
+        abort();
     }
-    printf("server listening on port %d\n", port);
-
-    int efd = epoll_create1(0);
-    if (efd == -1) {
-        assert("epoll create error" && false);
+    if (listen(listen_fd, kListenBacklog) < 0) {
+        perror("listen");
+        abort();
     }
+    return listen_fd;
+}
 
-    struct epoll_event ev, events[MAX_EVENTS];
-    auto epoll_init = [&](int fd) {
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-        ev.data.fd = fd;
-        ev.events = EPOLLIN | EPOLLET;
-        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-            assert("epoll ctl error" && false);
-        }
+// pick the socket of the reuseport group by the cpu that receives the SYN:
+// sockets are indexed in bind order, server i is bound to core i
+void steer_by_cpu(int listen_fd, int num_servers) {
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)num_servers},
+        {BPF_RET | BPF_A, 0, 0, 0},
     };
-    epoll_init(listen_fd);
-
-    std::map<int, std::unique_ptr<fd_worker<RT>>> workers;
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) < 0) {
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+        abort();
+    }
+}
 
-    int timeout = -1;
+template <RunType RT>
+void Start(IOBackend backend, int listen_fd) {
+    serve<fd_worker<RT>>(backend, listen_fd);
+}
 
-    while (true) {
-        int nfds = epoll_wait(efd, events, MAX_EVENTS, timeout);
-        if (nfds == -1) {
-            if (errno == EINTR) {
-                // avoid the interrupt caused by strace
-                continue;
-            }
-            // DEBUG(("epoll wait receive error code = " +
-            // std::to_string(errno)).c_str());
-            assert("epoll wait error" && false);
-        }
-        if (nfds == 0) {
-            DEBUG("server stopped due to inactivity.\n");
-            break;
+int main_fn(RunType rt, uint32_t port, int num_servers, Layout layout,
+            IOBackend backend) {
+    hm_safe = ptr_t<hashmap_t>::create(hashmap_t::make(1 << 16));
+    hashmap_set_limit(hm_safe, mem_limit);
+    // bind in server order before any server starts: the cpu steering
+    // program selects sockets by their index in the reuseport group
+    std::vector<int> listen_fds;
+    for (int i = 0; i < num_servers; ++i) {
+        if (layout == Layout::PortPerServer) {
+            listen_fds.push_back(listen_on(port + i, false));
+            printf("server listening on port %d\n", port + i);
+        } else {
+            listen_fds.push_back(listen_on(port, true));
         }
-        for (int i = 0; i < nfds; ++i) {
-            int fd = events[i].data.fd;
-            uint32_t state = events[i].events;
-            if (fd == listen_fd) {
-                // new client connection
-                struct sockaddr_in client_addr;
-                socklen_t client_addr_len = sizeof(client_addr);
-                while (true) {
-                    int conn_fd =
-                        accept(listen_fd, (struct sockaddr *)&client_addr,
-                               &client_addr_len);
-                    if (conn_fd == -1) {
-                        assert((errno == EAGAIN) || (errno == EWOULDBLOCK));
-                        break;
-                    }
-                    epoll_init(conn_fd);
-                    workers[conn_fd] = std::make_unique<fd_worker<RT>>(conn_fd);
-                }
-            } else if ((state & (EPOLLERR | EPOLLHUP)) && !(state & EPOLLIN)) {
-                // client connection closed
-                close(fd);
-                workers.erase(fd);
-            } else {
-                // receive message on this client socket
-                workers[fd]->run();
-                timeout = 5000;
-            }
+    }
+    if (layout != Layout::PortPerServer) {
+        if (layout == Layout::ReusePortCPU) {
+            steer_by_cpu(listen_fds[0], num_servers);
         }
+        printf("%d servers listening on port %d\n", num_servers, port);
     }
-}
-
-int main_fn(RunType rt, uint32_t port, int num_servers) {
-    hm_safe = ptr_t<hashmap_t>::create(hashmap_t::make(1 << 23));
+    bool pin = layout == Layout::ReusePortCPU;
     std::vector<scee::AppThread> app_threads;
     std::vector<std::thread> normal_threads;
     for (int i = 0; i < num_servers; ++i) {
+        int fd = listen_fds[i];
+        auto start = [fd, i, pin, backend](auto start_fn) {
+            if (pin) bind_core(pthread_self(), i);
+            start_fn(backend, fd);
+        };
         switch (rt) {
         case RunType::Baseline:
-            normal_threads.emplace_back([port, i]() { Start<RunType::Baseline>(port + i); });
+            normal_threads.emplace_back(
+                [start]() { start(Start<RunType::Baseline>); });
             break;
         case RunType::SCEE:
-            app_threads.emplace_back([port, i]() { Start<RunType::SCEE>(port + i); });
+            app_threads.emplace_back(
+                [start]() { start(Start<RunType::SCEE>); });
             break;
         case RunType::SCEEProfile:
-            app_threads.emplace_back([port, i]() { Start<RunType::SCEEProfile>(port + i); });
+            app_threads.emplace_back(
+                [start]() { start(Start<RunType::SCEEProfile>); });
+            break;
+        case RunType::SCEEBatch:
+            app_threads.emplace_back(
+                [start]() { start(Start<RunType::SCEEBatch>); });
             break;
         }
     }
@@ -305,10 +561,32 @@ int main_fn(RunType rt, uint32_t port, int num_servers) {
     return 0;
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-m MiB] [baseline|scee|scee-profile|scee-batch] "
+            "<port> [num_servers] [reuseport|reuseport-cpu|ports] "
+            "[epoll|uring]\n"
+            "  -m MiB  memory limit of keys and values, evicted by CLOCK "
+            "(default: unbounded)\n",
+            prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 5) {
-        fprintf(stderr, "Usage: %s [baseline|scee|scee-profile] <port> [num_servers]\n",
-                argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt == 'm') {
+            mem_limit = strtoull(optarg, nullptr, 10) << 20;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // positional arguments, as if there were no options
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+    if (argc < 2 || argc > 6) {
+        usage(argv[0]);
         return 1;
     }
     RunType rt;
@@ -318,15 +596,40 @@ int main(int argc, char *argv[]) {
         rt = RunType::SCEE;
     } else if (strcmp(argv[1], "scee-profile") == 0) {
         rt = RunType::SCEEProfile;
+    } else if (strcmp(argv[1], "scee-batch") == 0) {
+        rt = RunType::SCEEBatch;
     } else {
-        fprintf(stderr, "Usage: %s [baseline|scee|scee-profile] <port>\n",
-                argv[0]);
+        usage(argv[0]);
         return 1;
     }
     uint32_t port = 6379;
     uint32_t num_servers = 1;
+    Layout layout = Layout::ReusePort;
     if (argc >= 3) port = atoi(argv[2]);
     if (argc >= 4) num_servers = atoi(argv[3]);
-    scee::main_thread(main_fn, rt, port, num_servers);
+    if (argc >= 5) {
+        if (strcmp(argv[4], "reuseport") == 0) {
+            layout = Layout::ReusePort;
+        } else if (strcmp(argv[4], "reuseport-cpu") == 0) {
+            layout = Layout::ReusePortCPU;
+        } else if (strcmp(argv[4], "ports") == 0) {
+            layout = Layout::PortPerServer;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    IOBackend backend = IOBackend::Epoll;
+    if (argc >= 6) {
+        if (strcmp(argv[5], "epoll") == 0) {
+            backend = IOBackend::Epoll;
+        } else if (strcmp(argv[5], "uring") == 0) {
+            backend = IOBackend::Uring;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    scee::main_thread(main_fn, rt, port, (int)num_servers, layout, backend);
     return 0;
-}
\ No newline at end of file
+}
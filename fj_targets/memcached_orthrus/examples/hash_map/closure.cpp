@@ -0,0 +1,67 @@
+#include <cstdint>
+#include <cstring>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "custom_stl.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+
+namespace NAMESPACE {
+#include "closure.hpp"
+
+using namespace ::scee;
+
+counters_t counters_t::make(size_t capacity, size_t nstripes) {
+    counters_t counters;
+    counters.map = map_t::make(capacity, nstripes);
+    return counters;
+}
+
+void counters_t::destroy() const { map.destroy(); }
+
+uint64_t counters_add(ptr_t<counters_t> *counters, uint64_t key,
+                      uint64_t delta) {
+    const counters_t::map_t &map = counters->load()->map;
+    uint32_t hash = counter_hash(key);
+    counters_t::map_t::stripe_guard_t guard(map.stripe_of(hash));
+    auto slot = map.locate(key, hash);
+    uint64_t value = delta;
+    if (slot.entry != nullptr) {
+        value += slot.entry->value;
+        map.remove(slot);
+        free_obj(const_cast<counter_t *>(slot.entry));
+        // the chain may have changed
+        slot = map.locate(key, hash);
+    }
+    fixed_ptr_t<counter_t> next(slot.last().first);
+    map.insert(slot, ptr_t<counter_t>::make_obj(
+                         counter_t(key, value, hash, next)));
+    return value;
+}
+
+uint64_t counters_get(ptr_t<counters_t> *counters, uint64_t key) {
+    const counters_t::map_t &map = counters->load()->map;
+    uint32_t hash = counter_hash(key);
+    return map.read(hash, [&] {
+        const counter_t *counter = map.locate(key, hash).entry;
+        return counter != nullptr ? counter->value : 0;
+    });
+}
+
+bool counters_del(ptr_t<counters_t> *counters, uint64_t key) {
+    const counters_t::map_t &map = counters->load()->map;
+    uint32_t hash = counter_hash(key);
+    counters_t::map_t::stripe_guard_t guard(map.stripe_of(hash));
+    auto slot = map.locate(key, hash);
+    if (slot.entry == nullptr) return false;
+    map.remove(slot);
+    free_obj(const_cast<counter_t *>(slot.entry));
+    return true;
+}
+
+bool counters_resize(ptr_t<counters_t> *counters) {
+    return counters->load()->map.resize_step();
+}
+
+}  // namespace NAMESPACE
@@ -0,0 +1,43 @@
+// SHOULD NOT include any header files
+// SHOULD NOT #pragma once
+
+// a counter per key, in a scee::versioned_hash_map. Counters are immutable:
+// an add replaces the entry of the key
+struct counter_t : public scee::imm_nonunique_t {
+    scee::fixed_ptr_t<counter_t> next;
+    uint64_t key;
+    uint64_t value;
+    uint32_t hash;
+    uint32_t padding;
+    size_t size() const { return sizeof(*this); }
+    counter_t(uint64_t key, uint64_t value, uint32_t hash,
+              scee::fixed_ptr_t<counter_t> next)
+        : next(next), key(key), value(value), hash(hash), padding(0) {}
+    counter_t(const counter_t *counter, scee::fixed_ptr_t<counter_t> next)
+        : counter_t(counter->key, counter->value, counter->hash, next) {}
+    bool matches(uint64_t k, uint32_t h) const { return hash == h && key == k; }
+};
+
+struct counters_t : public scee::imm_nonunique_t {
+    using map_t = scee::versioned_hash_map<counter_t>;
+    map_t map;
+    size_t size() const { return sizeof(*this); }
+    // make: create a counters_t instance in non-versioned memory
+    static counters_t make(size_t capacity, size_t nstripes);
+    void destroy() const;
+};
+
+// few bits, so that keys share buckets and stripes
+inline uint32_t counter_hash(uint64_t key) {
+    return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+// add delta to the counter of key, created at 0; return the new value
+uint64_t counters_add(scee::ptr_t<counters_t> *counters, uint64_t key,
+                      uint64_t delta);
+// the value of key, 0 if it has no counter
+uint64_t counters_get(scee::ptr_t<counters_t> *counters, uint64_t key);
+// false if key has no counter
+bool counters_del(scee::ptr_t<counters_t> *counters, uint64_t key);
+// one step of versioned_hash_map::resize_step()
+bool counters_resize(scee::ptr_t<counters_t> *counters);
@@ -0,0 +1,169 @@
+#include <stdio.h>
+
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "context.hpp"
+#include "ctltypes.hpp"
+#include "custom_stl.hpp"
+#include "log.hpp"
+#include "namespace.hpp"
+#include "ptr.hpp"
+#include "scee.hpp"
+#include "thread.hpp"
+
+namespace raw {
+#include "closure.hpp"
+}  // namespace raw
+namespace app {
+#include "closure.hpp"
+}  // namespace app
+namespace validator {
+#include "closure.hpp"
+}  // namespace validator
+
+using namespace raw;
+
+// a few stripes and a small table, so that keys share stripes and the map
+// grows and shrinks many times
+constexpr size_t InitCap = 16, NStripes = 4;
+constexpr int NThreads = 2, NKeys = 1 << 12, NOps = 1 << 18;
+
+enum RunType {
+    Baseline,
+    SCEE,
+};
+
+template <RunType RT>
+uint64_t add(ptr_t<counters_t> *counters, uint64_t key, uint64_t delta) {
+    if constexpr (RT == RunType::Baseline) {
+        return counters_add(counters, key, delta);
+    } else {
+        using AddType =
+            uint64_t (*)(scee::ptr_t<counters_t> *, uint64_t, uint64_t);
+        auto app_fn = reinterpret_cast<AddType>(app::counters_add);
+        auto val_fn = reinterpret_cast<AddType>(validator::counters_add);
+        return scee::run2(app_fn, val_fn, counters, key, delta);
+    }
+}
+
+template <RunType RT>
+uint64_t get(ptr_t<counters_t> *counters, uint64_t key) {
+    if constexpr (RT == RunType::Baseline) {
+        return counters_get(counters, key);
+    } else {
+        using GetType = uint64_t (*)(scee::ptr_t<counters_t> *, uint64_t);
+        auto app_fn = reinterpret_cast<GetType>(app::counters_get);
+        auto val_fn = reinterpret_cast<GetType>(validator::counters_get);
+        return scee::run2(app_fn, val_fn, counters, key);
+    }
+}
+
+template <RunType RT>
+bool del(ptr_t<counters_t> *counters, uint64_t key) {
+    if constexpr (RT == RunType::Baseline) {
+        return counters_del(counters, key);
+    } else {
+        using DelType = bool (*)(scee::ptr_t<counters_t> *, uint64_t);
+        auto app_fn = reinterpret_cast<DelType>(app::counters_del);
+        auto val_fn = reinterpret_cast<DelType>(validator::counters_del);
+        return scee::run2(app_fn, val_fn, counters, key);
+    }
+}
+
+template <RunType RT>
+void resize(ptr_t<counters_t> *counters) {
+    if (!counters->load()->map.resize_due()) return;
+    if constexpr (RT == RunType::Baseline) {
+        counters_resize(counters);
+    } else {
+        using ResizeType = bool (*)(scee::ptr_t<counters_t> *);
+        auto app_fn = reinterpret_cast<ResizeType>(app::counters_resize);
+        auto val_fn = reinterpret_cast<ResizeType>(validator::counters_resize);
+        scee::run2(app_fn, val_fn, counters);
+    }
+}
+
+// each thread owns the keys k with k % NThreads == tid, and checks them
+// against its own copy; the keys of all threads share buckets and stripes
+template <RunType RT>
+void worker_fn(ptr_t<counters_t> *counters, int tid) {
+    std::mt19937 rng(tid + 1);
+    std::unordered_map<uint64_t, uint64_t> expect;
+    auto check = [&](bool ok, const char *op, uint64_t key) {
+        if (ok) return;
+        fprintf(stderr, "Thread %d: %s error for key %lu\n", tid, op, key);
+        exit(1);
+    };
+    auto expected = [&](uint64_t key) -> uint64_t {
+        auto it = expect.find(key);
+        return it != expect.end() ? it->second : 0;
+    };
+    for (int i = 0; i < NOps; ++i) {
+        uint64_t key = rng() % NKeys * NThreads + tid;
+        // phases of mostly adds and mostly deletes, to grow and shrink the
+        // map: add, delete or get
+        bool adding = (i / (NOps / 8)) % 2 == 0;
+        int op = rng() % 8;
+        if (op < (adding ? 4 : 1)) {
+            uint64_t delta = rng() % 100 + 1;
+            expect[key] += delta;
+            check(add<RT>(counters, key, delta) == expect[key], "Add", key);
+        } else if (op < 6) {
+            bool found = expect.erase(key) == 1;
+            check(del<RT>(counters, key) == found, "Del", key);
+        } else {
+            check(get<RT>(counters, key) == expected(key), "Get", key);
+        }
+        resize<RT>(counters);
+    }
+    for (uint64_t k = tid; k < NKeys * NThreads; k += NThreads) {
+        check(get<RT>(counters, k) == expected(k), "Final get", k);
+    }
+    scee::wait_validation();
+}
+
+template <RunType RT>
+void test_fn() {
+    ptr_t<counters_t> *counters =
+        ptr_t<counters_t>::create(counters_t::make(InitCap, NStripes));
+    std::vector<scee::AppThread> threads;
+    for (int tid = 0; tid < NThreads; ++tid) {
+        threads.emplace_back([counters, tid] { worker_fn<RT>(counters, tid); });
+    }
+    for (auto &thread : threads) thread.join();
+    fprintf(stderr, "Counters: %lu\n", counters->load()->map.count());
+    destroy_obj(const_cast<counters_t *>(counters->load()));
+    counters->destroy();
+    fprintf(stderr, "Test passed!!!\n");
+}
+
+int main_fn(RunType rt) {
+    switch (rt) {
+    case RunType::Baseline:
+        test_fn<RunType::Baseline>();
+        break;
+    case RunType::SCEE:
+        test_fn<RunType::SCEE>();
+        break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s [baseline|scee]\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "baseline") == 0) {
+        scee::main_thread(main_fn, RunType::Baseline);
+    } else if (strcmp(argv[1], "scee") == 0) {
+        scee::main_thread(main_fn, RunType::SCEE);
+    } else {
+        fprintf(stderr, "Usage: %s [baseline|scee]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -49,13 +49,17 @@ calculate_crc32(const void* data, std::size_t length) {
     return ~crc;
 }
 
-static checksum_t compute_checksum(const void* ptr, size_t size) {
+[[maybe_unused]] static checksum_t compute_checksum(const void* ptr,
+                                                    size_t size) {
     return calculate_crc32(ptr, size);
 }
 
 #else
 
-static checksum_t compute_checksum(const void* ptr, size_t size) { return 0; }
+[[maybe_unused]] static checksum_t compute_checksum(const void* ptr,
+                                                    size_t size) {
+    return 0;
+}
 
 #endif
 
@@ -2,5 +2,6 @@
 
 #include "context/docs.hpp"
 #include "context/raw.hpp"
+#include "context/readonly_run.hpp"
 #include "context/run.hpp"
 #include "context/validation.hpp"
@@ -4,6 +4,8 @@
 #include "namespace.hpp"
 
 // this file lists functions that requires context-specific implementation
+// (read-only contexts only implement loads, and delete the others)
+#if !IS_READONLY_CONTEXT
 namespace NAMESPACE {
 
 /* allocate an object of size `size`.
@@ -24,9 +26,37 @@ void destroy_obj(T *obj);
  */
 void *alloc_ptr();
 
-// free a pointer by calling free_mutable()
+/* free a pointer.
+ * raw: call free_mutable()
+ * run: push to free_log, lock-free readers may still load it
+ * validate: do nothing
+ */
 void free_ptr(void *ptr);
 
+/* allocate `n` contiguous pointers, e.g. the cells of a flat_mut_array_t.
+ * all pointers are initialized to nullptr.
+ * raw & run: call alloc_mutable_zeroed() to keep consistency
+ * validate: compare `n` and simply return the pointer allocated
+ */
+void *alloc_ptr_array(size_t n);
+
+/* free pointers allocated by alloc_ptr_array().
+ * raw: call free_mutable()
+ * run: push to free_log, concurrent readers may still be probing the array
+ * validate: do nothing
+ */
+void free_ptr_array(void *ptr);
+
+/* allocate zeroed, non-versioned memory for control data (see ctltypes.hpp),
+ * e.g. locks, version counters and statistics, in a versioned object.
+ * raw & run: call alloc_mutable_zeroed(), run records the pointer
+ * validate: simply return the pointer allocated, and never access it
+ */
+void *alloc_ctl(size_t size);
+
+// free control data allocated by alloc_ctl() by calling free_mutable()
+void free_ctl(void *ptr);
+
 /* create a shadow memory address at validation for object initialization.
  * raw: simply return the pointer
  * run: simply return the pointer
@@ -60,6 +90,11 @@ void store_obj(void *dst, const void *src, size_t size);
  * raw: read the value directly
  * run: record the address to load and the loaded value, OPTIONALLY validate the
  * checksum validate: compare the address to load and return the recorded value
+ * with LOAD_CACHE, run & validate serve repeated loads in a closure from
+ * the cache of its log, and only the first load is recorded, except inside a
+ * LoadCacheBypass
+ * read-only contexts record the loaded value only, and fold the address into
+ * readonly_trace
  */
 const void *load_ptr(const void *ptr);
 
@@ -71,6 +106,15 @@ const void *load_ptr(const void *ptr);
 void store_ptr(const void *ptr, const void *val);
 
 // return true if the current context is a validator
-bool is_validator();
+constexpr bool is_validator();
+
+// return true if the current context is raw, where objects are freed
+// immediately: readers can not rely on deferred frees, and should lock
+constexpr bool is_raw();
+
+// save and reuse a return value outside the protected space.
+template <typename T>
+T external_return(T val);
 
 }  // namespace NAMESPACE
+#endif
@@ -19,6 +19,16 @@ inline void *alloc_ptr() { return alloc_mutable(sizeof(void *)); }
 
 inline void free_ptr(void *ptr) { free_mutable(ptr); }
 
+inline void *alloc_ptr_array(size_t n) {
+    return alloc_mutable_zeroed(n * sizeof(void *));
+}
+
+inline void free_ptr_array(void *ptr) { free_mutable(ptr); }
+
+inline void *alloc_ctl(size_t size) { return alloc_mutable_zeroed(size); }
+
+inline void free_ctl(void *ptr) { free_mutable(ptr); }
+
 template <typename T>
 inline void destroy_obj(T *obj) {
     if constexpr (std::is_base_of_v<obj_header, T>) {
@@ -54,6 +64,13 @@ inline void store_ptr(const void *ptr, const void *val) {
     *((const void **)ptr) = val;
 }
 
-inline bool is_validator() { return false; }
+inline constexpr bool is_validator() { return false; }
+
+inline constexpr bool is_raw() { return true; }
+
+template <typename T>
+inline T external_return(T val) {
+    return val;
+}
 
 }  // namespace raw
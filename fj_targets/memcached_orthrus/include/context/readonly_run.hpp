@@ -0,0 +1,159 @@
+#pragma once
+
+#include "log.hpp"
+#include "memtypes.hpp"
+#include "readonly.hpp"
+
+/**
+ * Contexts of read-only closures, see run_readonly(). They only load: a
+ * read-only closure that reaches a store, an allocation or a free, directly
+ * or through ptr_t and the containers, does not compile.
+ *
+ * Loads log only the loaded value, and fold the address into readonly_trace;
+ * the validator replays the values, as for other closures, see ReadOnlyTrace.
+ */
+
+/**
+ * The stores, allocations and frees of the read-only contexts. They are
+ * templates that fail a static_assert when instantiated, rather than deleted
+ * functions: ptr_t and the containers call some of them without dependent
+ * arguments, and only the members a closure instantiates should be rejected.
+ */
+namespace readonly_forbidden {
+
+template <typename T>
+constexpr bool allowed = false;
+
+#define READONLY_FORBIDDEN(op) \
+    static_assert(allowed<T>, #op " in a read-only closure")
+
+template <typename T = void>
+void *alloc_obj(size_t size) {
+    READONLY_FORBIDDEN(alloc_obj);
+    return nullptr;
+}
+
+template <typename T = void>
+void free_obj(void *ptr) {
+    READONLY_FORBIDDEN(free_obj);
+}
+
+template <typename T>
+void destroy_obj(T *obj) {
+    READONLY_FORBIDDEN(destroy_obj);
+}
+
+template <typename T = void>
+void *alloc_ptr() {
+    READONLY_FORBIDDEN(alloc_ptr);
+    return nullptr;
+}
+
+template <typename T = void>
+void free_ptr(void *ptr) {
+    READONLY_FORBIDDEN(free_ptr);
+}
+
+template <typename T = void>
+void *alloc_ptr_array(size_t n) {
+    READONLY_FORBIDDEN(alloc_ptr_array);
+    return nullptr;
+}
+
+template <typename T = void>
+void free_ptr_array(void *ptr) {
+    READONLY_FORBIDDEN(free_ptr_array);
+}
+
+template <typename T = void>
+void *alloc_ctl(size_t size) {
+    READONLY_FORBIDDEN(alloc_ctl);
+    return nullptr;
+}
+
+template <typename T = void>
+void free_ctl(void *ptr) {
+    READONLY_FORBIDDEN(free_ctl);
+}
+
+template <typename T>
+T *shadow_init(T *ptr) {
+    READONLY_FORBIDDEN(shadow_init);
+    return ptr;
+}
+
+template <typename T>
+void shadow_commit(const T *shadow, T *real) {
+    READONLY_FORBIDDEN(shadow_commit);
+}
+
+template <typename T>
+void shadow_destroy(const T *shadow) {
+    READONLY_FORBIDDEN(shadow_destroy);
+}
+
+template <typename T>
+void store_obj(T *dst, const T *src) {
+    READONLY_FORBIDDEN(store_obj);
+}
+
+template <typename T = void>
+void store_ptr(const void *ptr, const void *val) {
+    READONLY_FORBIDDEN(store_ptr);
+}
+
+#undef READONLY_FORBIDDEN
+
+}  // namespace readonly_forbidden
+
+namespace app_readonly {
+
+using namespace ::scee;
+
+using namespace ::readonly_forbidden;
+
+inline const void *load_ptr(const void *ptr) {
+    const void *stored = *((const void **)ptr);
+    append_log_typed(stored);
+    readonly_trace.fold(ptr, stored);
+    return stored;
+}
+
+inline constexpr bool is_validator() { return false; }
+
+inline constexpr bool is_raw() { return false; }
+
+template <typename T>
+inline T external_return(T val) {
+    append_log_typed(val);
+    return val;
+}
+
+}  // namespace app_readonly
+
+namespace validator_readonly {
+
+using namespace ::scee;
+
+using namespace ::readonly_forbidden;
+
+inline const void *load_ptr(const void *ptr) {
+    const void *stored;
+    readonly_trace.consume(sizeof(stored));
+    log_reader.fetch_log_typed(&stored);
+    readonly_trace.fold(ptr, stored);
+    return stored;
+}
+
+inline constexpr bool is_validator() { return true; }
+
+inline constexpr bool is_raw() { return false; }
+
+template <typename T>
+inline T external_return(T val) {
+    readonly_trace.consume(sizeof(val));
+    log_reader.fetch_log_typed(&val);
+    return val;
+}
+
+}  // namespace validator_readonly
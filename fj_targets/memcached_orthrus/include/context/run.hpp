@@ -4,6 +4,7 @@
 
 #include "checksum.hpp"
 #include "free_log.hpp"
+#include "load_cache.hpp"
 #include "log.hpp"
 #include "memmgr.hpp"
 
@@ -26,7 +27,24 @@ inline void *alloc_ptr() {
     return ptr;
 }
 
-inline void free_ptr(void *ptr) { free_mutable(ptr); }
+inline void free_ptr(void *ptr) { thread_gc_instance.free_log.push(ptr); }
+
+inline void *alloc_ptr_array(size_t n) {
+    append_log_typed(n);
+    void *ptr = alloc_mutable_zeroed(n * sizeof(void *));
+    append_log_typed(ptr);
+    return ptr;
+}
+
+inline void free_ptr_array(void *ptr) { thread_gc_instance.free_log.push(ptr); }
+
+inline void *alloc_ctl(size_t size) {
+    void *ptr = alloc_mutable_zeroed(size);
+    append_log_typed(ptr);
+    return ptr;
+}
+
+inline void free_ctl(void *ptr) { free_mutable(ptr); }
 
 template <typename T>
 inline void destroy_obj(T *obj) {
@@ -58,9 +76,14 @@ inline void store_obj(T *dst, const T *src) {
 }
 
 inline const void *load_ptr(const void *ptr) {
+    if constexpr (ENABLE_LOAD_CACHE) {
+        const auto *cached = load_cache.lookup(ptr);
+        if (cached != nullptr) return cached->val;
+    }
     append_log_typed(ptr);
     const void *stored = *((const void **)ptr);
     append_log_typed(stored);
+    if constexpr (ENABLE_LOAD_CACHE) load_cache.insert(ptr, stored);
     return stored;
 }
 
@@ -68,8 +91,17 @@ inline void store_ptr(const void *ptr, const void *val) {
     append_log_typed(ptr);
     append_log_typed(val);
     *((const void **)ptr) = val;
+    if constexpr (ENABLE_LOAD_CACHE) load_cache.insert(ptr, val);
 }
 
-inline bool is_validator() { return false; }
+inline constexpr bool is_validator() { return false; }
+
+inline constexpr bool is_raw() { return false; }
+
+template <typename T>
+inline T external_return(T val) {
+    append_log_typed(val);
+    return val;
+}
 
 }  // namespace app
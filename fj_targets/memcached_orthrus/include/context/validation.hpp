@@ -4,6 +4,7 @@
 
 #include "assertion.hpp"
 #include "checksum.hpp"
+#include "load_cache.hpp"
 #include "log.hpp"
 #include "memmgr.hpp"
 
@@ -33,6 +34,23 @@ inline void *alloc_ptr() {
 
 inline void free_ptr(void *ptr) {}
 
+inline void *alloc_ptr_array(size_t n) {
+    log_reader.cmp_log_typed(n);
+    void *ptr;
+    log_reader.fetch_log_typed(&ptr);
+    return ptr;
+}
+
+inline void free_ptr_array(void *ptr) {}
+
+inline void *alloc_ctl(size_t size) {
+    void *ptr;
+    log_reader.fetch_log_typed(&ptr);
+    return ptr;
+}
+
+inline void free_ctl(void *ptr) {}
+
 constexpr size_t SHADOW_BUFFER_SIZE = 4096;
 
 template <typename T>
@@ -72,17 +90,32 @@ inline void store_obj(T *dst, const T *src) {
 }
 
 inline const void *load_ptr(const void *ptr) {
+    // mirror the app-side cache, so that hits do not consume the log
+    if constexpr (ENABLE_LOAD_CACHE) {
+        const auto *cached = load_cache.lookup(ptr);
+        if (cached != nullptr) return cached->val;
+    }
     log_reader.cmp_log_typed(ptr);
     const void *stored;
     log_reader.fetch_log_typed(&stored);
+    if constexpr (ENABLE_LOAD_CACHE) load_cache.insert(ptr, stored);
     return stored;
 }
 
 inline void store_ptr(const void *ptr, const void *val) {
     log_reader.cmp_log_typed(ptr);
     log_reader.cmp_log_typed(val);
+    if constexpr (ENABLE_LOAD_CACHE) load_cache.insert(ptr, val);
 }
 
-inline bool is_validator() { return true; }
+inline constexpr bool is_validator() { return true; }
+
+inline constexpr bool is_raw() { return false; }
+
+template <typename T>
+inline T external_return(T val) {
+    log_reader.fetch_log_typed(&val);
+    return val;
+}
 
 }  // namespace validator
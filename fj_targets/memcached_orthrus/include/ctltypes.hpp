@@ -1,9 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <thread>
 
+#include "compiler.hpp"
 #include "context.hpp"
 #include "namespace.hpp"
+#include "utils.hpp"
 
 namespace scee {
 using namespace NAMESPACE;
@@ -34,6 +37,45 @@ public:
     ~lock_guard_t() { mtx->unlock(); }
 };
 
+/**
+ * A cacheline-padded sequence lock, in non-versioned memory.
+ * Writers hold it exclusively and make the sequence odd while writing.
+ * Readers do not block writers: they retry if the sequence is odd or has
+ * changed. This struct does not log anything; to let the validator replay
+ * the same retries, pass the sequences read through external_return().
+ */
+struct alignas(CACHELINE_SIZE) seqlock_t {
+    std::atomic<uint64_t> seq;
+    seqlock_t() : seq(0) {}
+    // wait until no writer holds the lock, return the sequence
+    uint64_t read_begin() const {
+        while (true) {
+            uint64_t s = seq.load(std::memory_order_acquire);
+            if (likely((s & 1) == 0)) return s;
+            cpu_relax();
+        }
+    }
+    // return the current sequence, to compare with the one at read_begin()
+    uint64_t read_end() const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed);
+    }
+    void write_lock() {
+        while (true) {
+            uint64_t s = seq.load(std::memory_order_relaxed);
+            if ((s & 1) == 0 &&
+                seq.compare_exchange_weak(s, s + 1,
+                                          std::memory_order_acquire)) {
+                std::atomic_thread_fence(std::memory_order_release);
+                return;
+            }
+            cpu_relax();
+        }
+    }
+    void write_unlock() { seq.fetch_add(1, std::memory_order_release); }
+};
+static_assert(sizeof(seqlock_t) == CACHELINE_SIZE);
+
 template <typename T>
 struct mutable_list_t {
     T *v;
@@ -41,7 +83,12 @@ struct mutable_list_t {
     mutable_list_t() : v(nullptr), length(0) {}
     mutable_list_t(T *v, size_t length) : v(v), length(length) {}
     static mutable_list_t<T> create(size_t size) {
-        T *v = (T *)alloc_mutable(size * sizeof(T));
+        T *v;
+        if constexpr (alignof(T) > alignof(std::max_align_t)) {
+            v = (T *)alloc_mutable_aligned(alignof(T), size * sizeof(T));
+        } else {
+            v = (T *)alloc_mutable(size * sizeof(T));
+        }
         for (size_t i = 0; i < size; i++) new (&v[i]) T();
         return mutable_list_t<T>(v, size);
     }
@@ -2,8 +2,12 @@
 
 #include <vector>
 
+#include "compiler.hpp"
+#include "ctltypes.hpp"
+#include "load_cache.hpp"
 #include "memmgr.hpp"
 #include "ptr.hpp"
+#include "spin_lock.hpp"
 
 namespace scee {
 using namespace NAMESPACE;
@@ -96,8 +100,401 @@ public:
     }
 };
 
-// Optional: create a continuous piece of memory for a mut_array_t
-// Pro: faster edit of the array
-// Con: not being able to detect the error of writing address flipped
+/**
+ * 1-D array of mutable cells in one continuous piece of memory.
+ * Same usage as mut_array_t, but the ptr_t<T> cells are stored inline in a
+ * single alloc_ptr_array() allocation, instead of one allocation per cell.
+ * Layout:
+ * | ref count | checksum | pointer to cells | length |
+ * | cell 0 | cell 1 | ... | cell length - 1 |  (mutable memory)
+ *
+ * In non-versioned memory, `cells` points to the initial values (T[length]),
+ * or is nullptr to initialize all cells to nullptr.
+ *
+ * A flipped index could make a store land in a neighbouring object, which is
+ * not covered by any checksum. All accesses go through at(), which checks the
+ * range before the cell address is used. The address itself is logged and
+ * compared by the validator, as for any other ptr_t.
+ */
+template <typename T>
+class flat_mut_array_t : public imm_nonunique_t {
+    static_assert(sizeof(ptr_t<T>) == sizeof(void *));
+
+public:
+    ptr_t<T> *cells;
+    size_t length;
+    flat_mut_array_t(void *data, size_t length)
+        : cells((ptr_t<T> *)data), length(length) {}
+    size_t size() const { return sizeof(*this); }
+    void write_at(void *shadow, void *real, size_t size) const {
+        auto *vec = (ptr_t<T> *)alloc_ptr_array(this->length);
+        *(flat_mut_array_t<T> *)shadow = flat_mut_array_t<T>(vec, this->length);
+        // cells are initialized to nullptr by alloc_ptr_array()
+        const T *v_data = (const T *)this->cells;
+        if (v_data != nullptr) {
+            for (size_t i = 0; i < this->length; i++) {
+                store_ptr(&vec[i], ptr_t<T>::make_obj(v_data[i]));
+            }
+        }
+    }
+    // called before actually destroying an object
+    void destroy() const {
+        for (size_t i = 0; i < this->length; i++) {
+            const T *old = cells[i].load();
+            if (old != nullptr) destroy_obj(const_cast<T *>(old));
+        }
+        free_ptr_array(cells);
+    }
+    // at, load and store only work for arrays reside in versioned memory
+    ptr_t<T> *at(size_t index) const {
+        validator_assert(index < this->length);
+        return &cells[index];
+    }
+    const T *load(size_t index) const { return at(index)->load(); }
+    void store(size_t index, const T &value) const { at(index)->store(value); }
+};
+
+/**
+ * A concurrent hash map of immutable entries: chained buckets in
+ * flat_mut_array_t tables, guarded by striped seqlocks, resized
+ * incrementally. The map only links, unlinks and moves entries; what an
+ * entry holds is up to its type. Entry provides:
+ * - `uint32_t hash` and `fixed_ptr_t<Entry> next`;
+ * - `Entry(const Entry *entry, fixed_ptr_t<Entry> next)`, a copy of entry
+ *   linked onto next, that takes over whatever entry owns;
+ * - `bool matches(const K &key, uint32_t hash) const`, for locate();
+ * - destroy(), called by destroy() for the entries left in the map.
+ *
+ * The map is not an object of its own: embed it in an immutable object (see
+ * hashmap_t in benchmarks/redis). Its counters live in non-versioned control
+ * memory (alloc_ctl()), and only decide when to resize.
+ *
+ * Buckets are guarded by striped seqlocks (the low bits of the hash), and
+ * nstripes and every capacity are powers of two, capacity >= nstripes: the
+ * stripe of a key covers both its old and its new bucket. Writers hold the
+ * stripe with a stripe_guard_t; readers go through read(), which does not
+ * lock, and retries if the stripe sequence changed during the lookup.
+ * Sequences go through external_return(), so the validator replays the
+ * retries.
+ *
+ * Resize is incremental: `buckets` is replaced by a new table, the old one
+ * moves to `old_buckets`, and each resize_step() moves the next RESIZE_STEP
+ * entries, from the head of the chain at `cursor` on. Until that chain is
+ * empty, the keys of a bucket are split between it and the new table, and
+ * are looked up in both; new keys go to the new table. An emptied bucket is
+ * set to moved().
+ */
+template <typename Entry>
+class versioned_hash_map {
+public:
+    using table_t = flat_mut_array_t<Entry>;
+    static constexpr size_t DEFAULT_STRIPES = 1 << 12;
+    // entries moved (or emptied buckets passed) by one resize_step(): its
+    // log grows with entries, not with buckets
+    static constexpr size_t RESIZE_STEP = 16;
+
+    // a writer on a stripe, not needed by the validator. Nested, so that it
+    // is instantiated per context, with the Entry of that context
+    class stripe_guard_t {
+    private:
+        seqlock_t *stripe;
+
+    public:
+        explicit stripe_guard_t(seqlock_t *stripe) : stripe(stripe) {
+            if constexpr (!is_validator()) stripe->write_lock();
+        }
+        ~stripe_guard_t() {
+            if constexpr (!is_validator()) stripe->write_unlock();
+        }
+    };
+
+    // a chain that may hold a key, and its first entry
+    struct chain_t {
+        ptr_t<Entry> *head;
+        const Entry *first;
+    };
+    // where a key is, or would be inserted
+    struct slot_t {
+        chain_t chains[2];
+        int n;
+        int chain;           // index of the chain of entry
+        const Entry *entry;  // nullptr if the key is not in the map
+        // new keys go to the chain of the current table
+        const chain_t &last() const { return chains[n - 1]; }
+    };
+
+    size_t nstripes;
+    size_t min_capacity;
+    ptr_t<table_t> *buckets;
+    ptr_t<table_t> *old_buckets;
+    ptr_t<size_t> *cursor;
+    mutable_list_t<seqlock_t> stripes;
+
+    versioned_hash_map() {
+        nstripes = min_capacity = 0;
+        buckets = old_buckets = nullptr;
+        cursor = nullptr;
+        ctl = nullptr;
+    }
+
+    // nstripes is rounded up to a power of two, and capacity to
+    // nstripes * 2^k; capacity never shrinks below that
+    static versioned_hash_map make(size_t capacity,
+                                   size_t nstripes = DEFAULT_STRIPES) {
+        versioned_hash_map map;
+        map.nstripes = 1;
+        while (map.nstripes < nstripes) map.nstripes <<= 1;
+        size_t cap = map.nstripes;
+        while (cap < capacity) cap <<= 1;
+        map.min_capacity = cap;
+        map.buckets = ptr_t<table_t>::create(table_t(nullptr, cap));
+        map.old_buckets = ptr_t<table_t>::create();
+        map.cursor = ptr_t<size_t>::create(size_t{0});
+        map.stripes = mutable_list_t<seqlock_t>::create(map.nstripes);
+        map.ctl = new (alloc_ctl(sizeof(ctl_t))) ctl_t();
+        map.ctl->capacity = cap;
+        return map;
+    }
+
+    // destroy the entries left in the map, then the map
+    void destroy() const {
+        const table_t *old = old_buckets->load();
+        if (old != nullptr) destroy_table(old, true);
+        destroy_table(buckets->load(), true);
+        destroy_obj(const_cast<size_t *>(cursor->load()));
+        buckets->destroy();
+        old_buckets->destroy();
+        cursor->destroy();
+        stripes.destroy();
+        if constexpr (!is_validator()) ctl->~ctl_t();
+        free_ctl(ctl);
+    }
+
+    // the stripe of a hash, or of a bucket of any table
+    seqlock_t *stripe_of(size_t hash) const {
+        return &stripes.v[hash & (nstripes - 1)];
+    }
+
+    // the caller holds stripe_of(hash), or reads through read()
+    template <typename K>
+    slot_t locate(const K &key, uint32_t hash) const {
+        slot_t slot;
+        slot.n = chains_of(hash, slot.chains);
+        for (slot.chain = 0; slot.chain < slot.n; ++slot.chain) {
+            for (slot.entry = slot.chains[slot.chain].first;
+                 slot.entry != nullptr; slot.entry = slot.entry->next.get()) {
+                if (slot.entry->matches(key, hash)) return slot;
+            }
+        }
+        slot.entry = nullptr;
+        return slot;
+    }
+
+    /**
+     * Run fn(), a lookup under stripe_of(hash), without holding the stripe.
+     * Objects read by fn() are freed through the free log, after the closure
+     * is validated: a racing writer can not make them dangle. Raw frees them
+     * immediately, and holds the stripe instead.
+     */
+    template <typename Fn>
+    auto read(uint32_t hash, Fn fn) const {
+        seqlock_t *stripe = stripe_of(hash);
+        if constexpr (is_raw()) {
+            stripe_guard_t guard(stripe);
+            return fn();
+        }
+        // a retry has to load what the writer stored, not the cached pointers
+        LoadCacheBypass bypass;
+        while (true) {
+            uint64_t seq = 0;
+            if constexpr (!is_validator()) seq = stripe->read_begin();
+            seq = external_return(seq);
+            auto ret = fn();
+            uint64_t end = 0;
+            if constexpr (!is_validator()) end = stripe->read_end();
+            if (likely(external_return(end) == seq)) return ret;
+        }
+    }
+
+    // the caller holds the stripe of the key of entry, and made it with
+    // slot.last().first as its next
+    void insert(const slot_t &slot, const Entry *entry) const {
+        slot.last().head->reref(entry);
+        if constexpr (!is_validator()) ctl->count++;
+    }
+
+    // unlink slot.entry, which the caller then frees
+    void remove(const slot_t &slot) const {
+        const chain_t &chain = slot.chains[slot.chain];
+        remove(chain.head, chain.first, slot.entry);
+    }
+
+    // unlink target from the chain at head, see remove(const slot_t &)
+    void remove(ptr_t<Entry> *head, const Entry *first,
+                const Entry *target) const {
+        // entries are immutable: the ones before target are copied
+        fixed_ptr_t<Entry> next = unlink(first, target);
+        head->reref(next.get());
+        // freed through the free log, after readers of the old chain
+        // validate; the copies take over what they own
+        for (const Entry *e = first; e != target;) {
+            const Entry *enext = e->next.get();
+            free_obj(const_cast<Entry *>(e));
+            e = enext;
+        }
+        if constexpr (!is_validator()) ctl->count--;
+    }
+
+    // the current table, the only one while resizing() is false
+    const table_t *table() const { return buckets->load(); }
+
+    bool resizing() const { return old_buckets->load() != nullptr; }
+
+    // run fn() unless a resize_step() or another exclusive() runs: fn() may
+    // then index the current table across closures
+    template <typename Fn>
+    bool exclusive(Fn fn) const {
+        bool locked = false;
+        if constexpr (!is_validator()) locked = ctl->resize_lock.TryLock();
+        if (!external_return(locked)) return false;
+        bool busy = fn();
+        if constexpr (!is_validator()) ctl->resize_lock.Unlock();
+        return busy;
+    }
+
+    // called outside closures: only reads non-versioned data
+    bool resize_due() const {
+        if (ctl->resizing) return true;
+        size_t count = ctl->count, capacity = ctl->capacity;
+        return count > capacity ||
+               (count < capacity / 4 && capacity > min_capacity);
+    }
+
+    // migrate the next entries, or start a resize if one is due; return
+    // false if there is nothing to do
+    bool resize_step() const {
+        return exclusive([this] {
+            if (!resizing()) return start_resize();
+            migrate();
+            return true;
+        });
+    }
+
+    // called outside closures
+    size_t count() const { return ctl->count; }
+
+private:
+    struct ctl_t {
+        SpinLock resize_lock;
+        std::atomic<size_t> count;     // number of entries
+        std::atomic<size_t> capacity;  // length of the current table
+        std::atomic<bool> resizing;
+    };
+    ctl_t *ctl;
+
+    static const Entry *moved() {
+        return reinterpret_cast<const Entry *>(uintptr_t{1});
+    }
+
+    // fill the chains of a hash, the one of the current table last
+    int chains_of(uint32_t hash, chain_t chains[2]) const {
+        // load buckets first: a resize publishes old_buckets before buckets
+        const table_t *cur = buckets->load();
+        const table_t *old = old_buckets->load();
+        int n = 0;
+        if (old != nullptr) {
+            ptr_t<Entry> *head = old->at(hash & (old->length - 1));
+            const Entry *first = head->load();
+            if (first != moved()) chains[n++] = {head, first};
+        }
+        ptr_t<Entry> *head = cur->at(hash & (cur->length - 1));
+        chains[n++] = {head, head->load()};
+        return n;
+    }
+
+    bool start_resize() const {
+        const table_t *cur = buckets->load();
+        size_t count = 0;
+        if constexpr (!is_validator()) count = ctl->count;
+        count = external_return(count);
+        // grow at load factor 1, shrink at 1/4
+        size_t cap = cur->length;
+        if (count > cap) {
+            cap *= 2;
+        } else if (count < cap / 4 && cap > min_capacity) {
+            cap /= 2;
+        } else {
+            return false;
+        }
+        const table_t *next = ptr_t<table_t>::make_obj(table_t(nullptr, cap));
+        old_buckets->reref(cur);
+        buckets->reref(next);
+        cursor->store(size_t{0});
+        if constexpr (!is_validator()) {
+            ctl->capacity = cap;
+            ctl->resizing = true;
+        }
+        return true;
+    }
+
+    void migrate() const {
+        const table_t *from = old_buckets->load();
+        const table_t *to = buckets->load();
+        size_t i = *cursor->load();
+        for (size_t work = 0; work < RESIZE_STEP && i < from->length; ++work) {
+            // all keys of bucket i share this stripe, in both tables
+            stripe_guard_t guard(stripe_of(i));
+            ptr_t<Entry> *bucket = from->at(i);
+            const Entry *entry = bucket->load();
+            if (entry == nullptr) {
+                bucket->reref(moved());
+                ++i;
+                continue;
+            }
+            // move the head of the chain: the rest of it stays linked
+            ptr_t<Entry> *head = to->at(entry->hash & (to->length - 1));
+            fixed_ptr_t<Entry> next(head->load());
+            head->reref(ptr_t<Entry>::make_obj(Entry(entry, next)));
+            bucket->reref(entry->next.get());
+            // the copy took over what the entry owns, only free the entry
+            free_obj(const_cast<Entry *>(entry));
+        }
+        if (i < from->length) {
+            cursor->store(i);
+            return;
+        }
+        old_buckets->reref(nullptr);
+        if constexpr (!is_validator()) ctl->resizing = false;
+        // wait for raw readers that may still read `from` under a stripe
+        if constexpr (is_raw()) {
+            for (size_t s = 0; s < nstripes; ++s) {
+                stripe_guard_t guard(&stripes.v[s]);
+            }
+        }
+        destroy_table(from, false);
+    }
+
+    // with_entries: also destroy the entries left in the table
+    static void destroy_table(const table_t *table, bool with_entries) {
+        for (size_t i = 0; with_entries && i < table->length; ++i) {
+            const Entry *entry = table->load(i);
+            if (entry == moved()) continue;
+            while (entry != nullptr) {
+                const Entry *enext = entry->next.get();
+                destroy_obj(const_cast<Entry *>(entry));
+                entry = enext;
+            }
+        }
+        free_ptr_array(table->cells);
+        free_obj(const_cast<table_t *>(table));
+    }
+
+    // copy the chain from `entry` to `target`, excluding target, onto its next
+    static fixed_ptr_t<Entry> unlink(const Entry *entry, const Entry *target) {
+        if (entry == target) return target->next;
+        fixed_ptr_t<Entry> next = unlink(entry->next.get(), target);
+        return fixed_ptr_t<Entry>(ptr_t<Entry>::make_obj(Entry(entry, next)));
+    }
+};
 
 }  // namespace scee
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "compiler.hpp"
+#include "utils.hpp"
+
+namespace scee {
+
+#ifdef LOAD_CACHE
+constexpr bool ENABLE_LOAD_CACHE = true;
+#else
+constexpr bool ENABLE_LOAD_CACHE = false;
+#endif
+
+/**
+ * A small direct-mapped cache of ptr_t loads, valid within one closure.
+ *
+ * The app thread logs a (ptr, value) pair only on the first load of a ptr_t
+ * in a closure; later loads of the same ptr_t are served from this cache.
+ * The validator keeps its own instance and feeds it with the same sequence of
+ * loads and stores, so a hit at run() is also a hit at validation, and both
+ * sides consume the log identically.
+ *
+ * Stores update the cached value, so a closure always observes its own writes.
+ * Loads racing with stores from other threads are NOT observed after the first
+ * load. Only enable this (-DLOAD_CACHE) when each ptr_t is protected by a lock
+ * for the whole closure, or when a snapshot read is acceptable.
+ *
+ * Entries are tagged with an epoch, so reset() at closure start is O(1).
+ * Each log has its own cache, see LoadCacheStack.
+ */
+struct LoadCache {
+    static constexpr size_t SIZE = 64;
+    static_assert(is_power_of_2(SIZE));
+
+    struct Entry {
+        const void *addr;
+        const void *val;
+        uint64_t epoch;
+    };
+
+    Entry entries[SIZE] = {};
+    uint64_t epoch = 1;
+
+    static size_t index(const void *addr) {
+        return (reinterpret_cast<uintptr_t>(addr) >> 3) & (SIZE - 1);
+    }
+
+    void reset() { epoch++; }
+
+    // return the entry if `addr` has been loaded or stored in this closure
+    const Entry *lookup(const void *addr) const {
+        const Entry *e = &entries[index(addr)];
+        if (e->epoch == epoch && e->addr == addr) return e;
+        return nullptr;
+    }
+
+    // a conflicting entry is simply replaced
+    void insert(const void *addr, const void *val) {
+        entries[index(addr)] = {addr, val, epoch};
+    }
+};
+
+/**
+ * The caches of the logs in use by a thread, the innermost closure last.
+ *
+ * A nested closure gets a cache of its own, so that it neither resets nor
+ * evicts the entries of its caller: each log is validated on its own, with
+ * a fresh cache that sees only the loads of that log. A validator thread
+ * only uses the first cache.
+ *
+ * Inside a LoadCacheBypass, loads are neither served from nor added to the
+ * cache. The app and the validator run the same code, so they bypass the
+ * same loads.
+ */
+struct LoadCacheStack {
+    std::vector<LoadCache> caches = std::vector<LoadCache>(1);
+    size_t depth = 0;
+    int bypass = 0;
+
+    LoadCache &top() { return caches[depth]; }
+
+    // a closure starts, nested in the one of the current log if `nested`
+    void enter(bool nested) {
+        if (nested && ++depth == caches.size()) caches.emplace_back();
+        caches[depth].reset();
+    }
+
+    // the closure is done, and the caller's log is resumed if `nested`
+    void leave(bool nested) {
+        if (nested) depth--;
+    }
+
+    const LoadCache::Entry *lookup(const void *addr) {
+        return bypass ? nullptr : top().lookup(addr);
+    }
+
+    void insert(const void *addr, const void *val) {
+        if (!bypass) top().insert(addr, val);
+    }
+};
+
+// one instance per app thread, and one per validator thread
+extern thread_local LoadCacheStack load_cache;
+
+/**
+ * Reads that must observe other threads' stores, such as a seqlock read
+ * section that retries until it saw no writer, skip the cache while this is
+ * in scope.
+ */
+class LoadCacheBypass {
+public:
+    LoadCacheBypass() {
+        if constexpr (ENABLE_LOAD_CACHE) load_cache.bypass++;
+    }
+    ~LoadCacheBypass() {
+        if constexpr (ENABLE_LOAD_CACHE) load_cache.bypass--;
+    }
+    LoadCacheBypass(const LoadCacheBypass &) = delete;
+    LoadCacheBypass &operator=(const LoadCacheBypass &) = delete;
+};
+
+}  // namespace scee
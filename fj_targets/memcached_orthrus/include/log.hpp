@@ -14,6 +14,7 @@
 #include "assertion.hpp"
 #include "compiler.hpp"
 #include "free_log.hpp"
+#include "load_cache.hpp"
 #include "memmgr.hpp"
 #include "queue.hpp"
 #include "spin_lock.hpp"
@@ -214,7 +215,8 @@ inline Log *get_current_log() { return &get_thread_log_manager()->current_log; }
 inline void new_log() {
     auto *manager = get_thread_log_manager();
     // if there is already a log in use, stash it
-    if (manager->current_log.head) {
+    bool nested = manager->current_log.head != nullptr;
+    if (nested) {
         manager->caller_logs.push(manager->current_log);
     }
     // allocate a new log
@@ -223,6 +225,7 @@ inline void new_log() {
     log->gc_tsc = closure_start_log.new_closure();
     manager->current_log.head = log;
     manager->current_log.cursor = add_byte_offset(log, sizeof(LogHead));
+    load_cache.enter(nested);
 }
 
 template <size_t Size>
@@ -262,6 +265,24 @@ inline auto append_log_typed(T &&data) {
     return static_cast<const U *>(dst);
 }
 
+// copy a variable-length payload into the log, return where it is
+// the size comes from the caller: unlike the fixed-size appends, it is
+// always checked, before the copy, to leave room for the LogTail
+inline const void *append_log_bytes(const void *data, size_t size) {
+    auto *log = get_current_log();
+    void *dst = log->cursor;
+    size_t aligned = (size + 7) & ~size_t{7};
+    size_t length = ptr_distance(log->head, dst) + aligned + sizeof(LogTail);
+    if (unlikely(length > MIN_LOG_BUFFER_SIZE)) {
+        fprintf(stderr, "Error: log length %zu exceeded the limit %lu\n",
+                length, MIN_LOG_BUFFER_SIZE);
+        std::abort();
+    }
+    memcpy(dst, data, size);
+    log->cursor = add_byte_offset(dst, aligned);
+    return dst;
+}
+
 inline void commit_log() {
     auto *manager = get_thread_log_manager();
     auto log = manager->current_log;
@@ -272,6 +293,16 @@ inline void commit_log() {
     *log_tail = {.length = log_length, .magic = LogTail::MAGIC};
     manager->allocator.commit(log.head);
     log_enqueue(log.head);
+    // resume the caller's log, if any; otherwise the next new_log() would
+    // stash this committed log, and caller_logs grows by one per closure
+    bool nested = !manager->caller_logs.empty();
+    if (nested) {
+        manager->current_log = manager->caller_logs.top();
+        manager->caller_logs.pop();
+    } else {
+        manager->current_log.head = nullptr;
+    }
+    load_cache.leave(nested);
 }
 
 class LogReader {
@@ -318,6 +349,15 @@ public:
         cursor = add_byte_offset(cursor, AlignedSize);
     }
 
+    inline void skip(size_t size) {
+        cursor = add_byte_offset(cursor, (size + 7) & ~size_t{7});
+    }
+
+    // bytes left before the LogTail
+    inline size_t remaining() const {
+        return log->length - sizeof(LogTail) - ptr_distance(log, cursor);
+    }
+
     template <typename T>
     inline const T *peek() {
         return static_cast<const T *>(cursor);
@@ -341,6 +381,31 @@ private:
     void *cursor = nullptr;
 };
 
+/**
+ * A variable-length closure argument, e.g. a key or a value.
+ * The bytes are copied into the log after the closure (see log_arg()), and
+ * `data` points to that copy: the log grows with the payload, and the bytes
+ * stay valid until the closure has been validated.
+ */
+struct bytes_t {
+    const char *data;
+    size_t len;
+};
+
+template <typename T>
+inline T log_arg(T arg) {
+    if constexpr (std::is_same_v<T, bytes_t>) {
+        arg.data =
+            static_cast<const char *>(append_log_bytes(arg.data, arg.len));
+    }
+    return arg;
+}
+
+template <typename T>
+inline void skip_arg(LogReader *reader, const T &arg) {
+    if constexpr (std::is_same_v<T, bytes_t>) reader->skip(arg.len);
+}
+
 // for validator threads
 // TODO(quanxi): merge this with thread_log_manager
 extern thread_local LogReader log_reader;
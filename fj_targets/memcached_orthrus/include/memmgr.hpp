@@ -52,6 +52,14 @@ inline void *alloc_mutable(size_t size) {
     // OPTIONAL: optimize this for fixed size allocation (like ptr_t)
     return malloc(size);
 }
+// same as alloc_mutable(), but the memory piece is filled with zeros
+inline void *alloc_mutable_zeroed(size_t size) { return calloc(1, size); }
+// same as alloc_mutable(), for pieces aligned beyond malloc, like cachelines
+// size must be a multiple of align
+inline void *alloc_mutable_aligned(size_t align, size_t size) {
+    return std::aligned_alloc(align, size);
+}
+
 // ptr correspond to the start of the whole memory piece
 inline void free_mutable(void *ptr) {
     // OPTIONAL: optimize this for fixed size allocation (like ptr_t)
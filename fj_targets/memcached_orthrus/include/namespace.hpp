@@ -3,3 +3,11 @@
 #ifndef NAMESPACE
 #define NAMESPACE raw
 #endif
+
+// IS_READONLY_CONTEXT: NAMESPACE is a read-only context, see
+// context/readonly_run.hpp
+#define SCEE_READONLY_app_readonly 1
+#define SCEE_READONLY_validator_readonly 1
+#define SCEE_CONCAT_(a, b) a##b
+#define SCEE_CONCAT(a, b) SCEE_CONCAT_(a, b)
+#define IS_READONLY_CONTEXT SCEE_CONCAT(SCEE_READONLY_, NAMESPACE)
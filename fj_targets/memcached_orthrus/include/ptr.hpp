@@ -64,6 +64,7 @@ public:
     ptr_t<T> &operator=(const ptr_t<T> &) = delete;
 
     // we should only load each ptr once in each closure
+    // (or build with LOAD_CACHE to log repeated loads only once)
     const T *load() const {
         const T *p = (const T *)load_ptr(this);
         return p;
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <x86intrin.h>
+
+#include <cstdint>
+#include <type_traits>
+
+#include "assertion.hpp"
+#include "memtypes.hpp"
+
+namespace scee {
+
+/**
+ * State of a read-only closure started by run_readonly().
+ *
+ * A read-only closure is compiled in the app_readonly and validator_readonly
+ * contexts (see context/readonly_run.hpp), which have no store or allocation.
+ * load_ptr() logs only the loaded value, and folds the address and the value
+ * into `hash` instead of logging the address: a load costs 8 log bytes
+ * instead of 16. The validator re-executes the closure on the logged values,
+ * folds the addresses it computes, and compares the result and the hash with
+ * the log.
+ *
+ * `budget` is the number of log bytes left to the validator before the
+ * result: a validator that loads more than the app did fails, instead of
+ * reading the result as a value.
+ */
+struct ReadOnlyTrace {
+    checksum_t hash;
+    size_t budget;
+
+    void begin(size_t budget = 0) {
+        hash = ~0U;
+        this->budget = budget;
+    }
+
+    checksum_t end() { return ~hash; }
+
+    // validator: size bytes are about to be fetched from the log
+    void consume(size_t size) {
+        size = (size + 7) & ~size_t{7};
+        validator_assert(size <= budget);
+        budget -= size;
+    }
+
+    __attribute__((target("sse4.2"))) void fold(const void *ptr,
+                                                const void *val) {
+        hash = _mm_crc32_u64(hash, reinterpret_cast<uintptr_t>(ptr));
+        hash = _mm_crc32_u64(hash, reinterpret_cast<uintptr_t>(val));
+    }
+};
+
+extern thread_local ReadOnlyTrace readonly_trace;
+
+// arguments of a read-only closure: values, or pointers to const
+template <typename T>
+constexpr bool is_readonly_arg_v =
+    std::is_trivially_copyable_v<T> &&
+    (!std::is_pointer_v<T> || std::is_const_v<std::remove_pointer_t<T>>);
+
+}  // namespace scee
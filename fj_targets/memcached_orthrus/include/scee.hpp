@@ -6,6 +6,7 @@
 #include <utility>
 
 #include "log.hpp"
+#include "readonly.hpp"
 
 namespace scee {
 
@@ -27,8 +28,16 @@ struct Closure : public Validable {
 
     auto run_with_fn(Fn fn) const { return std::apply(fn, args); }
 
+    // skip the payloads logged after the closure, see log_arg()
+    void skip_args(LogReader *reader) const {
+        std::apply(
+            [reader](const Args &...arg) { (skip_arg(reader, arg), ...); },
+            args);
+    }
+
     void validate(LogReader *reader) const override {
         reader->template skip<sizeof(*this)>();
+        skip_args(reader);
         if constexpr (std::is_void_v<Ret>) {
             run();
         } else {
@@ -38,12 +47,23 @@ struct Closure : public Validable {
     }
 };
 
+// the closure is logged before the payloads of its arguments, which are
+// logged in order: braced initialization evaluates log_arg() left to right
+template <typename C, typename Fn, typename... Args>
+inline const C *append_closure(Fn fn, Args &&...args) {
+    constexpr size_t AlignedSize = (sizeof(C) + 7) & ~7;
+    auto *log = get_current_log();
+    void *dst = log->cursor;
+    log->cursor = add_byte_offset(dst, AlignedSize);
+    return new (dst) C{fn, log_arg(std::forward<Args>(args))...};
+}
+
 template <typename Ret, typename... Args>
 Ret run(Ret (*fn)(Args...), Args... args) {
     static_assert(std::is_trivial_v<Ret>);
     new_log();
-    const auto *func =
-        append_log_typed(Closure(fn, std::forward<Args>(args)...));
+    const auto *func = append_closure<Closure<Ret, Args...>>(
+        fn, std::forward<Args>(args)...);
     Ret ret = func->run();
     append_log_typed(ret);
     commit_log();
@@ -54,8 +74,8 @@ template <typename Ret, typename... Args>
 Ret run2(Ret (*app_fn)(Args...), Ret (*val_fn)(Args...), Args... args) {
     static_assert(std::is_void_v<Ret> || std::is_trivial_v<Ret>);
     new_log();
-    const auto *func =
-        append_log_typed(Closure(val_fn, std::forward<Args>(args)...));
+    const auto *func = append_closure<Closure<Ret, Args...>>(
+        val_fn, std::forward<Args>(args)...);
     if constexpr (std::is_void_v<Ret>) {
         func->run_with_fn(app_fn);
         commit_log();
@@ -72,8 +92,8 @@ Ret run2_profile(uint64_t &cycles, Ret (*app_fn)(Args...),
                  Ret (*val_fn)(Args...), Args... args) {
     static_assert(std::is_void_v<Ret> || std::is_trivial_v<Ret>);
     new_log();
-    const auto *func =
-        append_log_typed(Closure(val_fn, std::forward<Args>(args)...));
+    const auto *func = append_closure<Closure<Ret, Args...>>(
+        val_fn, std::forward<Args>(args)...);
     if constexpr (std::is_void_v<Ret>) {
         uint64_t start = _rdtsc();
         func->run_with_fn(app_fn);
@@ -89,6 +109,55 @@ Ret run2_profile(uint64_t &cycles, Ret (*app_fn)(Args...),
     }
 }
 
+/**
+ * A closure that only loads from ptr_t instances (see readonly.hpp).
+ * Log layout:
+ * | closure | payloads | loaded values | return value | hash |
+ */
+template <typename Ret, typename... Args>
+struct ReadOnlyClosure : public Closure<Ret, Args...> {
+    using Fn = typename Closure<Ret, Args...>::Fn;
+
+    explicit ReadOnlyClosure(Fn fn, Args &&...args)
+        : Closure<Ret, Args...>(fn, std::forward<Args>(args)...) {}
+
+    void validate(LogReader *reader) const override {
+        reader->template skip<sizeof(*this)>();
+        this->skip_args(reader);
+        // the logged values end where the return value starts
+        constexpr size_t trailer =
+            ((sizeof(Ret) + 7) & ~size_t{7}) + sizeof(uint64_t);
+        static_assert(sizeof(checksum_t) <= sizeof(uint64_t));
+        readonly_trace.begin(reader->remaining() - trailer);
+        auto ret = this->run();
+        checksum_t hash = readonly_trace.end();
+        validator_assert(readonly_trace.budget == 0);
+        reader->cmp_log_typed(ret);
+        reader->cmp_log_typed(hash);
+    }
+};
+
+// The functions must come from the app_readonly and validator_readonly
+// contexts (see context/readonly_run.hpp), where stores and allocations do not
+// compile. Top-level arguments must not be mutable pointers either.
+template <typename Ret, typename... Args>
+Ret run_readonly(Ret (*app_fn)(Args...), Ret (*val_fn)(Args...),
+                 Args... args) {
+    static_assert(std::is_trivial_v<Ret>);
+    static_assert((is_readonly_arg_v<Args> && ...),
+                  "read-only closures only take values or pointers to const");
+    new_log();
+    const auto *func = append_closure<ReadOnlyClosure<Ret, Args...>>(
+        val_fn, std::forward<Args>(args)...);
+    readonly_trace.begin();
+    Ret ret = func->run_with_fn(app_fn);
+    checksum_t hash = readonly_trace.end();
+    append_log_typed(ret);
+    append_log_typed(hash);
+    commit_log();
+    return ret;
+}
+
 void validate_one(LogHead *log);
 
 }  // namespace scee
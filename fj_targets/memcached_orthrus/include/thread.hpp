@@ -54,6 +54,11 @@ private:
 template <typename F, typename... Args>
 auto main_thread(F &&f, Args &&...args);
 
+// wait until the validator of this app thread has validated every closure it
+// committed, e.g. before freeing shared objects outside of closures: a
+// validator reads the objects its closure loaded
+void wait_validation();
+
 /* Internal Implementations */
 
 inline Thread::Thread() noexcept : thread() {}
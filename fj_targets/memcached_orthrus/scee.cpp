@@ -10,6 +10,7 @@ namespace scee {
 
 // queue.hpp
 thread_local LogQueue log_queue;
+thread_local uint64_t enqueued_logs;
 
 // free_log.hpp
 thread_local ThreadGC thread_gc_instance;
@@ -22,9 +23,16 @@ std::queue<void *> GlobalLogBufferAllocator::free_buffers;
 thread_local ThreadLogManager thread_log_manager;
 thread_local LogReader log_reader;
 
+// load_cache.hpp
+thread_local LoadCacheStack load_cache;
+
+// readonly.hpp
+thread_local ReadOnlyTrace readonly_trace;
+
 // scee.hpp
 void validate_one(LogHead *log) {
     log_reader.open(log);
+    load_cache.enter(false);
     const auto *validable = log_reader.peek<Validable>();
     validable->validate(&log_reader);
     log_reader.close();
@@ -33,8 +41,10 @@ void validate_one(LogHead *log) {
 // thread.hpp
 thread_local Thread validator_thread;
 thread_local std::atomic<bool> stop_validation;
+thread_local std::atomic<uint64_t> validated_logs;
 
-void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc) {
+void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc,
+              std::atomic<uint64_t> *validated) {
     app_thread_gc_instance = thread_gc;
     while (!stop) {
         auto *log = static_cast<LogHead *>(log_dequeue(queue));
@@ -43,13 +53,20 @@ void validate(LogQueue *queue, std::atomic<bool> &stop, ThreadGC *thread_gc) {
             continue;
         }
         validate_one(log);
+        validated->fetch_add(1, std::memory_order_release);
     }
 }
 
 void AppThread::register_queue() {
     LogQueue *queue = &log_queue;
-    validator_thread =
-        Thread(validate, queue, std::ref(stop_validation), &thread_gc_instance);
+    validator_thread = Thread(validate, queue, std::ref(stop_validation),
+                              &thread_gc_instance, &validated_logs);
+}
+
+void wait_validation() {
+    while (validated_logs.load(std::memory_order_acquire) != enqueued_logs) {
+        cpu_relax();
+    }
 }
 
 void AppThread::unregister_queue() {